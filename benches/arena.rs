@@ -0,0 +1,68 @@
+use redis_hyperloglog::{ArenaAlloc, HllColumn, MurmurHash64A};
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion};
+
+fn xorshift(state: &mut u64) -> u64 {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    *state
+}
+
+/// Random accesses over a large column, where 4 KiB pages miss the TLB on almost every access.
+pub fn bench_arena(c: &mut Criterion) {
+    let mut group = c.benchmark_group("arena");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+    group.sample_size(10);
+
+    // 12 KiB per sketch: 120 MiB and 1.2 GiB
+    let nums = [10_000, 100_000];
+
+    for n in nums {
+        for alloc in [ArenaAlloc::Global, ArenaAlloc::HugePages] {
+            let suffix = match alloc {
+                ArenaAlloc::Global => "4k",
+                ArenaAlloc::HugePages => "2m",
+            };
+            let mut column = HllColumn::with_alloc(MurmurHash64A, n, alloc);
+            let mut state = 0x9e37_79b9_7f4a_7c15_u64;
+            for _ in 0..n * 100 {
+                let g = xorshift(&mut state) as usize % n;
+                column.insert_hash(g, xorshift(&mut state));
+            }
+
+            // PFADD: one random register of a random sketch per element
+            group.bench_with_input(BenchmarkId::new(format!("pfadd-{suffix}"), n), &n, |b, _| {
+                b.iter(|| {
+                    let mut updated = false;
+                    for _ in 0..10_000 {
+                        let g = xorshift(&mut state) as usize % n;
+                        updated |= column.insert_hash(g, xorshift(&mut state));
+                    }
+                    updated
+                });
+            });
+
+            // PFCOUNT key1 ... key8 over random keys
+            group.bench_with_input(BenchmarkId::new(format!("pfcount-{suffix}"), n), &n, |b, _| {
+                b.iter(|| {
+                    let keys: [usize; 8] = std::array::from_fn(|_| xorshift(&mut state) as usize % n);
+                    column.union_count(black_box(&keys))
+                });
+            });
+
+            // PFMERGE dst key1 ... key8 over random keys
+            group.bench_with_input(BenchmarkId::new(format!("pfmerge-{suffix}"), n), &n, |b, _| {
+                b.iter(|| {
+                    let keys: [usize; 8] = std::array::from_fn(|_| xorshift(&mut state) as usize % n);
+                    column.merge_gather(keys[0], black_box(&keys[1..]));
+                });
+            });
+        }
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_arena);
+criterion_main!(benches);
@@ -0,0 +1,67 @@
+use redis_hyperloglog::{HllColumn, HyperLogLog};
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion};
+
+pub fn bench_column(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("column");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    let nums = [100, 1_000, 10_000];
+
+    for n in nums {
+        let mut column = HllColumn::new(n);
+        let mut hlls: Vec<HyperLogLog> = (0..n).map(|_| HyperLogLog::new()).collect();
+        for k in 0u64..(n as u64) * 100 {
+            let g = (k.wrapping_mul(0x9e37_79b9_7f4a_7c15) >> 32) as usize % n;
+            column.insert(g, &k.to_be_bytes());
+            hlls[g].insert(&k.to_be_bytes());
+        }
+
+        // every 7th group, e.g. the groups of one region
+        let gather: Vec<usize> = (0..n).step_by(7).collect();
+        let refs: Vec<&HyperLogLog> = gather.iter().map(|&g| &hlls[g]).collect();
+
+        group.bench_with_input(BenchmarkId::new("union-gather-column", n), &n, |b, _| {
+            b.iter(|| column.union_count(black_box(&gather)));
+        });
+        group.bench_with_input(BenchmarkId::new("union-gather-objects", n), &n, |b, _| {
+            b.iter(|| HyperLogLog::union_count(black_box(&refs)));
+        });
+
+        group.bench_with_input(BenchmarkId::new("merge-gather-column", n), &n, |b, _| {
+            b.iter(|| column.merge_gather(0, black_box(&gather)));
+        });
+
+        // merging invalidates the cached counts of the destination only,
+        // so the count benchmarks mostly measure streaming over the headers
+        group.bench_with_input(BenchmarkId::new("count-all-column", n), &n, |b, _| {
+            b.iter(|| column.count_all());
+        });
+        let all: Vec<&HyperLogLog> = hlls.iter().collect();
+        group.bench_with_input(BenchmarkId::new("count-many-objects", n), &n, |b, _| {
+            b.iter(|| HyperLogLog::count_many(black_box(&all)));
+        });
+
+        group.bench_with_input(BenchmarkId::new("insert-column", n), &n, |b, _| {
+            let mut k = 0u64;
+            b.iter(|| {
+                k += 1;
+                column.insert(k as usize % n, &k.to_le_bytes())
+            });
+        });
+        group.bench_with_input(BenchmarkId::new("insert-objects", n), &n, |b, _| {
+            let mut k = 0u64;
+            b.iter(|| {
+                k += 1;
+                hlls[k as usize % n].insert(&k.to_le_bytes())
+            });
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_column);
+criterion_main!(benches);
@@ -0,0 +1,46 @@
+use redis_hyperloglog::{HyperLogLog, MurmurHash64A, HLL_DENSE_LEN};
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion, Throughput};
+
+pub fn bench_compact(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("compact");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+    group.throughput(Throughput::Bytes(HLL_DENSE_LEN as u64));
+
+    let nums = [1_000, 100_000, 10_000_000];
+
+    for n in nums {
+        let mut hll = HyperLogLog::new();
+        for i in 0u64..n {
+            hll.insert(&i.to_be_bytes());
+        }
+        let encoded = hll.to_compact();
+
+        #[allow(clippy::cast_precision_loss)]
+        let ratio = HLL_DENSE_LEN as f64 / encoded.len() as f64;
+        println!(
+            "n: {n}, compact: {} bytes, dense: {HLL_DENSE_LEN} bytes, ratio: {ratio:.3}",
+            encoded.len()
+        );
+
+        for simd in [true, false] {
+            redis_hyperloglog::set_simd(simd);
+            let suffix = if simd { "simd" } else { "scalar" };
+
+            group.bench_with_input(BenchmarkId::new(format!("encode-{suffix}"), n), &n, |b, _| {
+                b.iter(|| black_box(&hll).to_compact());
+            });
+
+            group.bench_with_input(BenchmarkId::new(format!("decode-{suffix}"), n), &n, |b, _| {
+                b.iter(|| HyperLogLog::<MurmurHash64A>::from_compact(black_box(&encoded)));
+            });
+        }
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_compact);
+criterion_main!(benches);
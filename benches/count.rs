@@ -0,0 +1,180 @@
+use redis_hyperloglog::{Estimator, HyperLogLog};
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion};
+
+use std::time::{Duration, Instant};
+
+pub fn bench_count_from_dense(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("count_from_dense");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    let nums = [1_000, 100_000, 10_000_000];
+
+    for n in nums {
+        let mut hll = HyperLogLog::new();
+        for i in 0u64..n {
+            hll.insert(&i.to_be_bytes());
+        }
+        let regs = hll.registers().to_vec();
+
+        redis_hyperloglog::set_simd(true);
+        group.bench_with_input(BenchmarkId::new("count-simd", n), &n, |b, _| {
+            b.iter(|| HyperLogLog::count_from_dense(black_box(&regs)));
+        });
+
+        redis_hyperloglog::set_simd(false);
+        group.bench_with_input(BenchmarkId::new("count-scalar", n), &n, |b, _| {
+            b.iter(|| HyperLogLog::count_from_dense(black_box(&regs)));
+        });
+    }
+    group.finish();
+}
+
+pub fn bench_union_count(c: &mut Criterion) {
+    let mut group = c.benchmark_group("union_count");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    let nums = [2, 3, 7, 30, 60, 90];
+
+    for n in nums {
+        let mut hlls = Vec::new();
+        for i in 0u32..n {
+            let mut hll = HyperLogLog::new();
+            hll.insert(&i.to_be_bytes());
+            hlls.push(hll);
+        }
+        let sources: Vec<&HyperLogLog> = hlls.iter().collect();
+
+        let mut dst = HyperLogLog::new();
+
+        redis_hyperloglog::set_simd(true);
+        group.bench_with_input(BenchmarkId::new("union-count-simd", n), &n, |b, _| {
+            b.iter(|| HyperLogLog::union_count(black_box(sources.as_slice())));
+        });
+        group.bench_with_input(BenchmarkId::new("merge-count-simd", n), &n, |b, _| {
+            b.iter(|| {
+                dst.clear();
+                dst.merge(black_box(hlls.as_slice()));
+                dst.count()
+            });
+        });
+
+        redis_hyperloglog::set_simd(false);
+        group.bench_with_input(BenchmarkId::new("union-count-scalar", n), &n, |b, _| {
+            b.iter(|| HyperLogLog::union_count(black_box(sources.as_slice())));
+        });
+    }
+    group.finish();
+}
+
+pub fn bench_joint_count(c: &mut Criterion) {
+    let mut group = c.benchmark_group("joint_count");
+
+    let nums = [1_000, 100_000, 10_000_000];
+
+    for n in nums {
+        let mut hll_a = HyperLogLog::new();
+        let mut hll_b = HyperLogLog::new();
+        for i in 0u64..n {
+            hll_a.insert(&i.to_be_bytes());
+            hll_b.insert(&(i + n / 2).to_be_bytes());
+        }
+
+        redis_hyperloglog::set_simd(true);
+        group.bench_with_input(BenchmarkId::new("joint-count-simd", n), &n, |b, _| {
+            b.iter(|| black_box(&hll_a).joint_count(black_box(&hll_b)));
+        });
+
+        redis_hyperloglog::set_simd(false);
+        group.bench_with_input(BenchmarkId::new("joint-count-scalar", n), &n, |b, _| {
+            b.iter(|| black_box(&hll_a).joint_count(black_box(&hll_b)));
+        });
+    }
+    group.finish();
+}
+
+pub fn bench_estimator(c: &mut Criterion) {
+    let mut group = c.benchmark_group("estimator");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    let nums = [100, 10_000, 1_000_000, 100_000_000];
+
+    for n in nums {
+        let mut hll = HyperLogLog::new();
+        for i in 0u64..n {
+            hll.insert(&i.to_be_bytes());
+        }
+
+        group.bench_with_input(BenchmarkId::new("improved", n), &n, |b, _| {
+            b.iter(|| black_box(&hll).count_with(Estimator::Improved));
+        });
+        group.bench_with_input(BenchmarkId::new("mle", n), &n, |b, _| {
+            b.iter(|| black_box(&hll).count_with(Estimator::Mle));
+        });
+    }
+    group.finish();
+}
+
+pub fn bench_count_many(c: &mut Criterion) {
+    let mut group = c.benchmark_group("count_many");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+    group.sample_size(10);
+
+    let nums = [1_000, 20_000];
+
+    for n in nums {
+        let mut hlls: Vec<HyperLogLog> = (0u64..n)
+            .map(|i| {
+                let mut hll = HyperLogLog::new();
+                for j in 0..i % 1000 {
+                    hll.insert(&(i << 32 | j).to_be_bytes());
+                }
+                hll
+            })
+            .collect();
+
+        // every sketch is made stale before timing; at 20k sketches most headers are cold
+        let mut run = |f: &dyn Fn(&[&HyperLogLog]) -> Vec<u64>, iters: u64| {
+            let mut elapsed = Duration::ZERO;
+            for _ in 0..iters {
+                for hll in &mut hlls {
+                    hll.merge(&[]);
+                }
+                let sources: Vec<&HyperLogLog> = hlls.iter().collect();
+                let start = Instant::now();
+                black_box(f(&sources));
+                elapsed += start.elapsed();
+            }
+            elapsed
+        };
+
+        for simd in [true, false] {
+            redis_hyperloglog::set_simd(simd);
+            let suffix = if simd { "simd" } else { "scalar" };
+
+            group.bench_with_input(BenchmarkId::new(format!("naive-{suffix}"), n), &n, |b, _| {
+                b.iter_custom(|iters| run(&|sources| sources.iter().map(|hll| hll.count()).collect(), iters));
+            });
+            group.bench_with_input(BenchmarkId::new(format!("count-many-{suffix}"), n), &n, |b, _| {
+                b.iter_custom(|iters| run(&|sources| HyperLogLog::count_many(sources), iters));
+            });
+            group.bench_with_input(BenchmarkId::new(format!("count-many-par-{suffix}"), n), &n, |b, _| {
+                b.iter_custom(|iters| run(&|sources| HyperLogLog::count_many_par(sources), iters));
+            });
+        }
+    }
+    group.finish();
+}
+
+criterion_group!(
+    benches,
+    bench_count_from_dense,
+    bench_union_count,
+    bench_joint_count,
+    bench_estimator,
+    bench_count_many
+);
+criterion_main!(benches);
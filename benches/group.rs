@@ -0,0 +1,61 @@
+use redis_hyperloglog::{HllColumn, HyperLogLog};
+
+use criterion::{criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion, Throughput};
+
+pub fn bench_group_by(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("group_by");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+    group.sample_size(10);
+
+    // a dense sketch takes 12 KiB, so 1e5 groups already take 1.2 GiB per layout
+    let nums = [1_000, 10_000, 100_000];
+    let n_elements = 1 << 20;
+    group.throughput(Throughput::Elements(n_elements as u64));
+
+    for n in nums {
+        let mut state = 0x9e37_79b9_7f4a_7c15_u64;
+        let groups: Vec<usize> = (0..n_elements)
+            .map(|_| {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                (state >> 16) as usize % n
+            })
+            .collect();
+        let values: Vec<[u8; 8]> = (0..n_elements as u64).map(u64::to_be_bytes).collect();
+        let keys: Vec<&[u8]> = values.iter().map(<[u8; 8]>::as_slice).collect();
+
+        let mut column = HllColumn::new(n);
+        group.bench_with_input(BenchmarkId::new("column-grouped", n), &n, |b, _| {
+            b.iter(|| column.insert_grouped(&groups, &keys));
+        });
+        group.bench_with_input(BenchmarkId::new("column-one-by-one", n), &n, |b, _| {
+            b.iter(|| {
+                let mut updated = false;
+                for (&g, key) in groups.iter().zip(&keys) {
+                    updated |= column.insert(g, key);
+                }
+                updated
+            });
+        });
+        drop(column);
+
+        let mut hlls: Vec<HyperLogLog> = (0..n).map(|_| HyperLogLog::new()).collect();
+        group.bench_with_input(BenchmarkId::new("objects-one-by-one", n), &n, |b, _| {
+            b.iter(|| {
+                let mut updated = false;
+                for (&g, key) in groups.iter().zip(&keys) {
+                    updated |= hlls[g].insert(key);
+                }
+                updated
+            });
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_group_by);
+criterion_main!(benches);
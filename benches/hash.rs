@@ -0,0 +1,60 @@
+use redis_hyperloglog::{HllHasher, HyperLogLog, MurmurHash64A, Xxh3};
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion, Throughput};
+
+pub fn bench_hash(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("hash");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    let lens = [1, 4, 8, 16, 32, 64, 128, 256, 1024, 4096];
+    let data: Vec<u8> = (0..4096u32).map(|i| (i.wrapping_mul(0x9e37_79b1) >> 24) as u8).collect();
+
+    for len in lens {
+        let key = &data[..len];
+        group.throughput(Throughput::Bytes(len as u64));
+
+        group.bench_with_input(BenchmarkId::new("murmurhash64a", len), &len, |b, _| {
+            b.iter(|| MurmurHash64A::hash(black_box(key)));
+        });
+
+        redis_hyperloglog::set_simd(true);
+        group.bench_with_input(BenchmarkId::new("xxh3-simd", len), &len, |b, _| {
+            b.iter(|| Xxh3::hash(black_box(key)));
+        });
+
+        redis_hyperloglog::set_simd(false);
+        group.bench_with_input(BenchmarkId::new("xxh3-scalar", len), &len, |b, _| {
+            b.iter(|| Xxh3::hash(black_box(key)));
+        });
+    }
+    group.finish();
+}
+
+pub fn bench_insert(c: &mut Criterion) {
+    let mut group = c.benchmark_group("insert");
+
+    let lens = [8, 64, 1024];
+    let data: Vec<u8> = (0..1024u32).map(|i| (i.wrapping_mul(0x9e37_79b1) >> 24) as u8).collect();
+
+    redis_hyperloglog::set_simd(true);
+    for len in lens {
+        let key = &data[..len];
+
+        let mut hll = HyperLogLog::new();
+        group.bench_with_input(BenchmarkId::new("murmurhash64a", len), &len, |b, _| {
+            b.iter(|| hll.insert(black_box(key)));
+        });
+
+        let mut hll = HyperLogLog::with_hasher(Xxh3);
+        group.bench_with_input(BenchmarkId::new("xxh3", len), &len, |b, _| {
+            b.iter(|| hll.insert(black_box(key)));
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_hash, bench_insert);
+criterion_main!(benches);
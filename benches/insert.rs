@@ -0,0 +1,126 @@
+use redis_hyperloglog::HyperLogLog;
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion, Throughput};
+
+const CHUNK: usize = 4096;
+
+/// Fills `buf` with the next hashes of a splitmix64 stream.
+fn next_hashes(state: &mut u64, buf: &mut [u64]) {
+    for h in buf {
+        *state = state.wrapping_add(0x9e37_79b9_7f4a_7c15);
+        let mut z = *state;
+        z = (z ^ (z >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+        z = (z ^ (z >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+        *h = z ^ (z >> 31);
+    }
+}
+
+pub fn bench_insert_hashes(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("insert_hashes");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+    group.sample_size(10);
+
+    let nums = [1_000_000, 10_000_000, 100_000_000];
+
+    for n in nums {
+        group.throughput(Throughput::Elements(n));
+
+        let run = |batch: bool| {
+            let mut hll = HyperLogLog::new();
+            let mut state = 0;
+            let mut buf = vec![0; CHUNK];
+            let mut remaining = n;
+            while remaining > 0 {
+                let len = remaining.min(CHUNK as u64) as usize;
+                next_hashes(&mut state, &mut buf[..len]);
+                if batch {
+                    hll.insert_hashes(black_box(&buf[..len]));
+                } else {
+                    for &hash in &buf[..len] {
+                        hll.insert_hash(black_box(hash));
+                    }
+                }
+                remaining -= len as u64;
+            }
+            hll.count()
+        };
+
+        redis_hyperloglog::set_simd(true);
+        group.bench_with_input(BenchmarkId::new("insert_hash", n), &n, |b, _| {
+            b.iter(|| run(false));
+        });
+
+        group.bench_with_input(BenchmarkId::new("insert_hashes-simd", n), &n, |b, _| {
+            b.iter(|| run(true));
+        });
+
+        redis_hyperloglog::set_simd(false);
+        group.bench_with_input(BenchmarkId::new("insert_hashes-scalar", n), &n, |b, _| {
+            b.iter(|| run(true));
+        });
+    }
+    group.finish();
+}
+
+/// PFADD of fresh elements into a sketch that already holds `n` elements,
+/// where almost every insert is a no-op.
+pub fn bench_pfadd(c: &mut Criterion) {
+    let mut group = c.benchmark_group("pfadd");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+    group.throughput(Throughput::Elements(CHUNK as u64));
+
+    let nums = [10_000_000, 100_000_000];
+
+    for n in nums {
+        redis_hyperloglog::set_simd(true);
+
+        let mut hll = HyperLogLog::new();
+        let mut state = 0;
+        let mut buf = vec![0; CHUNK];
+        for _ in 0..n / CHUNK as u64 {
+            next_hashes(&mut state, &mut buf);
+            hll.insert_hashes(&buf);
+        }
+
+        let keys: Vec<[u8; 8]> = (n..n + CHUNK as u64).map(u64::to_be_bytes).collect();
+        let keys: Vec<&[u8]> = keys.iter().map(<[u8; 8]>::as_slice).collect();
+
+        group.bench_with_input(BenchmarkId::new("insert", n), &n, |b, _| {
+            b.iter(|| {
+                for key in &keys {
+                    hll.insert(black_box(key));
+                }
+            });
+        });
+
+        group.bench_with_input(BenchmarkId::new("insert_many", n), &n, |b, _| {
+            b.iter(|| hll.insert_many(black_box(&keys)));
+        });
+
+        next_hashes(&mut state, &mut buf);
+
+        group.bench_with_input(BenchmarkId::new("insert_hash", n), &n, |b, _| {
+            b.iter(|| {
+                for &hash in &buf {
+                    hll.insert_hash(black_box(hash));
+                }
+            });
+        });
+
+        group.bench_with_input(BenchmarkId::new("insert_hashes-simd", n), &n, |b, _| {
+            b.iter(|| hll.insert_hashes(black_box(&buf)));
+        });
+
+        redis_hyperloglog::set_simd(false);
+        group.bench_with_input(BenchmarkId::new("insert_hashes-scalar", n), &n, |b, _| {
+            b.iter(|| hll.insert_hashes(black_box(&buf)));
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_insert_hashes, bench_pfadd);
+criterion_main!(benches);
@@ -1,4 +1,4 @@
-use redis_hyperloglog::HyperLogLog;
+use redis_hyperloglog::{HyperLogLog, MergeScratch};
 
 use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
 use criterion::{BenchmarkId, Criterion};
@@ -29,6 +29,11 @@ pub fn bench_merge(c: &mut Criterion) {
             b.iter(|| dst.merge(black_box(hlls.as_slice())));
         });
 
+        let mut scratch = Box::new(MergeScratch::new());
+        group.bench_with_input(BenchmarkId::new("merge-scratch", n), &n, |b, _| {
+            b.iter(|| dst.merge_with_scratch(black_box(hlls.as_slice()), &mut scratch));
+        });
+
         redis_hyperloglog::set_simd(false);
         group.bench_with_input(BenchmarkId::new("merge-scalar", n), &n, |b, _| {
             b.iter(|| dst.merge(black_box(hlls.as_slice())));
@@ -0,0 +1,52 @@
+use redis_hyperloglog::{HllRepr, HyperLogLog, MurmurHash64A};
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion};
+
+fn build(repr: HllRepr, n: u64) -> HyperLogLog {
+    let mut hll = HyperLogLog::with_repr(MurmurHash64A, repr);
+    for i in 0..n {
+        hll.insert(&i.to_be_bytes());
+    }
+    hll
+}
+
+pub fn bench_nibble(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("nibble");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    let nums = [1_000, 100_000, 10_000_000];
+
+    for n in nums {
+        for repr in [HllRepr::Dense, HllRepr::Nibble] {
+            let name = format!("{repr:?}").to_lowercase();
+            let hll = build(repr, n);
+            let sources = [build(repr, n), build(repr, n / 2)];
+            println!("n: {n}, {name}: {} bytes", hll.memory_usage());
+
+            group.bench_with_input(BenchmarkId::new(format!("insert-{name}"), n), &n, |b, _| {
+                let mut hll = build(repr, n);
+                let mut i = n;
+                b.iter(|| {
+                    i += 1;
+                    hll.insert(black_box(&i.to_be_bytes()))
+                });
+            });
+
+            group.bench_with_input(BenchmarkId::new(format!("merge-{name}"), n), &n, |b, _| {
+                let mut dst = HyperLogLog::with_repr(MurmurHash64A, repr);
+                b.iter(|| dst.merge(black_box(&sources)));
+            });
+
+            group.bench_with_input(BenchmarkId::new(format!("union-count-{name}"), n), &n, |b, _| {
+                b.iter(|| HyperLogLog::union_count(black_box(&[&hll, &sources[0], &sources[1]])));
+            });
+        }
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_nibble);
+criterion_main!(benches);
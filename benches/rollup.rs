@@ -0,0 +1,57 @@
+use redis_hyperloglog::{HyperLogLog, SketchRollup};
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion};
+
+pub fn bench_rollup(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("rollup");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    // one day of per-minute sketches
+    let n = 1440;
+    let per_sketch = 1000u64;
+
+    let mut rollup = SketchRollup::new();
+    let mut sketches = Vec::new();
+    for t in 0..n as u64 {
+        let mut hll = HyperLogLog::new();
+        let mut copy = HyperLogLog::new();
+        for i in 0..per_sketch {
+            let key = (t * per_sketch + i).to_be_bytes();
+            hll.insert(&key);
+            copy.insert(&key);
+        }
+        rollup.push(hll);
+        sketches.push(copy);
+    }
+    println!("rollup memory: {} bytes for {n} sketches", rollup.memory_usage());
+
+    redis_hyperloglog::set_simd(true);
+
+    let lens = [60, 360, 1000, 1440];
+    for len in lens {
+        // unaligned ranges are the worst case for the rollup
+        let start = if len < n { ((n - len) / 2) | 1 } else { 0 };
+        let range = start..start + len;
+        let sources: Vec<&HyperLogLog> = sketches[range.clone()].iter().collect();
+
+        group.bench_with_input(BenchmarkId::new("rollup-count", len), &len, |b, _| {
+            b.iter(|| rollup.count(black_box(range.clone())));
+        });
+
+        group.bench_with_input(BenchmarkId::new("union_count", len), &len, |b, _| {
+            b.iter(|| HyperLogLog::union_count(black_box(sources.as_slice())));
+        });
+    }
+
+    group.bench_function("push", |b| {
+        b.iter(|| rollup.push(HyperLogLog::new()));
+    });
+
+    group.finish();
+}
+
+criterion_group!(benches, bench_rollup);
+criterion_main!(benches);
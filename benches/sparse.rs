@@ -0,0 +1,100 @@
+use redis_hyperloglog::HyperLogLog;
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion};
+
+pub fn bench_sparse(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("sparse");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    let nums = [100, 1_000, 10_000];
+
+    for n in nums {
+        let mut hll = HyperLogLog::new();
+        let mut other = HyperLogLog::new();
+        for i in 0u64..n {
+            hll.insert(&i.to_be_bytes());
+            other.insert(&(i + n / 2).to_be_bytes());
+        }
+        // the cached cardinality is stale, so counting reads the registers
+        let sparse = hll.to_redis_sparse().unwrap();
+        let dense = other.to_redis();
+        println!("n: {n}, sparse: {} bytes, dense: {} bytes", sparse.len(), dense.len());
+
+        group.bench_with_input(BenchmarkId::new("count-runs", n), &n, |b, _| {
+            b.iter(|| HyperLogLog::count_from_redis(black_box(&sparse)));
+        });
+
+        for simd in [true, false] {
+            redis_hyperloglog::set_simd(simd);
+            let suffix = if simd { "simd" } else { "scalar" };
+
+            group.bench_with_input(BenchmarkId::new(format!("count-decode-{suffix}"), n), &n, |b, _| {
+                b.iter(|| HyperLogLog::from_redis(black_box(&sparse)).unwrap().count());
+            });
+
+            group.bench_with_input(BenchmarkId::new(format!("union-mixed-{suffix}"), n), &n, |b, _| {
+                b.iter(|| HyperLogLog::union_count_redis(black_box(&[&sparse, &dense])));
+            });
+
+            group.bench_with_input(BenchmarkId::new(format!("union-decode-{suffix}"), n), &n, |b, _| {
+                b.iter(|| {
+                    let a = HyperLogLog::from_redis(black_box(&sparse)).unwrap();
+                    let b = HyperLogLog::from_redis(black_box(&dense)).unwrap();
+                    HyperLogLog::union_count(&[&a, &b])
+                });
+            });
+        }
+    }
+    group.finish();
+}
+
+pub fn bench_merge_sparse(c: &mut Criterion) {
+    let mut group = c.benchmark_group("merge-sparse");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    let mut dst = HyperLogLog::new();
+    for i in 0u64..100_000 {
+        dst.insert(&i.to_be_bytes());
+    }
+    let dst = dst.to_redis();
+
+    for n in [10, 100, 1000] {
+        let values: Vec<Vec<u8>> = (0u64..n)
+            .map(|s| {
+                let mut small = HyperLogLog::new();
+                for i in 0u64..20 {
+                    small.insert(&(1_000_000 * s + i).to_be_bytes());
+                }
+                small.to_redis_sparse().unwrap()
+            })
+            .collect();
+        let values: Vec<&[u8]> = values.iter().map(Vec::as_slice).collect();
+
+        group.bench_with_input(BenchmarkId::new("point-updates", n), &n, |b, _| {
+            b.iter(|| {
+                let mut hll = HyperLogLog::from_redis(&dst).unwrap();
+                hll.merge_redis(black_box(&values)).unwrap();
+                hll
+            });
+        });
+
+        group.bench_with_input(BenchmarkId::new("decode-merge", n), &n, |b, _| {
+            b.iter(|| {
+                let mut hll = HyperLogLog::from_redis(&dst).unwrap();
+                let sources: Vec<HyperLogLog> = values
+                    .iter()
+                    .map(|v| HyperLogLog::from_redis(black_box(v)).unwrap())
+                    .collect();
+                hll.merge(&sources);
+                hll
+            });
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_sparse, bench_merge_sparse);
+criterion_main!(benches);
@@ -0,0 +1,63 @@
+use redis_hyperloglog::HyperLogLog;
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion};
+
+/// `PFMERGE` into a rotating pool of cold destinations, interleaved with `PFCOUNT` over a
+/// few hot keys. Regular stores pull every destination into the cache and evict the hot keys,
+/// streaming stores leave them cached. With no hot keys, measures the merge alone.
+pub fn bench_stream(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("stream");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    // 12 KiB per sketch: about 500 MiB of destinations, more than the last-level cache
+    let pool = 40_000;
+    let sources: Vec<HyperLogLog> = (0..2u64)
+        .map(|s| {
+            let mut hll = HyperLogLog::new();
+            for i in 0..100_000 {
+                hll.insert(&(i * 2 + s).to_be_bytes());
+            }
+            hll
+        })
+        .collect();
+    let mut dsts: Vec<HyperLogLog> = (0..pool).map(|_| HyperLogLog::new()).collect();
+
+    let nums = [0, 32, 128];
+
+    for hot in nums {
+        let hot: Vec<HyperLogLog> = (0..hot as u64)
+            .map(|s| {
+                let mut hll = HyperLogLog::new();
+                for i in 0..10_000 {
+                    hll.insert(&(i * 64 + s).to_be_bytes());
+                }
+                hll
+            })
+            .collect();
+        let hot: Vec<&HyperLogLog> = hot.iter().collect();
+
+        for streaming in [false, true] {
+            let name = if streaming { "merge-streaming" } else { "merge-regular" };
+            group.bench_with_input(BenchmarkId::new(name, hot.len()), &hot.len(), |b, _| {
+                let mut k = 0;
+                b.iter(|| {
+                    k = (k + 1) % pool;
+                    if streaming {
+                        dsts[k].merge_streaming(black_box(&sources));
+                    } else {
+                        dsts[k].merge(black_box(&sources));
+                    }
+                    HyperLogLog::union_count(black_box(&hot))
+                });
+            });
+        }
+    }
+
+    group.finish();
+}
+
+criterion_group!(benches, bench_stream);
+criterion_main!(benches);
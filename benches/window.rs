@@ -0,0 +1,61 @@
+use redis_hyperloglog::{HyperLogLog, SlidingHyperLogLog};
+
+use criterion::{black_box, criterion_group, criterion_main, AxisScale, PlotConfiguration};
+use criterion::{BenchmarkId, Criterion};
+
+pub fn bench_window(c: &mut Criterion) {
+    dbg!(is_x86_feature_detected!("avx2"));
+
+    let mut group = c.benchmark_group("window");
+    group.plot_config(PlotConfiguration::default().summary_scale(AxisScale::Logarithmic));
+
+    let nums = [60, 1440];
+    let per_bucket = 1000u64;
+
+    for w in nums {
+        let mut window = SlidingHyperLogLog::new(w);
+        let mut buckets = Vec::new();
+
+        // one and a half windows, so the window spans two blocks
+        for t in 0..(w + w / 2) as u64 {
+            let mut bucket = HyperLogLog::new();
+            for i in 0..per_bucket {
+                let key = (t * per_bucket + i).to_be_bytes();
+                window.insert(&key);
+                bucket.insert(&key);
+            }
+            buckets.push(bucket);
+            window.advance();
+        }
+        let buckets = &buckets[buckets.len() - w..];
+        let sources: Vec<&HyperLogLog> = buckets.iter().collect();
+
+        redis_hyperloglog::set_simd(true);
+
+        group.bench_with_input(BenchmarkId::new("sliding-count", w), &w, |b, _| {
+            b.iter(|| black_box(&window).count());
+        });
+
+        group.bench_with_input(BenchmarkId::new("union_count-all", w), &w, |b, _| {
+            b.iter(|| HyperLogLog::union_count(black_box(sources.as_slice())));
+        });
+
+        let mut dst = HyperLogLog::new();
+        group.bench_with_input(BenchmarkId::new("merge-all-count", w), &w, |b, _| {
+            b.iter(|| {
+                dst.clear();
+                dst.merge(black_box(buckets));
+                dst.count()
+            });
+        });
+
+        // amortized over full blocks, including the in-place suffix folds
+        group.bench_with_input(BenchmarkId::new("advance", w), &w, |b, _| {
+            b.iter(|| window.advance());
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, bench_window);
+criterion_main!(benches);
@@ -3,6 +3,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <functional>
@@ -509,6 +510,136 @@ void compress_avx512_2(uint8_t *reg_dense, const uint8_t *reg_raw) {
         t += 48;
     }
 }
+
+/* Streaming versions: 256 registers pack into 192 bytes, which are written
+ * with three aligned non-temporal stores, so the destination must be 64-byte
+ * aligned. Meant for write-once results that should not evict hot data. */
+
+void compress_avx512_nt_1(uint8_t *reg_dense, const uint8_t *reg_raw) {
+    const __m512i indices = _mm512_setr_epi32( //
+        0, 3, 6, 9, 12, 15, 18, 21,            //
+        24, 27, 30, 33, 36, 39, 42, 45         //
+    );
+
+    /* The scatter writes 4 bytes per 3, so it needs one extra dword. */
+    alignas(64) uint8_t stage[192 + 64];
+
+    const uint8_t *r = reg_raw;
+    uint8_t *t = reg_dense;
+
+    for (int i = 0; i < HLL_REGISTERS / 256; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            __m512i x = _mm512_loadu_si512((__m512i *)(r + j * 64));
+
+            __m512i a1, a2, a3, a4;
+            a1 = _mm512_and_si512(x, _mm512_set1_epi32(0x0000003f));
+            a2 = _mm512_and_si512(x, _mm512_set1_epi32(0x00003f00));
+            a3 = _mm512_and_si512(x, _mm512_set1_epi32(0x003f0000));
+            a4 = _mm512_and_si512(x, _mm512_set1_epi32(0x3f000000));
+
+            a2 = _mm512_srli_epi32(a2, 2);
+            a3 = _mm512_srli_epi32(a3, 4);
+            a4 = _mm512_srli_epi32(a4, 6);
+
+            __m512i y1, y2, y;
+            y1 = _mm512_or_si512(a1, a2);
+            y2 = _mm512_or_si512(a3, a4);
+            y = _mm512_or_si512(y1, y2);
+
+            _mm512_i32scatter_epi32((__m512i *)(stage + j * 48), indices, y, 1);
+        }
+
+        _mm512_stream_si512((__m512i *)t, _mm512_load_si512(stage));
+        _mm512_stream_si512((__m512i *)(t + 64), _mm512_load_si512(stage + 64));
+        _mm512_stream_si512((__m512i *)(t + 128),
+                            _mm512_load_si512(stage + 128));
+
+        r += 256;
+        t += 192;
+    }
+
+    _mm_sfence();
+}
+
+void compress_avx512_nt_2(uint8_t *reg_dense, const uint8_t *reg_raw) {
+    const __m512i shuffle = _mm512_set_epi8( //
+        0x80, 0x80, 0x80, 0x80,              //
+        14, 13, 12,                          //
+        10, 9, 8,                            //
+        6, 5, 4,                             //
+        2, 1, 0,                             //
+        0x80, 0x80, 0x80, 0x80,              //
+        14, 13, 12,                          //
+        10, 9, 8,                            //
+        6, 5, 4,                             //
+        2, 1, 0,                             //
+        0x80, 0x80, 0x80, 0x80,              //
+        14, 13, 12,                          //
+        10, 9, 8,                            //
+        6, 5, 4,                             //
+        2, 1, 0,                             //
+        0x80, 0x80, 0x80, 0x80,              //
+        14, 13, 12,                          //
+        10, 9, 8,                            //
+        6, 5, 4,                             //
+        2, 1, 0                              //
+    );
+
+    /* After the shuffle, dwords 3, 7, 11 and 15 of each vector are empty.
+     * These gather the 48 packed bytes of 4 vectors into 3; indices >= 16
+     * select from the second operand. */
+    const __m512i gather1 = _mm512_setr_epi32( //
+        0, 1, 2, 4, 5, 6, 8, 9,                //
+        10, 12, 13, 14, 16, 17, 18, 20         //
+    );
+    const __m512i gather2 = _mm512_setr_epi32( //
+        5, 6, 8, 9, 10, 12, 13, 14,            //
+        16, 17, 18, 20, 21, 22, 24, 25         //
+    );
+    const __m512i gather3 = _mm512_setr_epi32( //
+        10, 12, 13, 14, 16, 17, 18, 20,        //
+        21, 22, 24, 25, 26, 28, 29, 30         //
+    );
+
+    const uint8_t *r = reg_raw;
+    uint8_t *t = reg_dense;
+
+    for (int i = 0; i < HLL_REGISTERS / 256; ++i) {
+        __m512i y[4];
+        for (int j = 0; j < 4; ++j) {
+            __m512i x = _mm512_loadu_si512((__m512i *)(r + j * 64));
+
+            __m512i a1, a2, a3, a4;
+            a1 = _mm512_and_si512(x, _mm512_set1_epi32(0x0000003f));
+            a2 = _mm512_and_si512(x, _mm512_set1_epi32(0x00003f00));
+            a3 = _mm512_and_si512(x, _mm512_set1_epi32(0x003f0000));
+            a4 = _mm512_and_si512(x, _mm512_set1_epi32(0x3f000000));
+
+            a2 = _mm512_srli_epi32(a2, 2);
+            a3 = _mm512_srli_epi32(a3, 4);
+            a4 = _mm512_srli_epi32(a4, 6);
+
+            __m512i y1, y2;
+            y1 = _mm512_or_si512(a1, a2);
+            y2 = _mm512_or_si512(a3, a4);
+            y[j] = _mm512_shuffle_epi8(_mm512_or_si512(y1, y2), shuffle);
+        }
+
+        __m512i z1, z2, z3;
+        z1 = _mm512_permutex2var_epi32(y[0], gather1, y[1]);
+        z2 = _mm512_permutex2var_epi32(y[1], gather2, y[2]);
+        z3 = _mm512_permutex2var_epi32(y[2], gather3, y[3]);
+
+        _mm512_stream_si512((__m512i *)t, z1);
+        _mm512_stream_si512((__m512i *)(t + 64), z2);
+        _mm512_stream_si512((__m512i *)(t + 128), z3);
+
+        r += 256;
+        t += 192;
+    }
+
+    _mm_sfence();
+}
 #endif
 
 TARGET_DEFAULT
@@ -783,7 +914,7 @@ void histogram_avx2_2(const uint8_t *reg_dense, int *hist) {
 void histogram_avx2_3(const uint8_t *reg_dense, int *hist) {
     const uint8_t *r = reg_dense - 4;
 
-    alignas(32) uint8_t vh[16][64];
+    alignas(32) uint16_t vh[16][64];
     alignas(32) uint8_t t[32];
     alignas(32) int h[64];
 
@@ -859,6 +990,88 @@ void histogram_avx2_3(const uint8_t *reg_dense, int *hist) {
     memcpy(hist, h, sizeof(h));
 }
 
+/**
+unpack (same as histogram_avx2_2) into a raw byte array, tracking min/max
+
+count bins [min, max], 8 bins per pass:
+cmpeq -> {ff|00|..} x32
+sub   -> byte counters, private per lane (no scatter, no conflicts)
+every 255 vectors: sad epu8 (vpsadbw) widens the byte counters to epi64
+
+real sketches only occupy a few bins, so most passes are skipped
+ */
+void histogram_avx2_4(const uint8_t *reg_dense, int *hist) {
+    const uint8_t *r = reg_dense - 4;
+
+    alignas(32) uint8_t raw[HLL_REGISTERS];
+    alignas(32) uint8_t t[2][32];
+
+    __m256i vmin = _mm256_set1_epi8(-1);
+    __m256i vmax = _mm256_setzero_si256();
+
+    for (int j = 0; j < 512; ++j) {
+        __m256i x0 = _mm256_loadu_si256((__m256i *)r);
+        __m256i x1 = _mm256_shuffle_epi8(x0, avx2_shuffle);
+
+        __m256i p1 = _mm256_and_si256(x1, _mm256_set1_epi32(0x00fc003f));
+        __m256i a1 = _mm256_mullo_epi16(p1, _mm256_set1_epi32(0x00400001));
+
+        __m256i p2 = _mm256_slli_epi32(x1, 2);
+        __m256i p3 = _mm256_slli_epi32(x1, 4);
+        __m256i b2 = _mm256_blend_epi16(p2, p3, 0b10101010);
+        __m256i a2 = _mm256_and_si256(b2, _mm256_set1_epi32(0x003f3f00));
+
+        __m256i y = _mm256_or_si256(a1, a2);
+
+        _mm256_store_si256((__m256i *)(raw + j * 32), y);
+        vmin = _mm256_min_epu8(vmin, y);
+        vmax = _mm256_max_epu8(vmax, y);
+
+        r += 24;
+    }
+
+    _mm256_store_si256((__m256i *)t[0], vmin);
+    _mm256_store_si256((__m256i *)t[1], vmax);
+    int lo = *std::min_element(t[0], t[0] + 32);
+    int hi = *std::max_element(t[1], t[1] + 32);
+
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (int base = lo; base <= hi; base += 8) {
+        __m256i v[8], acc[8], wide[8];
+        for (int k = 0; k < 8; ++k) {
+            v[k] = _mm256_set1_epi8(base + k);
+            wide[k] = zero;
+        }
+
+        for (int c = 0; c < 512; c += 255) {
+            int end = std::min(c + 255, 512);
+
+            for (int k = 0; k < 8; ++k) {
+                acc[k] = zero;
+            }
+            for (int j = c; j < end; ++j) {
+                __m256i x = _mm256_load_si256((__m256i *)(raw + j * 32));
+                for (int k = 0; k < 8; ++k) {
+                    __m256i eq = _mm256_cmpeq_epi8(x, v[k]);
+                    acc[k] = _mm256_sub_epi8(acc[k], eq);
+                }
+            }
+            for (int k = 0; k < 8; ++k) {
+                __m256i sad = _mm256_sad_epu8(acc[k], zero);
+                wide[k] = _mm256_add_epi64(wide[k], sad);
+            }
+        }
+
+        for (int k = 0; k < 8 && base + k <= hi; ++k) {
+            __m128i s = _mm_add_epi64(_mm256_castsi256_si128(wide[k]),
+                                      _mm256_extracti128_si256(wide[k], 1));
+            s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+            hist[base + k] += _mm_cvtsi128_si32(s);
+        }
+    }
+}
+
 const __m256i avx2_indices = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
 
 #ifndef NO_AVX512
@@ -1202,10 +1415,10 @@ class BenchmarkGroup {
     }
 };
 
-static uint8_t buf1[HLL_REGISTERS * 2];
-static uint8_t buf2[HLL_REGISTERS * 2];
-static uint8_t buf3[HLL_REGISTERS * 2];
-static uint8_t buf4[HLL_REGISTERS * 2];
+alignas(64) static uint8_t buf1[HLL_REGISTERS * 2];
+alignas(64) static uint8_t buf2[HLL_REGISTERS * 2];
+alignas(64) static uint8_t buf3[HLL_REGISTERS * 2];
+alignas(64) static uint8_t buf4[HLL_REGISTERS * 2];
 
 int check_merge(const uint8_t *lhs, const uint8_t *rhs) {
     for (int i = 0; i < HLL_REGISTERS; i++) {
@@ -1333,8 +1546,10 @@ void bench_compress(int rounds, int seed) {
             compress_avx2_1, //
             compress_avx2_2, //
 #ifndef NO_AVX512
-            compress_avx512_1, //
-            compress_avx512_2, //
+            compress_avx512_1,    //
+            compress_avx512_2,    //
+            compress_avx512_nt_1, //
+            compress_avx512_nt_2, //
 #endif
             compress_dynamic,
         };
@@ -1367,7 +1582,13 @@ void bench_compress(int rounds, int seed) {
         compress_avx512_1(reg_dense, reg_raw); //
     });
     group.add("compress_avx512_2", [=]() {
-        compress_avx512_1(reg_dense, reg_raw); //
+        compress_avx512_2(reg_dense, reg_raw); //
+    });
+    group.add("compress_avx512_nt_1", [=]() {
+        compress_avx512_nt_1(reg_dense, reg_raw); //
+    });
+    group.add("compress_avx512_nt_2", [=]() {
+        compress_avx512_nt_2(reg_dense, reg_raw); //
     });
 #endif
     group.add("compress_dynamic", [=]() {
@@ -1393,8 +1614,16 @@ int check_histogram(const int *lhs, const int *rhs) {
 static int hist1[64];
 static int hist2[64];
 
-void bench_histogram(int rounds, int seed) {
-    printf("------bench_histogram------\n");
+/* Registers of a real sketch concentrate around log2(n/m). */
+void fill_registers_skewed(uint8_t *reg_dense) {
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        uint8_t val = 5 + __builtin_ctz(rand() | (1 << 16));
+        HLL_DENSE_SET_REGISTER(reg_dense, i, val);
+    }
+}
+
+void bench_histogram(int rounds, int seed, bool skewed) {
+    printf("------bench_histogram%s------\n", skewed ? "_skewed" : "");
 
     srand(seed);
 
@@ -1402,8 +1631,12 @@ void bench_histogram(int rounds, int seed) {
 
     printf("verify\n");
     for (int r = 0; r < rounds / 10; ++r) {
-        for (int i = 0; i < HLL_DENSE_REG_LEN; i++) {
-            reg_dense[i] = rand();
+        if (skewed) {
+            fill_registers_skewed(reg_dense);
+        } else {
+            for (int i = 0; i < HLL_DENSE_REG_LEN; i++) {
+                reg_dense[i] = rand();
+            }
         }
 
         memset(hist1, 0, sizeof(hist1));
@@ -1416,6 +1649,7 @@ void bench_histogram(int rounds, int seed) {
             histogram_avx2_1, //
             histogram_avx2_2, //
             histogram_avx2_3, //
+            histogram_avx2_4, //
 #ifndef NO_AVX512
             histogram_avx512_1, //
             histogram_avx512_2, //
@@ -1443,36 +1677,52 @@ void bench_histogram(int rounds, int seed) {
         }
     }
 
+    /* The bins are reset on every call: the skewed registers fill one bin
+     * with half of them, which would overflow an int over the rounds. */
     BenchmarkGroup group;
     group.add("histogram_base_0", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_base_0(reg_dense, hist1); //
     });
     group.add("histogram_base_1", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_base_1(reg_dense, hist1); //
     });
     group.add("histogram_base_2", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_base_2(reg_dense, hist1); //
     });
     group.add("histogram_unroll", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_unroll(reg_dense, hist1); //
     });
     group.add("histogram_avx2_1", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_avx2_1(reg_dense, hist1); //
     });
     group.add("histogram_avx2_2", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_avx2_2(reg_dense, hist1); //
     });
     group.add("histogram_avx2_3", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_avx2_3(reg_dense, hist1); //
     });
+    group.add("histogram_avx2_4", [=]() {
+        memset(hist1, 0, sizeof(hist1));
+        histogram_avx2_4(reg_dense, hist1); //
+    });
 #ifndef NO_AVX512
     group.add("histogram_avx512_1", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_avx512_1(reg_dense, hist1); //
     });
     group.add("histogram_avx512_2", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_avx512_2(reg_dense, hist1); //
     });
     group.add("histogram_avx512_3", [=]() {
+        memset(hist1, 0, sizeof(hist1));
         histogram_avx512_3(reg_dense, hist1); //
     });
 #endif
@@ -1484,6 +1734,72 @@ void bench_histogram(int rounds, int seed) {
     printf("-----------------------\n");
 }
 
+#ifndef NO_AVX512
+/* Compress into a rotating pool of cold destinations, interleaved with a
+ * histogram of one of `hot` sketches. Regular stores pull every destination
+ * into the cache and evict the hot sketches, streaming stores leave them
+ * cached. With no hot sketches, measures the compress alone. */
+void bench_compress_pollution(int rounds, int seed, int hot) {
+    printf("------bench_compress_pollution_%d------\n", hot);
+
+    srand(seed);
+
+    /* About 500 MiB of destinations, more than the last-level cache. */
+    const size_t pool = 40000;
+    uint8_t *dsts = (uint8_t *)aligned_alloc(64, pool * HLL_DENSE_REG_LEN);
+    uint8_t *hots = (uint8_t *)aligned_alloc(64, (hot + 1) * HLL_REGISTERS);
+    if (dsts == NULL || hots == NULL) {
+        fprintf(stderr, "error: out of memory\n");
+        exit(1);
+    }
+    memset(dsts, 0, pool * HLL_DENSE_REG_LEN);
+    memset(hots, 0, (hot + 1) * HLL_REGISTERS);
+
+    uint8_t *reg_raw = buf1;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        reg_raw[i] = rand() & HLL_REGISTER_MAX;
+    }
+    for (int h = 0; h < hot; h++) {
+        fill_registers_skewed(hots + h * HLL_REGISTERS + 64);
+    }
+
+    size_t k = 0;
+    auto step = [=, &k](void (*compress)(uint8_t *, const uint8_t *)) {
+        k = (k + 1) % pool;
+        compress(dsts + k * HLL_DENSE_REG_LEN, reg_raw);
+        if (hot > 0) {
+            /* Reset, or the skewed bins overflow over the rounds. */
+            memset(hist1, 0, sizeof(hist1));
+            histogram_avx512_3(hots + (k % hot) * HLL_REGISTERS + 64, hist1);
+        }
+    };
+
+    BenchmarkGroup group;
+    group.add("compress_avx512_1", [=]() {
+        step(compress_avx512_1); //
+    });
+    group.add("compress_avx512_2", [=]() {
+        step(compress_avx512_2); //
+    });
+    group.add("compress_avx512_nt_1", [=]() {
+        step(compress_avx512_nt_1); //
+    });
+    group.add("compress_avx512_nt_2", [=]() {
+        step(compress_avx512_nt_2); //
+    });
+
+    printf("benchmark\n");
+    group.run(rounds);
+    group.summary();
+
+    free(dsts);
+    free(hots);
+
+    printf("-----------------------\n");
+}
+#endif
+
+#ifndef NO_MAIN
 int main() {
 #ifndef ROUNDS
     int rounds = 1e5;
@@ -1500,10 +1816,17 @@ int main() {
     printf("rounds: %d\n", rounds);
     printf("seed: %d\n", seed);
 
-    bench_histogram(rounds, seed);
+    bench_histogram(rounds, seed, false);
+    bench_histogram(rounds, seed, true);
     bench_merge(rounds, seed);
     bench_compress(rounds, seed);
+#ifndef NO_AVX512
+    bench_compress_pollution(rounds, seed, 0);
+    bench_compress_pollution(rounds, seed, 32);
+    bench_compress_pollution(rounds, seed, 128);
+#endif
 }
+#endif
 
 // AVX512:
 // g++ bench.cpp -O3 -march=native -Wall -Wextra -std=c++20 -o a.out && ./a.out
@@ -0,0 +1,171 @@
+// libFuzzer target that cross-checks every merge, compress and histogram
+// variant against the base version, on the same input layout as the Rust
+// targets in fuzz/: [fill, misalign, data...].
+//
+// clang++ fuzz.cpp -O1 -g -march=native -std=c++20
+//     -fsanitize=fuzzer,address && ./a.out
+
+#define NO_MAIN
+#include "bench.cpp"
+
+/* Slack around the buffers: the kernels may read a few bytes before the
+ * first register or read and write past the last one, and the misalignment
+ * shifts them by up to 63 bytes. The buffers start FUZZ_SLACK bytes in. */
+#define FUZZ_SLACK 128
+
+alignas(64) static uint8_t fuzz_raw[HLL_REGISTERS + 2 * FUZZ_SLACK];
+alignas(64) static uint8_t fuzz_dense[HLL_REGISTERS + 2 * FUZZ_SLACK];
+alignas(64) static uint8_t fuzz_expected[HLL_REGISTERS + 2 * FUZZ_SLACK];
+alignas(64) static uint8_t fuzz_actual[HLL_REGISTERS + 2 * FUZZ_SLACK];
+static int fuzz_hist1[64];
+static int fuzz_hist2[64];
+
+static void fuzz_fail(const char *kernel, int variant, int idx) {
+    fprintf(stderr, "mismatch: %s variant %d at %d\n", kernel, variant, idx);
+    abort();
+}
+
+/* Fills the registers the same way as `redis_hyperloglog::fuzzing`. */
+static void fuzz_fill(uint8_t *reg_raw, uint8_t *reg_dense, const uint8_t *data,
+                      size_t size) {
+    uint8_t fill = size > 0 ? data[0] : 0;
+    data += size >= 2 ? 2 : size;
+    size -= size >= 2 ? 2 : size;
+
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        uint8_t x = size > 0 ? data[i % size] : 0;
+        uint8_t y = size > 0 ? data[(i + 1) % size] : 0;
+        switch (fill % 4) {
+        case 0:
+            reg_raw[i] = 0;
+            break;
+        case 1:
+            reg_raw[i] = HLL_REGISTER_MAX;
+            break;
+        case 2:
+            reg_raw[i] = x & HLL_REGISTER_MAX;
+            break;
+        default:
+            reg_raw[i] = (x & 31) + (x >> 7);
+            break;
+        }
+        y = (uint8_t)((y << 3) | (y >> 5)) & HLL_REGISTER_MAX;
+        HLL_DENSE_SET_REGISTER(reg_dense, i, y);
+    }
+}
+
+static void fuzz_merge(const uint8_t *reg_raw, const uint8_t *reg_dense) {
+    std::vector<void (*)(uint8_t *, const uint8_t *)> funcs{
+        merge_avx2_1, //
+        merge_avx2_2, //
+        merge_avx2_3, //
+#ifndef NO_AVX512
+        merge_avx512_1, //
+        merge_avx512_2, //
+#endif
+        merge_dynamic,
+    };
+
+    memcpy(fuzz_expected, reg_raw, HLL_REGISTERS);
+    merge_base(fuzz_expected, reg_dense);
+
+    int num = funcs.size();
+    for (int j = 0; j < num; ++j) {
+        uint8_t *out = fuzz_actual + (reg_raw - fuzz_raw);
+        memcpy(out, reg_raw, HLL_REGISTERS);
+        funcs[j](out, reg_dense);
+        int idx = check_merge(fuzz_expected, out);
+        if (idx >= 0) {
+            fuzz_fail("merge", j, idx);
+        }
+    }
+}
+
+static void fuzz_compress(const uint8_t *reg_raw, size_t misalign) {
+    std::vector<void (*)(uint8_t *, const uint8_t *)> funcs{
+        compress_avx2_1, //
+        compress_avx2_2, //
+#ifndef NO_AVX512
+        compress_avx512_1, //
+        compress_avx512_2, //
+#endif
+        compress_dynamic,
+    };
+
+    memset(fuzz_expected, 0, sizeof(fuzz_expected));
+    compress_base(fuzz_expected, reg_raw);
+
+    int num = funcs.size();
+    for (int j = 0; j < num; ++j) {
+        uint8_t *out = fuzz_actual + FUZZ_SLACK + misalign;
+        memset(fuzz_actual, 0xaa, sizeof(fuzz_actual));
+        funcs[j](out, reg_raw);
+        int idx = check_compress(fuzz_expected, out);
+        if (idx >= 0) {
+            fuzz_fail("compress", j, idx);
+        }
+    }
+
+#ifndef NO_AVX512
+    /* The streaming versions need a 64-byte aligned destination. */
+    std::vector<void (*)(uint8_t *, const uint8_t *)> nt_funcs{
+        compress_avx512_nt_1, //
+        compress_avx512_nt_2, //
+    };
+
+    num = nt_funcs.size();
+    for (int j = 0; j < num; ++j) {
+        uint8_t *out = fuzz_actual + FUZZ_SLACK;
+        memset(fuzz_actual, 0xaa, sizeof(fuzz_actual));
+        nt_funcs[j](out, reg_raw);
+        int idx = check_compress(fuzz_expected, out);
+        if (idx >= 0) {
+            fuzz_fail("compress_nt", j, idx);
+        }
+    }
+#endif
+}
+
+static void fuzz_histogram(const uint8_t *reg_dense) {
+    std::vector<void (*)(const uint8_t *, int *)> funcs{
+        histogram_base_1, //
+        histogram_base_2, //
+        histogram_unroll, //
+        histogram_avx2_1, //
+        histogram_avx2_2, //
+        histogram_avx2_3, //
+        histogram_avx2_4, //
+#ifndef NO_AVX512
+        histogram_avx512_1, //
+        histogram_avx512_2, //
+        histogram_avx512_3, //
+#endif
+    };
+
+    memset(fuzz_hist1, 0, sizeof(fuzz_hist1));
+    histogram_base_0(reg_dense, fuzz_hist1);
+
+    int num = funcs.size();
+    for (int j = 0; j < num; ++j) {
+        memset(fuzz_hist2, 0, sizeof(fuzz_hist2));
+        funcs[j](reg_dense, fuzz_hist2);
+        int idx = check_histogram(fuzz_hist1, fuzz_hist2);
+        if (idx >= 0) {
+            fuzz_fail("histogram", j, idx);
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    size_t misalign = size >= 2 ? data[1] % 64 : 0;
+    uint8_t *reg_raw = fuzz_raw + FUZZ_SLACK + misalign;
+    uint8_t *reg_dense = fuzz_dense + FUZZ_SLACK + misalign;
+
+    memset(fuzz_dense, 0, sizeof(fuzz_dense));
+    fuzz_fill(reg_raw, reg_dense, data, size);
+
+    fuzz_merge(reg_raw, reg_dense);
+    fuzz_compress(reg_raw, misalign);
+    fuzz_histogram(reg_dense);
+    return 0;
+}
@@ -0,0 +1,9 @@
+#!/bin/bash -ex
+CXX='clang++ -g -O1 -march=native -Wall -Wextra -std=c++20 -fsanitize=fuzzer,address'
+mkdir -p logs/fuzz-corpus
+if lscpu | grep -q avx512; then
+    $CXX cpp/fuzz.cpp -o logs/fuzz.out
+else
+    $CXX cpp/fuzz.cpp -o logs/fuzz.out -DNO_AVX512
+fi
+./logs/fuzz.out logs/fuzz-corpus "$@"
@@ -0,0 +1,8 @@
+//! Cross-checks the scalar and SIMD kernels on fuzzed registers.
+//! See `redis_hyperloglog::fuzzing` for the input layout.
+
+#![no_main]
+
+use libfuzzer_sys::fuzz_target;
+
+fuzz_target!(|data: &[u8]| redis_hyperloglog::fuzzing::check_kernels(data));
@@ -0,0 +1,7 @@
+//! Inserts fuzzed hashes and checks merging and counting against a one-register reference.
+
+#![no_main]
+
+use libfuzzer_sys::fuzz_target;
+
+fuzz_target!(|data: &[u8]| redis_hyperloglog::fuzzing::check_pipeline(data));
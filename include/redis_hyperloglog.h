@@ -0,0 +1,50 @@
+/* C interface of redis-hyperloglog.
+ *
+ * Build with `cargo build --release` and link target/release/libredis_hyperloglog.a
+ * (or the shared library). Sketches use the Redis hash function and register layout.
+ *
+ * A handle is not thread-safe for writes. `hll_count` caches the cardinality,
+ * but may be called concurrently with other reads.
+ */
+
+#ifndef REDIS_HYPERLOGLOG_H
+#define REDIS_HYPERLOGLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct hll hll_t;
+
+/* Creates an empty sketch. Free it with hll_destroy. */
+hll_t *hll_create(void);
+void hll_destroy(hll_t *hll);
+void hll_clear(hll_t *hll);
+
+/* Returns 1 if a register was updated, 0 otherwise. */
+int hll_insert(hll_t *hll, const uint8_t *key, size_t len);
+int hll_insert_hashes(hll_t *hll, const uint64_t *hashes, size_t n);
+
+uint64_t hll_count(const hll_t *hll);
+uint64_t hll_union_count(const hll_t *const *sources, size_t n);
+
+/* dst must not be one of the sources. */
+void hll_merge(hll_t *dst, const hll_t *const *sources, size_t n);
+
+/* Write the encoding to out if it fits in cap bytes, and return its length either way.
+ * Call with cap = 0 to query the length. */
+size_t hll_serialize(const hll_t *hll, uint8_t *out, size_t cap);
+size_t hll_to_redis(const hll_t *hll, uint8_t *out, size_t cap);
+
+/* Return NULL if the bytes are not a valid encoding. */
+hll_t *hll_deserialize(const uint8_t *data, size_t len);
+hll_t *hll_from_redis(const uint8_t *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
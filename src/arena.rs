@@ -0,0 +1,112 @@
+//! Zeroed, 64-byte-aligned slabs for the registers of many sketches.
+//!
+//! With `ArenaAlloc::HugePages` the slab is mapped with `MAP_HUGETLB`, which only succeeds if
+//! huge pages are reserved (`vm.nr_hugepages`). Otherwise it is mapped with 4 KiB pages and
+//! advised with `MADV_HUGEPAGE`, so transparent huge pages back it when `enabled` is `madvise`
+//! or `always`. Either way every 2 MiB page is touched once before returning, so the default
+//! first-touch policy places the whole slab on the NUMA node of the creating thread.
+
+use std::alloc::alloc_zeroed;
+use std::alloc::dealloc;
+use std::alloc::handle_alloc_error;
+use std::alloc::Layout;
+use std::ffi::{c_int, c_long, c_void};
+use std::ptr;
+
+use crate::config::ArenaAlloc;
+
+const HUGE_PAGE_SIZE: usize = 2 << 20;
+
+const PROT_READ: c_int = 0x1;
+const PROT_WRITE: c_int = 0x2;
+const MAP_PRIVATE: c_int = 0x02;
+const MAP_ANONYMOUS: c_int = 0x20;
+const MAP_HUGETLB: c_int = 0x40000;
+const MADV_HUGEPAGE: c_int = 14;
+const MAP_FAILED: *mut c_void = !0 as *mut c_void;
+
+extern "C" {
+    fn mmap(addr: *mut c_void, len: usize, prot: c_int, flags: c_int, fd: c_int, offset: c_long) -> *mut c_void;
+    fn munmap(addr: *mut c_void, len: usize) -> c_int;
+    fn madvise(addr: *mut c_void, len: usize, advice: c_int) -> c_int;
+}
+
+pub struct Arena {
+    ptr: *mut u8,
+    /// Length of the mapping, or 0 if the slab comes from the global allocator.
+    mapped_len: usize,
+    layout: Layout,
+}
+
+impl Arena {
+    /// Allocates `size` zeroed bytes aligned to 64 bytes. With huge pages, the page before the
+    /// slab is usually unmapped, so a kernel that reads before its input faults.
+    pub fn new(size: usize, alloc: ArenaAlloc) -> Self {
+        let layout = Layout::from_size_align(size.max(1), 64).unwrap();
+        match alloc {
+            ArenaAlloc::HugePages if !cfg!(miri) => unsafe { Self::map_huge(layout) },
+            _ => {
+                let ptr = unsafe { alloc_zeroed(layout) };
+                if ptr.is_null() {
+                    handle_alloc_error(layout);
+                }
+                Self {
+                    ptr,
+                    mapped_len: 0,
+                    layout,
+                }
+            }
+        }
+    }
+
+    unsafe fn map_huge(layout: Layout) -> Self {
+        let len = layout.size().next_multiple_of(HUGE_PAGE_SIZE);
+        let prot = PROT_READ | PROT_WRITE;
+        let flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+        let mut ptr = mmap(ptr::null_mut(), len, prot, flags | MAP_HUGETLB, -1, 0);
+        if ptr == MAP_FAILED {
+            // map one extra huge page to align the slab, then unmap the unaligned ends
+            let raw = mmap(ptr::null_mut(), len + HUGE_PAGE_SIZE, prot, flags, -1, 0);
+            if raw == MAP_FAILED {
+                handle_alloc_error(layout);
+            }
+            let head = raw.cast::<u8>().align_offset(HUGE_PAGE_SIZE);
+            if head > 0 {
+                munmap(raw, head);
+            }
+            ptr = raw.cast::<u8>().add(head).cast();
+            if head < HUGE_PAGE_SIZE {
+                munmap(ptr.cast::<u8>().add(len).cast(), HUGE_PAGE_SIZE - head);
+            }
+            // fails harmlessly if transparent huge pages are disabled
+            madvise(ptr, len, MADV_HUGEPAGE);
+        }
+
+        let ptr = ptr.cast::<u8>();
+        for offset in (0..len).step_by(HUGE_PAGE_SIZE) {
+            ptr.add(offset).write_volatile(0);
+        }
+        Self {
+            ptr,
+            mapped_len: len,
+            layout,
+        }
+    }
+
+    pub fn as_ptr(&self) -> *mut u8 {
+        self.ptr
+    }
+}
+
+impl Drop for Arena {
+    fn drop(&mut self) {
+        unsafe {
+            if self.mapped_len == 0 {
+                dealloc(self.ptr, self.layout);
+            } else {
+                munmap(self.ptr.cast(), self.mapped_len);
+            }
+        }
+    }
+}
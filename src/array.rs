@@ -20,6 +20,10 @@ impl<T: Copy, const N: usize> UnsafeArray<T, N> {
     pub fn as_mut_ptr(&mut self) -> *mut T {
         self.data.as_mut_ptr()
     }
+
+    pub fn as_array(&self) -> &[T; N] {
+        &self.data
+    }
 }
 
 impl<T: Debug, const N: usize> Debug for UnsafeArray<T, N> {
@@ -1,13 +1,16 @@
+use redis_hyperloglog::Estimator;
 use redis_hyperloglog::HyperLogLog;
+use redis_hyperloglog::{is_simd_enabled, set_simd};
 
-use std::collections::HashSet;
 use std::fs;
 use std::io;
+use std::sync::Mutex;
 
 use clap::Parser;
 use indicatif::ProgressStyle;
 use ndarray::Array;
 use rayon::iter::IntoParallelIterator;
+use rayon::iter::IntoParallelRefIterator;
 use rayon::iter::ParallelIterator;
 
 #[derive(clap::Parser, Debug)]
@@ -23,49 +26,239 @@ struct Args {
 
     #[clap(long, default_value = "results.json")]
     save: String,
+
+    #[clap(long, value_enum, default_value = "improved")]
+    estimator: EstimatorArg,
+
+    /// Number of logarithmically spaced checkpoints per decade of cardinality.
+    #[clap(long, default_value = "20")]
+    points_per_decade: usize,
+
+    /// Maximum number of inserts per parallel piece of a round.
+    #[clap(long, default_value = "1048576")]
+    chunk_size: usize,
+
+    /// Saves the per-checkpoint error percentiles across rounds.
+    #[clap(long)]
+    save_checkpoints: Option<String>,
+
+    /// Number of sketches merged into the evaluated union (1 evaluates a single sketch).
+    #[clap(short = 'k', long, default_value = "1")]
+    sketches: usize,
+
+    /// Fraction of the values of each sketch that are shared with the next one.
+    #[clap(long, default_value = "0")]
+    overlap: f64,
+
+    /// Runs every merge and count with SIMD both on and off, and checks the results are identical.
+    #[clap(long)]
+    simd_sweep: bool,
 }
 
-#[allow(clippy::needless_range_loop)]
-fn gen_rand_seq(n: usize) -> Vec<u64> {
-    let mut set = HashSet::with_capacity(n);
-    let mut vals = vec![0u64; n];
-    for i in 0..n {
-        let mut val = rand::random::<u64>();
-        while !set.insert(val) {
-            val = rand::random::<u64>();
+#[derive(clap::ValueEnum, Clone, Copy, Debug)]
+enum EstimatorArg {
+    Improved,
+    Mle,
+}
+
+impl From<EstimatorArg> for Estimator {
+    fn from(arg: EstimatorArg) -> Self {
+        match arg {
+            EstimatorArg::Improved => Estimator::Improved,
+            EstimatorArg::Mle => Estimator::Mle,
         }
-        vals[i] = val;
     }
-    vals
 }
 
-#[allow(clippy::cast_precision_loss, clippy::cast_lossless, clippy::needless_range_loop)]
-fn run_error_rate(n: usize) -> (f64, f64, f64) {
-    let vals = gen_rand_seq(n);
+/// A bijective 64-bit mixer (the splitmix64 finalizer).
+/// Distinct inputs give distinct values, so a round needs no set to stay unique.
+fn mix64(mut x: u64) -> u64 {
+    x = (x ^ (x >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    x = (x ^ (x >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    x ^ (x >> 31)
+}
 
-    let mut hll = HyperLogLog::new();
-    assert_eq!(hll.count(), 0);
+/// Returns the cardinalities `1..=n` at which the error is measured,
+/// spaced evenly on a log scale and always ending with `n`.
+#[allow(clippy::cast_precision_loss, clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+fn log_checkpoints(n: usize, per_decade: usize) -> Vec<usize> {
+    let mut checkpoints = Vec::new();
+    for k in 0.. {
+        let c = 10f64.powf(k as f64 / per_decade as f64).round() as usize;
+        if c >= n {
+            break;
+        }
+        if checkpoints.last() != Some(&c) {
+            checkpoints.push(c);
+        }
+    }
+    checkpoints.push(n);
+    checkpoints
+}
 
-    let mut max_err_abs: f64 = 0.0;
-    let mut sum_err_abs: f64 = 0.0;
+/// Splits `0..n` into pieces that end at every checkpoint and are at most `chunk_size` long.
+fn split_pieces(checkpoints: &[usize], chunk_size: usize) -> Vec<(usize, usize)> {
+    let mut pieces = Vec::new();
+    let mut start = 0;
+    for &end in checkpoints {
+        while start < end {
+            let piece_end = end.min(start + chunk_size);
+            pieces.push((start, piece_end));
+            start = piece_end;
+        }
+    }
+    pieces
+}
 
-    for i in 1..=n {
-        hll.insert(&vals[i - 1].to_be_bytes());
-        let count = hll.count();
+/// How the values of a round are spread over the merged sketches.
+///
+/// Sketch `j` holds the values `j * step .. j * step + size`,
+/// so neighbouring sketches share `size - step` values when `step < size`.
+#[derive(Debug, Clone, Copy)]
+struct Layout {
+    sketches: usize,
+    size: usize,
+    step: usize,
+}
 
-        let err = (count as f64 - f64::from(i as u32)) / f64::from(i as u32);
+impl Layout {
+    /// Chooses the sketch size so that the union holds about `n` values.
+    #[allow(clippy::cast_precision_loss, clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+    fn new(n: usize, sketches: usize, overlap: f64) -> Self {
+        let stride = 1.0 - overlap;
+        let size = (n as f64 / ((sketches - 1) as f64 * stride + 1.0)).round().max(1.0) as usize;
+        let step = (size as f64 * stride).round() as usize;
+        Self { sketches, size, step }
+    }
 
-        max_err_abs = max_err_abs.max(err.abs());
-        sum_err_abs += err.abs();
+    /// Cardinality of the union when every sketch holds its first `c` values.
+    fn union_len(&self, c: usize) -> usize {
+        if self.step >= c {
+            self.sketches * c
+        } else {
+            (self.sketches - 1) * self.step + c
+        }
     }
+}
 
-    let last_err = (hll.count() as f64 - n as f64) / n as f64;
+/// Serializes the SIMD toggling of `--simd-sweep` across rounds.
+static SIMD_LOCK: Mutex<()> = Mutex::new(());
 
-    let avg_err = sum_err_abs / (n as f64);
-    (max_err_abs, avg_err, last_err)
+/// Runs `f` with SIMD forced on or off, or as configured when `simd` is `None`.
+fn with_simd<R>(simd: Option<bool>, f: impl FnOnce() -> R) -> R {
+    let Some(enabled) = simd else { return f() };
+    let _guard = SIMD_LOCK.lock().unwrap();
+    let prev = is_simd_enabled();
+    set_simd(enabled);
+    let ans = f();
+    set_simd(prev);
+    ans
 }
 
-#[allow(clippy::needless_range_loop)]
+/// Estimates the union of `sketches`, returning the count and the merged registers.
+///
+/// Several sketches are merged like `PFMERGE` and the result is checked against `PFCOUNT key1 key2 ...`.
+fn count_union(sketches: &[HyperLogLog], estimator: Estimator) -> (u64, Vec<u8>) {
+    let count = |hll: &HyperLogLog| match estimator {
+        Estimator::Improved => hll.count(),
+        Estimator::Mle => hll.count_with(Estimator::Mle),
+    };
+
+    if let [hll] = sketches {
+        return (count(hll), hll.registers().to_vec());
+    }
+
+    let mut dst = HyperLogLog::new();
+    dst.merge(sketches);
+    let ans = count(&dst);
+
+    if estimator == Estimator::Improved {
+        let sources: Vec<&HyperLogLog> = sketches.iter().collect();
+        assert_eq!(HyperLogLog::union_count(&sources), ans);
+    }
+
+    (ans, dst.registers().to_vec())
+}
+
+/// Evaluates one round, returning `(max_err, avg_err, last_err)` over the checkpoints
+/// and the signed relative error of the union at each checkpoint.
+///
+/// The pieces of each sketch are filled in parallel and merged in order.
+/// Merging is a register-wise max, so the sketch at each checkpoint is the same
+/// as if the values were inserted one by one.
+#[allow(clippy::cast_precision_loss)]
+fn run_error_rate(
+    layout: Layout,
+    checkpoints: &[usize],
+    chunk_size: usize,
+    estimator: Estimator,
+    simd_sweep: bool,
+) -> ((f64, f64, f64), Vec<f64>) {
+    let key = rand::random::<u64>();
+
+    let pieces = split_pieces(checkpoints, chunk_size);
+    let jobs: Vec<(usize, usize)> = (0..pieces.len())
+        .flat_map(|p| (0..layout.sketches).map(move |j| (p, j * layout.step)))
+        .collect();
+    let sketches = jobs
+        .par_iter()
+        .map(|&(p, offset)| {
+            let (start, end) = pieces[p];
+            let mut hll = HyperLogLog::new();
+            for i in offset + start..offset + end {
+                hll.insert(&mix64(key.wrapping_add(i as u64)).to_be_bytes());
+            }
+            hll
+        })
+        .collect::<Vec<_>>();
+
+    let modes: &[Option<bool>] = if simd_sweep { &[Some(true), Some(false)] } else { &[None] };
+    let mut accs: Vec<Vec<HyperLogLog>> = modes
+        .iter()
+        .map(|_| (0..layout.sketches).map(|_| HyperLogLog::new()).collect())
+        .collect();
+
+    let mut errors = Vec::with_capacity(checkpoints.len());
+    let mut next = checkpoints.iter().peekable();
+    for (p, &(_, end)) in pieces.iter().enumerate() {
+        let piece = &sketches[p * layout.sketches..(p + 1) * layout.sketches];
+        for (&simd, acc) in modes.iter().zip(&mut accs) {
+            with_simd(simd, || {
+                for (hll, src) in acc.iter_mut().zip(piece) {
+                    hll.merge(std::slice::from_ref(src));
+                }
+            });
+        }
+
+        if next.next_if_eq(&&end).is_some() {
+            let results: Vec<_> = modes
+                .iter()
+                .zip(&accs)
+                .map(|(&simd, acc)| with_simd(simd, || count_union(acc, estimator)))
+                .collect();
+            for other in &results[1..] {
+                assert!(*other == results[0], "SIMD and scalar results differ at {end}");
+            }
+
+            let truth = layout.union_len(end) as f64;
+            errors.push((results[0].0 as f64 - truth) / truth);
+        }
+    }
+
+    let max_err = errors.iter().fold(0.0, |acc: f64, e| acc.max(e.abs()));
+    let avg_err = errors.iter().map(|e| e.abs()).sum::<f64>() / errors.len() as f64;
+    let last_err = *errors.last().unwrap();
+    ((max_err, avg_err, last_err), errors)
+}
+
+/// Nearest-rank percentile of sorted values.
+#[allow(clippy::cast_precision_loss, clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+fn percentile(sorted: &[f64], p: f64) -> f64 {
+    let rank = (p / 100.0 * sorted.len() as f64).ceil() as usize;
+    sorted[rank.clamp(1, sorted.len()) - 1]
+}
+
+#[allow(clippy::needless_range_loop, clippy::cast_precision_loss)]
 fn main() -> io::Result<()> {
     let args = Args::parse();
     let Args {
@@ -73,10 +266,25 @@ fn main() -> io::Result<()> {
         rounds,
         batch_size,
         ref save,
+        estimator,
+        points_per_decade,
+        chunk_size,
+        ref save_checkpoints,
+        sketches,
+        overlap,
+        simd_sweep,
     } = args;
     println!("{args:?}");
+    assert!(n > 0 && chunk_size > 0 && sketches > 0);
+    assert!((0.0..=1.0).contains(&overlap));
+
+    let layout = Layout::new(n, sketches, overlap);
+    println!("{layout:?}, union: {}", layout.union_len(layout.size));
+
+    let checkpoints = log_checkpoints(layout.size, points_per_decade);
 
     let mut total_results = Vec::with_capacity(rounds);
+    let mut total_errors = Vec::with_capacity(rounds);
 
     let pbar = indicatif::ProgressBar::new(rounds as u64);
     pbar.set_style(
@@ -87,7 +295,12 @@ fn main() -> io::Result<()> {
     while r < rounds {
         let batch = (rounds - r).min(batch_size);
 
-        let results = (0..batch).into_par_iter().map(|_| run_error_rate(n)).collect::<Vec<_>>();
+        let (results, errors): (Vec<_>, Vec<_>) = (0..batch)
+            .into_par_iter()
+            .map(|_| run_error_rate(layout, &checkpoints, chunk_size, estimator.into(), simd_sweep))
+            .collect::<Vec<_>>()
+            .into_iter()
+            .unzip();
 
         for i in 0..batch {
             let round = r + i + 1;
@@ -102,6 +315,7 @@ fn main() -> io::Result<()> {
         }
 
         total_results.extend(results);
+        total_errors.extend(errors);
 
         r += batch;
         pbar.inc(batch as u64);
@@ -118,6 +332,36 @@ fn main() -> io::Result<()> {
         println!("sample variance: {sample_var}");
     }
 
+    {
+        println!("{:>12} {:>10} {:>10} {:>10} {:>10} {:>10}", "n", "bias", "p50", "p90", "p99", "max");
+
+        let mut stats = Vec::with_capacity(checkpoints.len());
+        for (j, &c) in checkpoints.iter().enumerate() {
+            let c = layout.union_len(c);
+            let bias = total_errors.iter().map(|e| e[j]).sum::<f64>() / total_errors.len() as f64;
+            let mut abs_errors: Vec<f64> = total_errors.iter().map(|e| e[j].abs()).collect();
+            abs_errors.sort_by(f64::total_cmp);
+
+            let [p50, p90, p99, max] = [50.0, 90.0, 99.0, 100.0].map(|p| percentile(&abs_errors, p));
+            println!(
+                "{:>12} {:>9.4}% {:>9.4}% {:>9.4}% {:>9.4}% {:>9.4}%",
+                c,
+                bias * 100.0,
+                p50 * 100.0,
+                p90 * 100.0,
+                p99 * 100.0,
+                max * 100.0
+            );
+
+            stats.push(serde_json::json!({ "n": c, "bias": bias, "p50": p50, "p90": p90, "p99": p99, "max": max }));
+        }
+
+        if let Some(path) = save_checkpoints {
+            let mut file = fs::File::create(path)?;
+            serde_json::to_writer(&mut file, &stats)?;
+        }
+    }
+
     println!("done");
 
     Ok(())
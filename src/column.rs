@@ -0,0 +1,284 @@
+//! A column of dense sketches stored as a structure of arrays, e.g. one sketch per group
+//! of a `GROUP BY`.
+//!
+//! `cmin`, the cached cardinality and the histogram of every sketch live in their own
+//! contiguous arrays, so counting the whole column streams through the histograms only.
+//! The packed registers share one allocation, 64-byte-aligned and `COLUMN_STRIDE` bytes apart,
+//! so the kernels read a predictable sequence of aligned blocks. For millions of sketches,
+//! the allocation can be backed by huge pages, see `ArenaAlloc`.
+
+use std::marker::PhantomData;
+use std::mem;
+use std::slice;
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering;
+
+use crate::arena::Arena;
+use crate::array::UnsafeArray;
+use crate::config::*;
+use crate::dense::{compress, count_raw, merge_max, raise_register, reg_histogram, DENSE_REGISTERS_LEN, HLL_DENSE_LEN};
+use crate::{HllHasher, MurmurHash64A};
+
+/// Offset of the registers of a sketch within its stride. Like in `HllDense`, the bytes before
+/// the registers are readable, which `merge_max` requires.
+const COLUMN_REGS_OFFSET: usize = 64;
+
+/// Distance between the registers of two consecutive sketches, padding included.
+const COLUMN_STRIDE: usize = (COLUMN_REGS_OFFSET + DENSE_REGISTERS_LEN).next_multiple_of(64);
+
+/// Keys hashed at a time by `insert_grouped`.
+const GROUPED_BATCH: usize = 1024;
+
+/// `insert_hashes_grouped` prefetches the register and histogram this many updates ahead.
+const GROUPED_PREFETCH_DISTANCE: usize = 8;
+
+pub struct HllColumn<H = MurmurHash64A> {
+    len: usize,
+    cmin: Vec<u8>,
+    card: Vec<AtomicU64>,
+    hist: Vec<UnsafeArray<u16, HLL_HIST_LEN>>,
+    regs: Arena,
+    _hasher: PhantomData<fn() -> H>,
+}
+
+unsafe impl<H> Send for HllColumn<H> {}
+unsafe impl<H> Sync for HllColumn<H> {}
+
+impl HllColumn {
+    /// Creates a column of `len` empty sketches.
+    #[must_use]
+    pub fn new(len: usize) -> Self {
+        Self::with_hasher(MurmurHash64A, len)
+    }
+}
+
+impl<H: HllHasher> HllColumn<H> {
+    #[must_use]
+    pub fn with_hasher(hasher: H, len: usize) -> Self {
+        Self::with_alloc(hasher, len, ArenaAlloc::Global)
+    }
+
+    /// Creates a column of `len` empty sketches whose registers are allocated by `alloc`.
+    #[must_use]
+    #[allow(clippy::cast_possible_truncation)]
+    pub fn with_alloc(_: H, len: usize, alloc: ArenaAlloc) -> Self {
+        let regs = Arena::new(len * COLUMN_STRIDE, alloc);
+
+        let hist = (0..len)
+            .map(|_| {
+                // SAFETY: zero is a valid histogram entry
+                let mut hist: UnsafeArray<u16, HLL_HIST_LEN> = unsafe { mem::zeroed() };
+                hist[0] = HLL_REGISTERS as u16;
+                hist
+            })
+            .collect();
+
+        Self {
+            len,
+            cmin: vec![0; len],
+            card: (0..len).map(|_| AtomicU64::new(0)).collect(),
+            hist,
+            regs,
+            _hasher: PhantomData,
+        }
+    }
+
+    /// Adds a key to sketch `i`. Returns `true` if a register was updated.
+    pub fn insert(&mut self, i: usize, key: &[u8]) -> bool {
+        self.insert_hash(i, H::hash(key))
+    }
+
+    pub fn insert_hash(&mut self, i: usize, hash: u64) -> bool {
+        let (index, count) = hll_pattern(hash);
+        let regs = self.regs_mut(i);
+        let raised = unsafe { raise_register(regs, &mut self.hist[i], &mut self.cmin[i], index, count) };
+        if raised {
+            *self.card[i].get_mut() = u64::MAX;
+        }
+        raised
+    }
+
+    /// Adds `keys[k]` to sketch `groups[k]` for each `k`, like one `PFADD` per element.
+    /// Returns `true` if any register was updated.
+    ///
+    /// Meant for streams spread over more groups than fit in the cache, where every update
+    /// misses. The keys are hashed in bulk, so the register and the histogram that an update
+    /// touches can be prefetched a few updates ahead and the misses overlap.
+    pub fn insert_grouped(&mut self, groups: &[usize], keys: &[&[u8]]) -> bool {
+        assert_eq!(groups.len(), keys.len());
+        let mut hashes = [0; GROUPED_BATCH];
+        let mut updated = false;
+        for (groups, keys) in groups.chunks(GROUPED_BATCH).zip(keys.chunks(GROUPED_BATCH)) {
+            for (hash, key) in hashes.iter_mut().zip(keys) {
+                *hash = H::hash(key);
+            }
+            updated |= self.insert_hashes_grouped(groups, &hashes[..keys.len()]);
+        }
+        updated
+    }
+
+    /// Like `insert_grouped`, with keys that are already hashed.
+    pub fn insert_hashes_grouped(&mut self, groups: &[usize], hashes: &[u64]) -> bool {
+        assert_eq!(groups.len(), hashes.len());
+        let mut updated = false;
+        for (k, (&group, &hash)) in groups.iter().zip(hashes).enumerate() {
+            if let (Some(&group), Some(&hash)) =
+                (groups.get(k + GROUPED_PREFETCH_DISTANCE), hashes.get(k + GROUPED_PREFETCH_DISTANCE))
+            {
+                self.prefetch_update(group, hash);
+            }
+            updated |= self.insert_hash(group, hash);
+        }
+        updated
+    }
+}
+
+impl<H> HllColumn<H> {
+    #[must_use]
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    fn regs(&self, i: usize) -> *const u8 {
+        assert!(i < self.len);
+        unsafe { self.regs.as_ptr().add(i * COLUMN_STRIDE + COLUMN_REGS_OFFSET) }
+    }
+
+    fn regs_mut(&mut self, i: usize) -> *mut u8 {
+        assert!(i < self.len);
+        unsafe { self.regs.as_ptr().add(i * COLUMN_STRIDE + COLUMN_REGS_OFFSET) }
+    }
+
+    /// Prefetches the register and the histogram that inserting `hash` into sketch `i` reads.
+    fn prefetch_update(&self, i: usize, hash: u64) {
+        use core::arch::x86_64::{_mm_prefetch, _MM_HINT_T0};
+
+        if cfg!(miri) || i >= self.len {
+            return;
+        }
+        let (index, _) = hll_pattern(hash);
+        unsafe {
+            let reg = self
+                .regs
+                .as_ptr()
+                .add(i * COLUMN_STRIDE + COLUMN_REGS_OFFSET + index as usize * HLL_BITS / 8);
+            _mm_prefetch::<_MM_HINT_T0>(reg.cast_const().cast());
+            _mm_prefetch::<_MM_HINT_T0>(self.hist.as_ptr().add(i).cast());
+        }
+    }
+
+    /// Returns the registers of sketch `i` in the Redis dense encoding.
+    #[must_use]
+    pub fn registers(&self, i: usize) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.regs(i), HLL_DENSE_LEN) }
+    }
+
+    #[allow(clippy::cast_possible_truncation)]
+    pub fn clear(&mut self, i: usize) {
+        unsafe { self.regs_mut(i).write_bytes(0, DENSE_REGISTERS_LEN) };
+        self.cmin[i] = 0;
+        *self.card[i].get_mut() = 0;
+        self.hist[i] = unsafe { mem::zeroed() };
+        self.hist[i][0] = HLL_REGISTERS as u16;
+    }
+
+    #[must_use]
+    pub fn count(&self, i: usize) -> u64 {
+        let card = self.card[i].load(Ordering::Relaxed);
+        if card != u64::MAX {
+            return card;
+        }
+
+        let ans = hll_estimate(self.hist[i].as_array());
+
+        self.card[i].store(ans, Ordering::Relaxed);
+        ans
+    }
+
+    /// Computes the cardinality of every sketch. Only the histograms are read, and stale
+    /// sketches are estimated four at a time, one per SIMD lane.
+    #[must_use]
+    pub fn count_all(&self) -> Vec<u64> {
+        let mut out = vec![0; self.len];
+        let mut stale = [0; 4];
+        let mut n = 0;
+        for i in 0..self.len {
+            let card = self.card[i].load(Ordering::Relaxed);
+            if card != u64::MAX {
+                out[i] = card;
+                continue;
+            }
+            stale[n] = i;
+            n += 1;
+            if n == stale.len() {
+                let cards = hll_estimate_x4(stale.map(|i| self.hist[i].as_array()));
+                for (&i, card) in stale.iter().zip(cards) {
+                    self.card[i].store(card, Ordering::Relaxed);
+                    out[i] = card;
+                }
+                n = 0;
+            }
+        }
+        for &i in &stale[..n] {
+            out[i] = self.count(i);
+        }
+        out
+    }
+
+    /// Estimates the cardinality of the union of the sketches in `sources`.
+    #[must_use]
+    pub fn union_count(&self, sources: &[usize]) -> u64 {
+        let mut reg_raw = [0; HLL_REGISTERS];
+        unsafe {
+            self.gather_max(&mut reg_raw, sources);
+            count_raw(reg_raw.as_ptr())
+        }
+    }
+
+    /// Merges sketch `src` into sketch `dst`.
+    pub fn merge_into(&mut self, src: usize, dst: usize) {
+        self.merge_gather(dst, &[src]);
+    }
+
+    /// Merges the sketches in `sources` into sketch `dst`. `sources` may contain `dst`.
+    pub fn merge_gather(&mut self, dst: usize, sources: &[usize]) {
+        let mut reg_raw = [0; HLL_REGISTERS];
+        unsafe {
+            self.gather_max(&mut reg_raw, &[dst]);
+            self.gather_max(&mut reg_raw, sources);
+            self.load_raw(dst, &reg_raw);
+        }
+    }
+
+    /// Raises `reg_raw` to the registers of each sketch in `sources`, skipping empty ones.
+    unsafe fn gather_max(&self, reg_raw: &mut [u8; HLL_REGISTERS], sources: &[usize]) {
+        for &src in sources {
+            let regs = self.regs(src);
+            if usize::from(self.hist[src][0]) != HLL_REGISTERS {
+                merge_max(reg_raw.as_mut_ptr(), regs);
+            }
+        }
+    }
+
+    /// Replaces the registers of sketch `i` with `reg_raw` and marks its cardinality as stale.
+    unsafe fn load_raw(&mut self, i: usize, reg_raw: &[u8; HLL_REGISTERS]) {
+        let regs = self.regs_mut(i);
+        let hist = &mut self.hist[i];
+        reg_histogram(hist.as_mut_ptr(), reg_raw.as_ptr());
+
+        let mut count_min = 0;
+        while hist[count_min] == 0 {
+            count_min += 1;
+        }
+        self.cmin[i] = count_min;
+
+        *self.card[i].get_mut() = u64::MAX;
+
+        compress(regs, reg_raw.as_ptr());
+    }
+}
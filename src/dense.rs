@@ -2,28 +2,59 @@ use std::alloc::alloc_zeroed;
 use std::alloc::dealloc;
 use std::alloc::handle_alloc_error;
 use std::alloc::Layout;
+use std::mem::MaybeUninit;
 use std::ptr;
 use std::sync::atomic::AtomicU64;
 use std::sync::atomic::Ordering;
 
 use crate::array::UnsafeArray;
 use crate::config::*;
+use crate::mle::{hll_estimate_mle, JointHist, A_EQ_B, A_GT_B, A_LT_B};
+use crate::nibble::{decode_nibbles, encode_nibbles, NIBBLES_LEN, NIBBLE_ESCAPE};
+use crate::redis;
 
 const HLL_BITS_MASK: u16 = (1 << HLL_BITS) - 1;
 
+/// Size of the packed registers in the Redis dense encoding.
+pub const HLL_DENSE_LEN: usize = (HLL_REGISTERS * HLL_BITS + 7) / 8;
+
 const DENSE_PAD_LEN: usize = 16;
-const DENSE_REGISTERS_LEN: usize = (HLL_REGISTERS * HLL_BITS + 7) / 8 + DENSE_PAD_LEN;
+pub const DENSE_REGISTERS_LEN: usize = HLL_DENSE_LEN + DENSE_PAD_LEN;
+
+/// Below this batch size, `insert_hashes` inserts one by one.
+const INSERT_BATCH_MIN: usize = 1024;
+
+/// Number of hashes filtered against `cmin` at a time.
+const FILTER_CHUNK: usize = 1024;
+
+/// Below this number of surviving hashes per chunk, unpacking and compressing the registers
+/// costs more than it saves.
+const UNPACK_MIN: usize = 256;
+
+/// The compact encoding stores each register as a 4-bit offset from the smallest register.
+/// Offsets of 15 or more are escaped and listed as `(index: u16, register: u8)` exceptions.
+///
+/// Layout: magic, hasher id, base register, number of exceptions (u16), cached cardinality (u64),
+/// `HLL_REGISTERS / 2` bytes of nibbles (even register in the low nibble), then the exceptions.
+/// Integers are little-endian.
+const COMPACT_MAGIC: [u8; 4] = *b"HLLC";
+const COMPACT_HEADER_LEN: usize = 4 + 1 + 1 + 2 + 8;
+const COMPACT_NIBBLES_LEN: usize = NIBBLES_LEN;
 
-#[repr(C)]
+/// The registers start on a cache line, so `compress_nt` writes whole lines.
+#[repr(C, align(64))]
 pub struct HllDense {
     repr: HllRepr,
     cmin: u8,
     _pad: [u8; 6],
     card: AtomicU64,
     hist: UnsafeArray<u16, HLL_HIST_LEN>,
+    _pad_regs: [u8; 48],
     regs: UnsafeArray<u8, DENSE_REGISTERS_LEN>,
 }
 
+const _: () = assert!(std::mem::offset_of!(HllDense, regs) % 64 == 0);
+
 impl HllDense {
     pub fn create() -> *mut Self {
         let layout = Layout::new::<Self>();
@@ -60,100 +91,419 @@ impl HllDense {
 
     pub fn insert(&mut self, hash: u64) -> bool {
         let (index, count) = hll_pattern(hash);
+        self.raise(index, count)
+    }
 
-        if count < self.cmin {
-            return false;
+    /// Raises the register at `index` to `count`. Returns `true` if the register changed.
+    #[inline(always)]
+    fn raise(&mut self, index: u32, count: u8) -> bool {
+        let raised = unsafe { raise_register(self.regs.as_mut_ptr(), &mut self.hist, &mut self.cmin, index, count) };
+        if raised {
+            *self.card.get_mut() = u64::MAX;
         }
+        raised
+    }
 
-        let old_count = unsafe { get_register(self.regs.as_ptr(), index) };
-
-        if count <= old_count {
-            return false;
+    /// Inserts a batch of hashes. Returns `true` if any register was updated.
+    ///
+    /// Hashes whose rank is below `cmin` cannot update any register. They are dropped
+    /// by a vectorized mask test before the registers are touched, which discards most of
+    /// the batch once the sketch is saturated.
+    ///
+    /// When many hashes survive, they are bucketed by register index into an unpacked copy of
+    /// the registers, so each update is a byte access instead of a read-modify-write of the
+    /// packed bits. This only pays off when unpacking and compressing are vectorized.
+    pub fn insert_hashes(&mut self, hashes: &[u64]) -> bool {
+        if hashes.len() < INSERT_BATCH_MIN {
+            let mut updated = false;
+            for &hash in hashes {
+                updated |= self.insert(hash);
+            }
+            return updated;
         }
 
+        let unpack_is_fast =
+            const { HLL_BITS == 6 && HLL_REGISTERS % 64 == 0 } && is_simd_enabled() && is_x86_feature_detected!("avx2");
+
         unsafe {
-            set_register(self.regs.as_mut_ptr(), index, count);
+            let mut reg_raw: MaybeUninit<[u8; HLL_REGISTERS]> = MaybeUninit::uninit();
+            let reg_raw = reg_raw.as_mut_ptr().cast::<u8>();
+            let mut unpacked = false;
+
+            let mut buf: MaybeUninit<[u64; FILTER_CHUNK + 4]> = MaybeUninit::uninit();
+            let buf = buf.as_mut_ptr().cast::<u64>();
+
+            let mut updated = false;
+            let mut raw_updated = false;
+
+            for chunk in hashes.chunks(FILTER_CHUNK) {
+                // `cmin` only grows, so filtering with a stale one is still exact.
+                let n = filter_rank(buf, chunk, self.cmin);
+                let survivors = std::slice::from_raw_parts(buf, n);
+
+                if !unpacked && (n < UNPACK_MIN || !unpack_is_fast) {
+                    for &hash in survivors {
+                        updated |= self.insert(hash);
+                    }
+                    continue;
+                }
 
-            self.hist[old_count] -= 1;
-            self.hist[count] += 1;
+                if !unpacked {
+                    unpack(reg_raw, self.regs.as_ptr());
+                    unpacked = true;
+                }
 
-            if old_count == self.cmin {
+                for &hash in survivors {
+                    let (index, count) = hll_pattern(hash);
+                    let old_count = &mut *reg_raw.add(index as usize);
+                    if count > *old_count {
+                        self.hist[*old_count] -= 1;
+                        self.hist[count] += 1;
+                        *old_count = count;
+                        raw_updated = true;
+                    }
+                }
+            }
+
+            if raw_updated {
                 let mut count_min = self.cmin;
                 while self.hist[count_min] == 0 {
                     count_min += 1;
                 }
                 self.cmin = count_min;
+
+                *self.card.get_mut() = u64::MAX;
+
+                compress(self.regs.as_mut_ptr(), reg_raw);
             }
 
-            *self.card.get_mut() = u64::MAX;
+            updated | raw_updated
         }
-
-        true
     }
 
-    #[allow(
-        clippy::cast_precision_loss,
-        clippy::cast_lossless,
-        clippy::cast_sign_loss,
-        clippy::cast_possible_truncation
-    )]
     pub fn count(&self) -> u64 {
         let card = self.card.load(Ordering::Relaxed);
         if card != u64::MAX {
             return card;
         }
 
-        let m = HLL_REGISTERS as f64;
+        let ans = hll_estimate(self.hist.as_array());
 
-        let h_last = self.hist[HLL_Q + 1] as f64;
-        let mut z = m * hll_tau((m - h_last) / m);
+        self.card.store(ans, Ordering::Relaxed);
+        ans
+    }
+
+    /// Computes the cardinality with `estimator`, bypassing the cache.
+    pub fn count_with(&self, estimator: Estimator) -> u64 {
+        match estimator {
+            Estimator::Improved => hll_estimate(self.hist.as_array()),
+            Estimator::Mle => hll_estimate_mle(self.hist.as_array()),
+        }
+    }
+
+    /// Computes the cardinality of packed dense registers without a histogram cache.
+    pub fn count_from_dense(reg_dense: &[u8]) -> u64 {
+        assert_eq!(reg_dense.len(), HLL_DENSE_LEN);
+        unsafe {
+            let mut reg_raw: MaybeUninit<[u8; HLL_REGISTERS]> = MaybeUninit::uninit();
+            let mut hist = [0; HLL_HIST_LEN];
 
-        let mut i = HLL_Q;
-        loop {
-            let count = self.hist[i];
-            z += count as f64;
-            z *= 0.5;
+            unpack(reg_raw.as_mut_ptr().cast(), reg_dense.as_ptr());
+            reg_histogram(hist.as_mut_ptr(), reg_raw.as_ptr().cast());
 
-            i -= 1;
-            if i == 0 {
-                break;
+            hll_estimate(&hist)
+        }
+    }
+
+    /// Estimates the cardinality of the union without writing a destination.
+    pub fn union_count<'a>(sources: impl IntoIterator<Item = &'a Self>) -> u64 {
+        let mut sources = sources.into_iter().peekable();
+        let Some(first) = sources.next() else { return 0 };
+        if sources.peek().is_none() {
+            return first.count();
+        }
+        unsafe {
+            let mut reg_raw: MaybeUninit<[u8; HLL_REGISTERS]> = MaybeUninit::uninit();
+            let reg_raw = reg_raw.as_mut_ptr().cast::<u8>();
+            let mut hist = [0; HLL_HIST_LEN];
+
+            unpack(reg_raw, first.regs.as_ptr());
+            for src in sources {
+                if src.card.load(Ordering::Relaxed) != 0 {
+                    merge_max(reg_raw, src.regs.as_ptr());
+                }
             }
+
+            reg_histogram(hist.as_mut_ptr(), reg_raw);
+            hll_estimate(&hist)
         }
+    }
 
-        let h0 = self.hist[0] as f64;
-        z += m * hll_sigma(h0 / m);
+    /// Builds the joint histogram of two sketches in one pass over both register arrays.
+    pub fn joint_histogram(a: &Self, b: &Self) -> JointHist {
+        let mut hist = JointHist::new();
+        unsafe { joint_histogram(&mut hist, a.regs.as_ptr(), b.regs.as_ptr()) }
+        hist
+    }
 
-        let e = HLL_ALPHA_INF * m * m / z;
-        let ans = e.round() as u64;
+    pub fn histogram(&self) -> &[u16; HLL_HIST_LEN] {
+        self.hist.as_array()
+    }
 
-        self.card.store(ans, Ordering::Relaxed);
-        ans
+    /// Returns the cached cardinality, or `u64::MAX` if it is stale.
+    pub fn cached_count(&self) -> u64 {
+        self.card.load(Ordering::Relaxed)
+    }
+
+    pub fn set_cached_count(&self, card: u64) {
+        self.card.store(card, Ordering::Relaxed);
+    }
+
+    pub fn registers(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts(self.regs.as_ptr(), HLL_DENSE_LEN) }
     }
 
-    pub fn merge(&mut self, sources: &[&Self]) {
+    /// Serializes the registers and the cached cardinality in the compact encoding.
+    pub fn to_compact(&self, hasher: u8) -> Vec<u8> {
         unsafe {
-            let mut reg_raw = [0; HLL_REGISTERS];
+            let mut reg_raw: MaybeUninit<[u8; HLL_REGISTERS]> = MaybeUninit::uninit();
+            let reg_raw = reg_raw.as_mut_ptr().cast::<u8>();
+            unpack(reg_raw, self.regs.as_ptr());
+            raw_to_compact(reg_raw, hasher, self.cmin, self.card.load(Ordering::Relaxed))
+        }
+    }
+
+    /// Deserializes the compact encoding. Returns `None` if `bytes` is not a valid encoding,
+    /// or was written with another hasher.
+    pub fn from_compact(bytes: &[u8], hasher: u8) -> Option<*mut Self> {
+        let (header, body) = bytes.split_at_checked(COMPACT_HEADER_LEN)?;
+        if header[..4] != COMPACT_MAGIC || header[4] != hasher {
+            return None;
+        }
+        let base = header[5];
+        let exceptions = usize::from(u16::from_le_bytes([header[6], header[7]]));
+        let card = u64::from_le_bytes(header[8..].try_into().unwrap());
+
+        if body.len() != COMPACT_NIBBLES_LEN + exceptions * 3 || usize::from(base) > HLL_Q + 1 {
+            return None;
+        }
+        let (nibbles, exceptions_bytes) = body.split_at(COMPACT_NIBBLES_LEN);
+
+        unsafe {
+            let mut reg_raw: MaybeUninit<[u8; HLL_REGISTERS]> = MaybeUninit::uninit();
+            let reg_raw = reg_raw.as_mut_ptr().cast::<u8>();
+            if decode_nibbles(reg_raw, nibbles.as_ptr(), base) != exceptions {
+                return None;
+            }
+
+            for e in exceptions_bytes.chunks_exact(3) {
+                let index = usize::from(u16::from_le_bytes([e[0], e[1]]));
+                let value = e[2];
+                if index >= HLL_REGISTERS || *reg_raw.add(index) != base + NIBBLE_ESCAPE || value < base + NIBBLE_ESCAPE {
+                    return None;
+                }
+                *reg_raw.add(index) = value;
+            }
+
+            let reg_max = std::slice::from_raw_parts(reg_raw, HLL_REGISTERS).iter().copied().max();
+            if usize::from(reg_max.unwrap_or(0)) > HLL_Q + 1 {
+                return None;
+            }
+
+            let this = Self::create();
+            (*this).load_raw(reg_raw);
+
+            // `card == 0` marks an empty sketch, which other code relies on
+            let empty = usize::from((*this).hist[0]) == HLL_REGISTERS;
+            let card = if empty {
+                0
+            } else if card == 0 {
+                u64::MAX
+            } else {
+                card
+            };
+            *(*this).card.get_mut() = card;
+
+            Some(this)
+        }
+    }
+
+    /// Merges `sources` into `self`. With `streaming`, the registers are written with
+    /// non-temporal stores, which do not evict the working set of other sketches but make the
+    /// next access to `self` miss: meant for a destination that is not read again soon.
+    ///
+    /// The first non-empty operand is unpacked into `scratch` rather than merged into zeros,
+    /// so the contents of `scratch` do not matter.
+    pub fn merge(&mut self, sources: &[&Self], scratch: &mut MergeScratch, streaming: bool) {
+        let mut sources = sources.iter();
+        unsafe {
+            let reg_raw = scratch.as_mut_ptr();
 
             if *self.card.get_mut() != 0 {
-                merge_max(reg_raw.as_mut_ptr(), self.regs.as_ptr());
+                unpack(reg_raw, self.regs.as_ptr());
+            } else if let Some(first) = sources.next() {
+                unpack(reg_raw, first.regs.as_ptr());
+            } else {
+                return;
             }
-            for &src in sources {
-                merge_max(reg_raw.as_mut_ptr(), src.regs.as_ptr());
+            for src in sources {
+                merge_max(reg_raw, src.regs.as_ptr());
             }
 
-            reg_histogram(self.hist.as_mut_ptr(), reg_raw.as_ptr());
+            if streaming {
+                self.load_raw_nt(reg_raw);
+            } else {
+                self.load_raw(reg_raw);
+            }
+        }
+    }
 
-            let mut count_min = 0;
-            while self.hist[count_min] == 0 {
-                count_min += 1;
+    /// Merges the sparse opcodes of a Redis string value as point updates on the packed
+    /// registers, so the cost is proportional to the number of non-zero registers of the source
+    /// rather than to `HLL_REGISTERS`. Returns `None`, leaving the sketch unchanged, if the
+    /// opcodes are corrupted.
+    #[allow(clippy::cast_possible_truncation)]
+    pub fn merge_sparse(&mut self, sparse: &[u8]) -> Option<()> {
+        redis::sparse_for_each_val(sparse, |index, len, value| {
+            for index in index..index + len {
+                self.raise(index as u32, value);
             }
-            self.cmin = count_min;
+        })
+    }
 
-            *self.card.get_mut() = u64::MAX;
+    /// Writes the registers to `reg_raw`, one byte each.
+    pub unsafe fn to_raw(&self, reg_raw: *mut u8) {
+        unpack(reg_raw, self.regs.as_ptr());
+    }
+
+    /// Raises each register of `reg_raw` to the matching register of the sketch.
+    pub unsafe fn max_into(&self, reg_raw: *mut u8) {
+        merge_max(reg_raw, self.regs.as_ptr());
+    }
+
+    /// Replaces the registers with `reg_raw` and marks the cardinality as stale.
+    pub unsafe fn load_raw(&mut self, reg_raw: *const u8) {
+        self.load_header(reg_raw);
+        compress(self.regs.as_mut_ptr(), reg_raw);
+    }
+
+    /// Like `load_raw`, with non-temporal stores for the registers.
+    pub unsafe fn load_raw_nt(&mut self, reg_raw: *const u8) {
+        self.load_header(reg_raw);
+        compress_nt(self.regs.as_mut_ptr(), reg_raw);
+    }
+
+    unsafe fn load_header(&mut self, reg_raw: *const u8) {
+        reg_histogram(self.hist.as_mut_ptr(), reg_raw);
+
+        let mut count_min = 0;
+        while self.hist[count_min] == 0 {
+            count_min += 1;
+        }
+        self.cmin = count_min;
+
+        *self.card.get_mut() = u64::MAX;
+    }
+}
+
+/// Space for the unpacked registers of a merge, aligned to a cache line.
+/// It can be reused across merges; see `HyperLogLog::merge_with_scratch`.
+#[repr(C, align(64))]
+pub struct MergeScratch {
+    reg_raw: [u8; HLL_REGISTERS],
+}
+
+impl MergeScratch {
+    #[must_use]
+    pub const fn new() -> Self {
+        Self {
+            reg_raw: [0; HLL_REGISTERS],
+        }
+    }
+
+    pub fn as_mut_ptr(&mut self) -> *mut u8 {
+        self.reg_raw.as_mut_ptr()
+    }
+}
+
+impl Default for MergeScratch {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+/// Computes the cardinality of unpacked registers.
+pub unsafe fn count_raw(reg_raw: *const u8) -> u64 {
+    let mut hist = [0; HLL_HIST_LEN];
+    reg_histogram(hist.as_mut_ptr(), reg_raw);
+    hll_estimate(&hist)
+}
+
+/// Packs unpacked registers into the Redis dense encoding.
+pub unsafe fn raw_to_dense(reg_raw: *const u8) -> Vec<u8> {
+    let mut reg_dense = vec![0; DENSE_REGISTERS_LEN];
+    compress(reg_dense.as_mut_ptr(), reg_raw);
+    reg_dense.truncate(HLL_DENSE_LEN);
+    reg_dense
+}
+
+/// Serializes unpacked registers whose smallest value is `base` in the compact encoding.
+#[allow(clippy::cast_possible_truncation)]
+pub unsafe fn raw_to_compact(reg_raw: *const u8, hasher: u8, base: u8, card: u64) -> Vec<u8> {
+    let mut out = Vec::with_capacity(COMPACT_HEADER_LEN + COMPACT_NIBBLES_LEN);
+    out.extend_from_slice(&COMPACT_MAGIC);
+    out.push(hasher);
+    out.push(base);
+    out.extend_from_slice(&[0; 2]);
+    out.extend_from_slice(&card.to_le_bytes());
+    out.resize(COMPACT_HEADER_LEN + COMPACT_NIBBLES_LEN, 0);
+
+    // not appended to `out` directly, which may reallocate under `nibbles`
+    let mut exceptions = Vec::new();
+    let nibbles = out.as_mut_ptr().add(COMPACT_HEADER_LEN);
+    let n = encode_nibbles(nibbles, reg_raw, base, &mut |index, value| {
+        exceptions.extend_from_slice(&(index as u16).to_le_bytes());
+        exceptions.push(value);
+    });
+    out[6..8].copy_from_slice(&(n as u16).to_le_bytes());
+    out.extend_from_slice(&exceptions);
+    out
+}
+
+/// Raises the packed register at `index` to `count`, keeping `hist` and `cmin` up to date.
+/// Returns `true` if the register changed.
+#[inline(always)]
+pub unsafe fn raise_register(
+    reg_dense: *mut u8,
+    hist: &mut UnsafeArray<u16, HLL_HIST_LEN>,
+    cmin: &mut u8,
+    index: u32,
+    count: u8,
+) -> bool {
+    if count < *cmin {
+        return false;
+    }
+
+    let old_count = get_register(reg_dense, index);
+
+    if count <= old_count {
+        return false;
+    }
+
+    set_register(reg_dense, index, count);
+
+    hist[old_count] -= 1;
+    hist[count] += 1;
 
-            compress(self.regs.as_mut_ptr(), reg_raw.as_ptr());
+    if old_count == *cmin {
+        let mut count_min = *cmin;
+        while hist[count_min] == 0 {
+            count_min += 1;
         }
+        *cmin = count_min;
     }
+
+    true
 }
 
 #[inline(always)]
@@ -181,7 +531,79 @@ unsafe fn set_register(reg_dense: *mut u8, index: u32, value: u8) {
     ptr.write_unaligned(value);
 }
 
-unsafe fn reg_histogram(hist: *mut u16, reg_raw: *const u8) {
+/// Copies the hashes whose rank is at least `cmin` to `out`, and returns their number.
+/// `out` must have room for `hashes.len() + 4` hashes.
+#[inline(always)]
+unsafe fn filter_rank(out: *mut u64, hashes: &[u64], cmin: u8) -> usize {
+    // rank >= cmin  <=>  the lowest `cmin - 1` bits above the index are zero
+    let mask = if cmin <= 1 { 0 } else { ((1u64 << (cmin - 1)) - 1) << HLL_P };
+    if is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        return filter_rank_avx2(out, hashes, mask);
+    }
+    filter_rank_scalar(out, hashes, mask)
+}
+
+unsafe fn filter_rank_scalar(out: *mut u64, hashes: &[u64], mask: u64) -> usize {
+    let mut n = 0;
+    for &hash in hashes {
+        *out.add(n) = hash;
+        n += usize::from(hash & mask == 0);
+    }
+    n
+}
+
+/// Tests four hashes per vector and left-packs the survivors with a permutation
+/// selected by the comparison mask, so the store is branch-free.
+#[allow(clippy::cast_sign_loss, clippy::cast_possible_wrap)]
+#[target_feature(enable = "avx2")]
+unsafe fn filter_rank_avx2(out: *mut u64, hashes: &[u64], mask: u64) -> usize {
+    use core::arch::x86_64::*;
+
+    const fn compact_table() -> [[i32; 8]; 16] {
+        let mut table = [[0; 8]; 16];
+        let mut m = 0;
+        while m < 16 {
+            let mut k = 0;
+            let mut lane = 0;
+            while lane < 4 {
+                if m & (1 << lane) != 0 {
+                    table[m][2 * k] = 2 * lane;
+                    table[m][2 * k + 1] = 2 * lane + 1;
+                    k += 1;
+                }
+                lane += 1;
+            }
+            m += 1;
+        }
+        table
+    }
+    static COMPACT: [[i32; 8]; 16] = compact_table();
+
+    let vmask = _mm256_set1_epi64x(mask as i64);
+    let zero = _mm256_setzero_si256();
+
+    let mut n = 0;
+    let mut chunks = hashes.chunks_exact(4);
+    for chunk in &mut chunks {
+        let x = _mm256_loadu_si256(chunk.as_ptr().cast());
+        let hit = _mm256_cmpeq_epi64(_mm256_and_si256(x, vmask), zero);
+        let m = _mm256_movemask_pd(_mm256_castsi256_pd(hit)) as usize;
+        let perm = _mm256_loadu_si256(COMPACT[m].as_ptr().cast());
+        _mm256_storeu_si256(out.add(n).cast(), _mm256_permutevar8x32_epi32(x, perm));
+        n += m.count_ones() as usize;
+    }
+    n + filter_rank_scalar(out.add(n), chunks.remainder(), mask)
+}
+
+#[inline(always)]
+pub unsafe fn reg_histogram(hist: *mut u16, reg_raw: *const u8) {
+    if const { HLL_BITS == 6 && HLL_REGISTERS % 32 == 0 } && is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        return reg_histogram_avx2(hist, reg_raw);
+    }
+    reg_histogram_scalar(hist, reg_raw);
+}
+
+unsafe fn reg_histogram_scalar(hist: *mut u16, reg_raw: *const u8) {
     hist.write_bytes(0, HLL_HIST_LEN);
     for i in 0..HLL_REGISTERS {
         let val = *reg_raw.add(i);
@@ -189,8 +611,212 @@ unsafe fn reg_histogram(hist: *mut u16, reg_raw: *const u8) {
     }
 }
 
+/// Counts each bin with lane-private byte counters (cmpeq + sub) instead of scattered increments.
+/// The byte counters are widened by `vpsadbw` before they can overflow.
+/// Only the bins between the smallest and the largest register are visited.
+#[allow(clippy::cast_possible_truncation, clippy::cast_possible_wrap, clippy::cast_sign_loss)]
+#[target_feature(enable = "avx2")]
+unsafe fn reg_histogram_avx2(hist: *mut u16, reg_raw: *const u8) {
+    use core::arch::x86_64::*;
+
+    const VECS: usize = HLL_REGISTERS / 32;
+
+    hist.write_bytes(0, HLL_HIST_LEN);
+
+    let mut vmin = _mm256_set1_epi8(-1);
+    let mut vmax = _mm256_setzero_si256();
+    for i in 0..VECS {
+        let x = _mm256_loadu_si256(reg_raw.add(i * 32).cast());
+        vmin = _mm256_min_epu8(vmin, x);
+        vmax = _mm256_max_epu8(vmax, x);
+    }
+
+    let mut t = [[0u8; 32]; 2];
+    _mm256_storeu_si256(t[0].as_mut_ptr().cast(), vmin);
+    _mm256_storeu_si256(t[1].as_mut_ptr().cast(), vmax);
+    let lo = usize::from(t[0].iter().copied().min().unwrap_or(0));
+    let hi = usize::from(t[1].iter().copied().max().unwrap_or(0));
+
+    let zero = _mm256_setzero_si256();
+
+    let mut base = lo;
+    while base <= hi {
+        let mut bins = [zero; 8];
+        let mut wide = [zero; 8];
+        for (k, v) in bins.iter_mut().enumerate() {
+            *v = _mm256_set1_epi8((base + k) as i8);
+        }
+
+        let mut c = 0;
+        while c < VECS {
+            let end = (c + 255).min(VECS);
+
+            let mut acc = [zero; 8];
+            for i in c..end {
+                let x = _mm256_loadu_si256(reg_raw.add(i * 32).cast());
+                for (a, &v) in acc.iter_mut().zip(&bins) {
+                    *a = _mm256_sub_epi8(*a, _mm256_cmpeq_epi8(x, v));
+                }
+            }
+            for (w, &a) in wide.iter_mut().zip(&acc) {
+                *w = _mm256_add_epi64(*w, _mm256_sad_epu8(a, zero));
+            }
+
+            c = end;
+        }
+
+        for (k, &w) in wide.iter().enumerate().take(hi + 1 - base) {
+            let s = _mm_add_epi64(_mm256_castsi256_si128(w), _mm256_extracti128_si256(w, 1));
+            let s = _mm_add_epi64(s, _mm_unpackhi_epi64(s, s));
+            *hist.add(base + k) = _mm_cvtsi128_si32(s) as u16;
+        }
+
+        base += 8;
+    }
+}
+
+/// Unpacks the dense registers into `reg_raw` without reading outside of `reg_dense[..HLL_DENSE_LEN]`.
 #[inline(always)]
-unsafe fn merge_max(reg_raw: *mut u8, reg_dense: *const u8) {
+pub unsafe fn unpack(reg_raw: *mut u8, reg_dense: *const u8) {
+    if const { HLL_BITS == 6 && HLL_REGISTERS % 32 == 0 } && is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        return unpack_avx2(reg_raw, reg_dense);
+    }
+    unpack_scalar(reg_raw, reg_dense);
+}
+
+#[allow(clippy::cast_possible_truncation)]
+unsafe fn unpack_scalar(reg_raw: *mut u8, reg_dense: *const u8) {
+    for i in 0..HLL_REGISTERS {
+        let byte = i * HLL_BITS / 8;
+        let low = (i * HLL_BITS) & 7;
+        let b0 = u16::from(*reg_dense.add(byte));
+        let b1 = if low + HLL_BITS > 8 {
+            u16::from(*reg_dense.add(byte + 1))
+        } else {
+            0
+        };
+        *reg_raw.add(i) = (((b0 | (b1 << 8)) >> low) & HLL_BITS_MASK) as u8;
+    }
+}
+
+#[target_feature(enable = "avx2")]
+unsafe fn unpack_avx2(reg_raw: *mut u8, reg_dense: *const u8) {
+    use core::arch::x86_64::*;
+
+    const BLOCKS: usize = HLL_REGISTERS / 32;
+
+    // Each block loads 4 bytes before and after its 24 bytes,
+    // so the first and the last block go through a padded copy.
+    let mut edge = [0u8; 32];
+
+    for j in 0..BLOCKS {
+        let r = if j == 0 || j == BLOCKS - 1 {
+            ptr::copy_nonoverlapping(reg_dense.add(j * 24), edge.as_mut_ptr().add(4), 24);
+            edge.as_ptr()
+        } else {
+            reg_dense.add(j * 24 - 4)
+        };
+
+        let y = unpack_block_avx2(r);
+        _mm256_storeu_si256(reg_raw.add(j * 32).cast(), y);
+    }
+}
+
+/// Unpacks the 32 registers stored in `r[4..28]`. Reads `r[0..32]`.
+#[inline]
+#[target_feature(enable = "avx2")]
+unsafe fn unpack_block_avx2(r: *const u8) -> core::arch::x86_64::__m256i {
+    use core::arch::x86_64::*;
+
+    let shuffle = _mm256_setr_epi8(
+        4, 5, 6, -1, //
+        7, 8, 9, -1, //
+        10, 11, 12, -1, //
+        13, 14, 15, -1, //
+        0, 1, 2, -1, //
+        3, 4, 5, -1, //
+        6, 7, 8, -1, //
+        9, 10, 11, -1, //
+    );
+
+    let x = _mm256_loadu_si256(r.cast());
+    let x = _mm256_shuffle_epi8(x, shuffle);
+
+    let a1 = _mm256_and_si256(x, _mm256_set1_epi32(0x0000_003f));
+    let a2 = _mm256_and_si256(x, _mm256_set1_epi32(0x0000_0fc0));
+    let a3 = _mm256_and_si256(x, _mm256_set1_epi32(0x0003_f000));
+    let a4 = _mm256_and_si256(x, _mm256_set1_epi32(0x00fc_0000));
+
+    let a2 = _mm256_slli_epi32(a2, 2);
+    let a3 = _mm256_slli_epi32(a3, 4);
+    let a4 = _mm256_slli_epi32(a4, 6);
+
+    let y1 = _mm256_or_si256(a1, a2);
+    let y2 = _mm256_or_si256(a3, a4);
+    _mm256_or_si256(y1, y2)
+}
+
+#[inline(always)]
+unsafe fn joint_histogram(hist: &mut JointHist, reg_a: *const u8, reg_b: *const u8) {
+    if const { HLL_BITS == 6 && HLL_REGISTERS % 32 == 0 } && is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        return joint_histogram_avx2(hist, reg_a, reg_b);
+    }
+    joint_histogram_scalar(hist, reg_a, reg_b);
+}
+
+#[allow(clippy::cast_possible_truncation)]
+unsafe fn joint_histogram_scalar(hist: &mut JointHist, reg_a: *const u8, reg_b: *const u8) {
+    for i in 0..HLL_REGISTERS {
+        let a = usize::from(get_register(reg_a, i as u32));
+        let b = usize::from(get_register(reg_b, i as u32));
+        let band = match a.cmp(&b) {
+            std::cmp::Ordering::Greater => A_GT_B,
+            std::cmp::Ordering::Less => A_LT_B,
+            std::cmp::Ordering::Equal => A_EQ_B,
+        };
+        hist.a[band + a] += 1;
+        hist.b[band + b] += 1;
+    }
+}
+
+/// Tags each register pair with its band in one fused pass:
+/// `a >= b` sets bit 6 and `b >= a` sets bit 7, so the tagged bytes index `JointHist` directly.
+#[target_feature(enable = "avx2")]
+unsafe fn joint_histogram_avx2(hist: &mut JointHist, reg_a: *const u8, reg_b: *const u8) {
+    use core::arch::x86_64::*;
+
+    let mut ra = reg_a.sub(4);
+    let mut rb = reg_b.sub(4);
+
+    let mut ta = [0u8; 32];
+    let mut tb = [0u8; 32];
+
+    for _ in 0..HLL_REGISTERS / 32 {
+        let a = unpack_block_avx2(ra);
+        let b = unpack_block_avx2(rb);
+
+        let max = _mm256_max_epu8(a, b);
+        let a_ge = _mm256_and_si256(_mm256_cmpeq_epi8(max, a), _mm256_set1_epi8(0x40));
+        let b_ge = _mm256_and_si256(_mm256_cmpeq_epi8(max, b), _mm256_set1_epi8(-0x80));
+        let band = _mm256_or_si256(a_ge, b_ge);
+
+        _mm256_storeu_si256(ta.as_mut_ptr().cast(), _mm256_or_si256(a, band));
+        _mm256_storeu_si256(tb.as_mut_ptr().cast(), _mm256_or_si256(b, band));
+
+        for (&x, &y) in ta.iter().zip(&tb) {
+            hist.a[usize::from(x)] += 1;
+            hist.b[usize::from(y)] += 1;
+        }
+
+        ra = ra.add(24);
+        rb = rb.add(24);
+    }
+}
+
+/// Raises each register of `reg_raw` to the matching register of `reg_dense`.
+/// The 4 bytes before `reg_dense` and the padding after the registers must be readable.
+#[inline(always)]
+pub unsafe fn merge_max(reg_raw: *mut u8, reg_dense: *const u8) {
     if const { HLL_BITS == 6 && HLL_REGISTERS % 64 == 0 }
         && is_simd_enabled()
         && is_x86_feature_detected!("avx512f")
@@ -269,7 +895,7 @@ unsafe fn merge_max_avx512(reg_raw: *mut u8, reg_dense: *const u8) {
 }
 
 #[inline(always)]
-unsafe fn compress(reg_dense: *mut u8, reg_raw: *const u8) {
+pub unsafe fn compress(reg_dense: *mut u8, reg_raw: *const u8) {
     if const { HLL_BITS == 6 && HLL_REGISTERS % 64 == 0 } && is_simd_enabled() && is_x86_feature_detected!("avx2") {
         return compress_avx2(reg_dense, reg_raw);
     }
@@ -331,3 +957,83 @@ unsafe fn compress_avx2(reg_dense: *mut u8, reg_raw: *const u8) {
         t = t.add(24);
     }
 }
+
+/// Like `compress`, with non-temporal stores that bypass the cache. Writes exactly
+/// `HLL_DENSE_LEN` bytes when `reg_dense` is 16-byte aligned, and falls back to `compress`
+/// otherwise.
+#[inline(always)]
+pub unsafe fn compress_nt(reg_dense: *mut u8, reg_raw: *const u8) {
+    if const { HLL_BITS == 6 && HLL_REGISTERS % 64 == 0 }
+        && is_simd_enabled()
+        && is_x86_feature_detected!("avx2")
+        && reg_dense.addr() % 16 == 0
+    {
+        return compress_nt_avx2(reg_dense, reg_raw);
+    }
+    compress(reg_dense, reg_raw);
+}
+
+/// Streaming stores must be aligned and must not overlap, so unlike `compress_avx2`, the
+/// 24 bytes packed from each 32 registers are first moved to the bottom of the vector, and
+/// the 48 bytes of 64 registers are written as three aligned 16-byte stores.
+#[allow(clippy::cast_ptr_alignment)]
+#[target_feature(enable = "avx2")]
+unsafe fn compress_nt_avx2(reg_dense: *mut u8, reg_raw: *const u8) {
+    use core::arch::x86_64::*;
+
+    let shuffle = _mm256_setr_epi8(
+        0, 1, 2, //
+        4, 5, 6, //
+        8, 9, 10, //
+        12, 13, 14, //
+        -1, -1, -1, -1, //
+        0, 1, 2, //
+        4, 5, 6, //
+        8, 9, 10, //
+        12, 13, 14, //
+        -1, -1, -1, -1, //
+    );
+    let gather = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+    let pack = |r: *const u8| {
+        let x = _mm256_loadu_si256(r.cast());
+
+        let a1 = _mm256_and_si256(x, _mm256_set1_epi32(0x0000_003f));
+        let a2 = _mm256_and_si256(x, _mm256_set1_epi32(0x0000_3f00));
+        let a3 = _mm256_and_si256(x, _mm256_set1_epi32(0x003f_0000));
+        let a4 = _mm256_and_si256(x, _mm256_set1_epi32(0x3f00_0000));
+
+        let a2 = _mm256_srli_epi32(a2, 2);
+        let a3 = _mm256_srli_epi32(a3, 4);
+        let a4 = _mm256_srli_epi32(a4, 6);
+
+        let y1 = _mm256_or_si256(a1, a2);
+        let y2 = _mm256_or_si256(a3, a4);
+        let y = _mm256_or_si256(y1, y2);
+        let y = _mm256_shuffle_epi8(y, shuffle);
+        _mm256_permutevar8x32_epi32(y, gather)
+    };
+
+    let mut r = reg_raw;
+    let mut t = reg_dense.cast::<__m128i>();
+
+    for _ in 0..HLL_REGISTERS / 64 {
+        let a = pack(r);
+        let b = pack(r.add(32));
+
+        let a_low = _mm256_castsi256_si128(a);
+        let a_high = _mm256_extracti128_si256(a, 1);
+        let b_low = _mm256_castsi256_si128(b);
+        let b_high = _mm256_extracti128_si256(b, 1);
+
+        _mm_stream_si128(t, a_low);
+        _mm_stream_si128(t.add(1), _mm_unpacklo_epi64(a_high, b_low));
+        _mm_stream_si128(t.add(2), _mm_alignr_epi8(b_high, b_low, 8));
+
+        r = r.add(64);
+        t = t.add(3);
+    }
+
+    // orders the streaming stores before any later store, e.g. the release of a lock
+    _mm_sfence();
+}
@@ -0,0 +1,126 @@
+//! C ABI over `HyperLogLog` with the default (Redis-compatible) hasher.
+//! See `include/redis_hyperloglog.h`.
+//!
+//! A handle is the sketch itself, so an array of handles can be merged without copying.
+
+#![allow(clippy::missing_safety_doc)]
+
+use crate::{HyperLogLog, MurmurHash64A};
+
+use std::mem::ManuallyDrop;
+use std::ptr;
+use std::slice;
+
+/// Opaque sketch handle, `hll_t` in C.
+#[repr(C)]
+pub struct Hll {
+    _private: [u8; 0],
+}
+
+/// Borrows the sketch behind a handle without taking ownership.
+unsafe fn borrow(hll: *const Hll) -> ManuallyDrop<HyperLogLog> {
+    ManuallyDrop::new(HyperLogLog::from_raw(hll.cast_mut().cast()))
+}
+
+unsafe fn bytes<'a>(ptr: *const u8, len: usize) -> &'a [u8] {
+    if len == 0 {
+        return &[];
+    }
+    slice::from_raw_parts(ptr, len)
+}
+
+/// Creates an empty sketch. Free it with `hll_destroy`.
+#[no_mangle]
+pub extern "C" fn hll_create() -> *mut Hll {
+    HyperLogLog::new().into_raw().cast()
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn hll_destroy(hll: *mut Hll) {
+    if !hll.is_null() {
+        drop(HyperLogLog::<MurmurHash64A>::from_raw(hll.cast()));
+    }
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn hll_clear(hll: *mut Hll) {
+    borrow(hll).clear();
+}
+
+/// Inserts a key. Returns 1 if a register was updated, 0 otherwise.
+#[no_mangle]
+pub unsafe extern "C" fn hll_insert(hll: *mut Hll, key: *const u8, len: usize) -> i32 {
+    i32::from(borrow(hll).insert(bytes(key, len)))
+}
+
+/// Inserts `n` pre-hashed keys. Returns 1 if a register was updated, 0 otherwise.
+#[no_mangle]
+pub unsafe extern "C" fn hll_insert_hashes(hll: *mut Hll, hashes: *const u64, n: usize) -> i32 {
+    let hashes = if n == 0 { &[] } else { slice::from_raw_parts(hashes, n) };
+    i32::from(borrow(hll).insert_hashes(hashes))
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn hll_count(hll: *const Hll) -> u64 {
+    borrow(hll).count()
+}
+
+/// Estimates the cardinality of the union of `n` sketches.
+#[no_mangle]
+pub unsafe extern "C" fn hll_union_count(sources: *const *const Hll, n: usize) -> u64 {
+    let sources: Vec<ManuallyDrop<HyperLogLog>> = (0..n).map(|i| borrow(*sources.add(i))).collect();
+    let sources: Vec<&HyperLogLog> = sources.iter().map(|src| &**src).collect();
+    HyperLogLog::union_count(&sources)
+}
+
+/// Merges `n` sketches into `dst`. `dst` must not be one of the sources.
+#[no_mangle]
+pub unsafe extern "C" fn hll_merge(dst: *mut Hll, sources: *const *const Hll, n: usize) {
+    // a handle has the layout of a `HyperLogLog`
+    let sources: &[HyperLogLog] = if n == 0 {
+        &[]
+    } else {
+        slice::from_raw_parts(sources.cast(), n)
+    };
+    borrow(dst).merge(sources);
+}
+
+/// Writes the compact encoding to `out` if it fits in `cap` bytes.
+/// Returns the length of the encoding either way.
+#[no_mangle]
+pub unsafe extern "C" fn hll_serialize(hll: *const Hll, out: *mut u8, cap: usize) -> usize {
+    let encoded = borrow(hll).to_compact();
+    if encoded.len() <= cap {
+        ptr::copy_nonoverlapping(encoded.as_ptr(), out, encoded.len());
+    }
+    encoded.len()
+}
+
+/// Reads the compact encoding. Returns `NULL` if the bytes are not a valid encoding.
+#[no_mangle]
+pub unsafe extern "C" fn hll_deserialize(data: *const u8, len: usize) -> *mut Hll {
+    match HyperLogLog::<MurmurHash64A>::from_compact(bytes(data, len)) {
+        Some(hll) => hll.into_raw().cast(),
+        None => ptr::null_mut(),
+    }
+}
+
+/// Writes the dense Redis string value to `out` if it fits in `cap` bytes.
+/// Returns the length of the value either way.
+#[no_mangle]
+pub unsafe extern "C" fn hll_to_redis(hll: *const Hll, out: *mut u8, cap: usize) -> usize {
+    let value = borrow(hll).to_redis();
+    if value.len() <= cap {
+        ptr::copy_nonoverlapping(value.as_ptr(), out, value.len());
+    }
+    value.len()
+}
+
+/// Reads a Redis string value, dense or sparse. Returns `NULL` if it is not a valid value.
+#[no_mangle]
+pub unsafe extern "C" fn hll_from_redis(data: *const u8, len: usize) -> *mut Hll {
+    match HyperLogLog::from_redis(bytes(data, len)) {
+        Some(hll) => hll.into_raw().cast(),
+        None => ptr::null_mut(),
+    }
+}
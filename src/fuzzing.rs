@@ -0,0 +1,352 @@
+//! Differential checks shared by the unit tests and the fuzz targets in `fuzz/`.
+//!
+//! Every kernel has a scalar version and at most one SIMD version behind its dispatcher, so
+//! each check runs once with SIMD disabled and once enabled. The two runs must agree with each
+//! other and with a reference built from the one-register accessors of `redis`, which follow
+//! the `HLL_DENSE_GET_REGISTER` and `HLL_DENSE_SET_REGISTER` macros of Redis.
+//! Any difference panics.
+//!
+//! Input layout: `[fill, misalign, data...]`. `fill` selects the registers: all zero, all 63,
+//! `data` masked to 6 bits, or `data` masked to the values the sparse encoding can hold.
+//! `misalign` shifts the buffers the kernels read and write from a 64-byte boundary.
+
+use crate::config::*;
+use crate::dense::{compress, compress_nt, merge_max, reg_histogram, unpack, HllDense, DENSE_REGISTERS_LEN, HLL_DENSE_LEN};
+use crate::mle::JointHist;
+use crate::nibble::{decode_nibbles, encode_nibbles, NIBBLES_LEN};
+use crate::redis;
+use crate::{HllRepr, HyperLogLog, MergeScratch, MurmurHash64A};
+
+/// Room for the largest misalignment, and for the kernels that read a few bytes around their
+/// input, e.g. `merge_max`.
+const SLACK: usize = 64;
+
+/// `check_pipeline` extends short inputs to this many hashes, so the batched insert is covered.
+const PIPELINE_HASHES_MIN: usize = 2048;
+
+struct Input {
+    a: [u8; HLL_REGISTERS],
+    b: [u8; HLL_REGISTERS],
+    misalign: usize,
+}
+
+impl Input {
+    fn parse(data: &[u8]) -> Self {
+        let fill = data.first().copied().unwrap_or(0);
+        let misalign = usize::from(data.get(1).copied().unwrap_or(0)) % SLACK;
+        let data = data.get(2..).unwrap_or(&[]);
+
+        let byte = |i: usize| if data.is_empty() { 0 } else { data[i % data.len()] };
+        let mut a = [0; HLL_REGISTERS];
+        let mut b = [0; HLL_REGISTERS];
+        for i in 0..HLL_REGISTERS {
+            let x = byte(i);
+            a[i] = match fill % 4 {
+                0 => 0,
+                1 => 63,
+                2 => x & 63,
+                _ => (x & 31) + (x >> 7),
+            };
+            // the other operand of the binary kernels, shifted so that the two differ
+            b[i] = byte(i + 1).rotate_left(3) & 63;
+        }
+        Self { a, b, misalign }
+    }
+}
+
+/// A buffer of `len` bytes that starts `misalign` bytes past a 64-byte boundary, with at least
+/// `SLACK` readable bytes on both sides.
+struct Buffer {
+    bytes: Vec<u8>,
+    start: usize,
+}
+
+impl Buffer {
+    fn new(len: usize, misalign: usize, fill: u8) -> Self {
+        let bytes = vec![fill; len + 4 * SLACK];
+        let start = SLACK + bytes[SLACK..].as_ptr().align_offset(64) + misalign;
+        Self { bytes, start }
+    }
+
+    fn as_ptr(&self) -> *const u8 {
+        self.bytes[self.start..].as_ptr()
+    }
+
+    fn as_mut_ptr(&mut self) -> *mut u8 {
+        self.bytes[self.start..].as_mut_ptr()
+    }
+
+    fn get(&self, len: usize) -> &[u8] {
+        &self.bytes[self.start..self.start + len]
+    }
+}
+
+/// The outputs of every kernel for one input.
+#[derive(Debug, PartialEq)]
+struct Kernels {
+    dense: Vec<u8>,
+    dense_nt: Vec<u8>,
+    unpacked: Vec<u8>,
+    merged: Vec<u8>,
+    hist: Vec<u16>,
+    joint: (Vec<u16>, Vec<u16>),
+    estimates: [u64; 4],
+    nibbles: (Vec<u8>, Vec<(usize, u8)>),
+    decoded: Vec<u8>,
+    sparse: Option<Vec<u8>>,
+    sparse_decoded: Option<Vec<u8>>,
+    sparse_hist: Option<Vec<u16>>,
+}
+
+#[allow(clippy::cast_possible_truncation)]
+fn run_kernels(input: &Input) -> Kernels {
+    let Input { a, b, misalign } = input;
+    let misalign = *misalign;
+
+    unsafe {
+        let mut dense = Buffer::new(DENSE_REGISTERS_LEN, misalign, 0xaa);
+        compress(dense.as_mut_ptr(), a.as_ptr());
+        let dense = dense.get(HLL_DENSE_LEN).to_vec();
+
+        let mut dense_nt = Buffer::new(DENSE_REGISTERS_LEN, misalign, 0xaa);
+        compress_nt(dense_nt.as_mut_ptr(), a.as_ptr());
+        let dense_nt = dense_nt.get(HLL_DENSE_LEN).to_vec();
+
+        // unpacking must not read past the registers: they end the allocation
+        let mut exact = vec![0; misalign + HLL_DENSE_LEN];
+        exact[misalign..].copy_from_slice(&dense);
+        let mut unpacked = Buffer::new(HLL_REGISTERS, misalign, 0xaa);
+        unpack(unpacked.as_mut_ptr(), exact[misalign..].as_ptr());
+        let unpacked = unpacked.get(HLL_REGISTERS).to_vec();
+
+        let mut padded = Buffer::new(DENSE_REGISTERS_LEN, misalign, 0);
+        padded.bytes[padded.start..padded.start + HLL_DENSE_LEN].copy_from_slice(&dense);
+        let mut merged = Buffer::new(HLL_REGISTERS, misalign, 0);
+        merged.bytes[merged.start..merged.start + HLL_REGISTERS].copy_from_slice(b);
+        merge_max(merged.as_mut_ptr(), padded.as_ptr());
+        let merged = merged.get(HLL_REGISTERS).to_vec();
+
+        let mut hist = [0xaaaa; HLL_HIST_LEN];
+        reg_histogram(hist.as_mut_ptr(), a.as_ptr());
+
+        let sketch = |regs: &[u8; HLL_REGISTERS]| {
+            let mut hll = HyperLogLog::new();
+            hll.load_raw(regs.as_ptr());
+            hll
+        };
+        let (sa, sb) = (sketch(a), sketch(b));
+        let joint: JointHist = HllDense::joint_histogram(&*sa.ptr.cast(), &*sb.ptr.cast());
+
+        let mut hist_b = [0; HLL_HIST_LEN];
+        reg_histogram(hist_b.as_mut_ptr(), b.as_ptr());
+        let zeros = {
+            let mut hist = [0; HLL_HIST_LEN];
+            hist[0] = HLL_REGISTERS as u16;
+            hist
+        };
+        let estimates = hll_estimate_x4([&hist, &hist_b, &zeros, &hist]);
+
+        let base = a.iter().copied().min().unwrap_or(0);
+        let mut nibbles = vec![0xaa; NIBBLES_LEN];
+        let mut escapes = Vec::new();
+        encode_nibbles(nibbles.as_mut_ptr(), a.as_ptr(), base, &mut |index, value| escapes.push((index, value)));
+        let mut decoded = vec![0; HLL_REGISTERS];
+        let n = decode_nibbles(decoded.as_mut_ptr(), nibbles.as_ptr(), base);
+        assert_eq!(n, escapes.len());
+        for &(index, value) in &escapes {
+            decoded[index] = value;
+        }
+
+        let mut sparse = Vec::new();
+        let sparse = redis::raw_to_sparse(a, &mut sparse).map(|()| sparse);
+        let sparse_decoded = sparse.as_ref().map(|sparse| {
+            let mut raw = [0xaa; HLL_REGISTERS];
+            redis::sparse_to_raw(&mut raw, sparse).unwrap();
+            raw.to_vec()
+        });
+        let sparse_hist = sparse.as_ref().map(|sparse| {
+            let mut hist = [0; HLL_HIST_LEN];
+            redis::sparse_histogram(&mut hist, sparse).unwrap();
+            hist.to_vec()
+        });
+
+        Kernels {
+            dense,
+            dense_nt,
+            unpacked,
+            merged,
+            hist: hist.to_vec(),
+            joint: (joint.a.to_vec(), joint.b.to_vec()),
+            estimates,
+            nibbles: (nibbles, escapes),
+            decoded,
+            sparse,
+            sparse_decoded,
+            sparse_hist,
+        }
+    }
+}
+
+/// Checks the outputs against the one-register reference.
+#[allow(clippy::cast_possible_truncation)]
+fn check_reference(input: &Input, out: &Kernels) {
+    let Input { a, b, .. } = input;
+
+    let mut dense = vec![0; HLL_DENSE_LEN];
+    for (i, &x) in a.iter().enumerate() {
+        redis::dense_set(&mut dense, i, x);
+    }
+    assert_eq!(out.dense, dense, "compress");
+    assert_eq!(out.dense_nt, dense, "compress_nt");
+    assert_eq!(out.unpacked, a, "unpack");
+    let merged: Vec<u8> = a.iter().zip(b).map(|(&x, &y)| x.max(y)).collect();
+    assert_eq!(out.merged, merged, "merge_max");
+
+    let mut hist = [0; HLL_HIST_LEN];
+    for &x in a {
+        hist[usize::from(x)] += 1;
+    }
+    assert_eq!(out.hist, hist, "reg_histogram");
+    assert_eq!(out.estimates[0], hll_estimate(&hist), "hll_estimate_x4");
+    assert_eq!(out.estimates[2], 0, "hll_estimate_x4");
+    assert_eq!(out.estimates[3], out.estimates[0], "hll_estimate_x4");
+
+    let pairs: u32 = out.joint.0.iter().map(|&n| u32::from(n)).sum();
+    assert_eq!(pairs as usize, HLL_REGISTERS, "joint_histogram");
+
+    assert_eq!(out.decoded, a, "nibbles");
+    let max = a.iter().copied().max().unwrap_or(0);
+    assert_eq!(out.sparse.is_some(), max <= redis::HLL_SPARSE_VAL_MAX, "raw_to_sparse");
+    if let Some(decoded) = &out.sparse_decoded {
+        assert_eq!(decoded, a, "sparse_to_raw");
+    }
+    if let Some(sparse_hist) = &out.sparse_hist {
+        assert_eq!(sparse_hist, &hist, "sparse_histogram");
+    }
+}
+
+/// Runs every kernel on registers decoded from `data`, with and without SIMD.
+pub fn check_kernels(data: &[u8]) {
+    let input = Input::parse(data);
+
+    let simd = SimdGuard::new(false);
+    let scalar = run_kernels(&input);
+    simd.set(true);
+    let vector = run_kernels(&input);
+    drop(simd);
+
+    check_reference(&input, &scalar);
+    assert_eq!(scalar, vector);
+}
+
+/// Computes the cardinality of dense registers one register at a time.
+#[allow(clippy::cast_possible_truncation)]
+fn reference_count(reg_dense: &[u8]) -> u64 {
+    let mut hist = [0; HLL_HIST_LEN];
+    for i in 0..HLL_REGISTERS {
+        hist[usize::from(redis::dense_get(reg_dense, i))] += 1;
+    }
+    hll_estimate(&hist)
+}
+
+/// Inserts hashes read from `data` into two sketches of each representation, then merges and
+/// counts them through the public API, with and without SIMD.
+pub fn check_pipeline(data: &[u8]) {
+    let mut hashes: Vec<u64> = data
+        .get(2..)
+        .unwrap_or(&[])
+        .chunks_exact(8)
+        .map(|chunk| u64::from_le_bytes(chunk.try_into().unwrap()))
+        .collect();
+    // cheap hashes reach the batched insert, and the fuzzed ones keep their edge values
+    if data.first().is_some_and(|fill| fill & 1 != 0) {
+        let mut state = hashes.iter().fold(0x9e37_79b9_7f4a_7c15_u64, |s, &h| s ^ h.rotate_left(17)) | 1;
+        while hashes.len() < PIPELINE_HASHES_MIN {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            hashes.push(state);
+        }
+    }
+    let (hashes_a, hashes_b) = hashes.split_at(hashes.len() / 2);
+
+    let mut ref_a = vec![0; HLL_DENSE_LEN];
+    let mut ref_b = vec![0; HLL_DENSE_LEN];
+    for &hash in hashes_a {
+        redis::dense_insert(&mut ref_a, hash);
+    }
+    for &hash in hashes_b {
+        redis::dense_insert(&mut ref_b, hash);
+    }
+    let mut ref_union = ref_a.clone();
+    for i in 0..HLL_REGISTERS {
+        let x = redis::dense_get(&ref_b, i);
+        if x > redis::dense_get(&ref_union, i) {
+            redis::dense_set(&mut ref_union, i, x);
+        }
+    }
+
+    for_each_simd(|_| {
+        for repr in [HllRepr::Dense, HllRepr::Nibble] {
+            check_pipeline_repr(repr, hashes_a, hashes_b, [&ref_a, &ref_b, &ref_union]);
+        }
+    });
+}
+
+fn check_pipeline_repr(repr: HllRepr, hashes_a: &[u64], hashes_b: &[u64], refs: [&[u8]; 3]) {
+    let [ref_a, ref_b, ref_union] = refs;
+    let simd = is_simd_enabled();
+
+    // one by one, then in a batch
+    let mut a = HyperLogLog::with_repr(MurmurHash64A, repr);
+    let (first, rest) = hashes_a.split_at(hashes_a.len() / 3);
+    for &hash in first {
+        a.insert_hash(hash);
+    }
+    a.insert_hashes(rest);
+    let mut b = HyperLogLog::with_repr(MurmurHash64A, repr);
+    b.insert_hashes(hashes_b);
+
+    assert_eq!(*a.registers(), *ref_a, "insert, {repr:?}, simd: {simd}");
+    assert_eq!(*b.registers(), *ref_b, "insert, {repr:?}, simd: {simd}");
+    assert_eq!(a.count(), reference_count(ref_a), "count, {repr:?}, simd: {simd}");
+    assert_eq!(b.count(), reference_count(ref_b), "count, {repr:?}, simd: {simd}");
+    let union = reference_count(ref_union);
+    assert_eq!(HyperLogLog::union_count(&[&a, &b]), union, "union_count, {repr:?}, simd: {simd}");
+
+    // stale copies, so that the estimates are computed four at a time
+    let copies: Vec<HyperLogLog> = (0..6).map(|i| if i % 2 == 0 { &a } else { &b }.converted(repr)).collect();
+    let copies: Vec<&HyperLogLog> = copies.iter().collect();
+    let expected: Vec<u64> = (0..6).map(|i| if i % 2 == 0 { a.count() } else { b.count() }).collect();
+    assert_eq!(HyperLogLog::count_many(&copies), expected, "count_many, {repr:?}, simd: {simd}");
+
+    let mut scratch = MergeScratch::new();
+    unsafe { scratch.as_mut_ptr().write_bytes(63, HLL_REGISTERS) };
+    for method in 0..4 {
+        let mut dst = a.converted(repr);
+        let sources = [b.converted(repr)];
+        match method {
+            0 => dst.merge(&sources),
+            1 => dst.merge_streaming(&sources),
+            2 => dst.merge_with_scratch(&sources, &mut scratch),
+            _ => {
+                let sparse = b.to_redis_sparse();
+                let dense = b.to_redis();
+                let values: Vec<&[u8]> = sparse.iter().map(Vec::as_slice).chain([dense.as_slice()]).collect();
+                dst.merge_redis(&values).unwrap();
+            }
+        }
+        assert_eq!(*dst.registers(), *ref_union, "merge {method}, {repr:?}, simd: {simd}");
+        assert_eq!(dst.count(), union, "merge {method}, {repr:?}, simd: {simd}");
+    }
+
+    let decoded = HyperLogLog::<MurmurHash64A>::from_compact(&a.to_compact()).unwrap();
+    assert_eq!(*decoded.registers(), *ref_a, "compact, {repr:?}, simd: {simd}");
+    let decoded = HyperLogLog::from_redis(&a.to_redis()).unwrap();
+    assert_eq!(*decoded.registers(), *ref_a, "redis, {repr:?}, simd: {simd}");
+    assert_eq!(
+        HyperLogLog::count_from_redis(&b.to_redis()),
+        Some(b.count()),
+        "redis, {repr:?}, simd: {simd}"
+    );
+}
@@ -1,3 +1,42 @@
+use crate::config::is_simd_enabled;
+
+/// Hash function that feeds keys into the registers.
+///
+/// Sketches are only comparable (and mergeable) when built with the same hasher.
+pub trait HllHasher {
+    /// Identifies the hasher in serialized sketches, which are rejected by other hashers.
+    const ID: u8;
+
+    fn hash(key: &[u8]) -> u64;
+}
+
+/// `MurmurHash64A` with the seed of Redis. Sketches stay compatible with Redis.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct MurmurHash64A;
+
+impl HllHasher for MurmurHash64A {
+    const ID: u8 = 0;
+
+    #[inline]
+    fn hash(key: &[u8]) -> u64 {
+        const SEED: u64 = 0xadc8_3b19;
+        murmurhash64a(key, SEED)
+    }
+}
+
+/// XXH3 (64-bit, default secret). Much faster on long keys, but not compatible with Redis.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Xxh3;
+
+impl HllHasher for Xxh3 {
+    const ID: u8 = 1;
+
+    #[inline]
+    fn hash(key: &[u8]) -> u64 {
+        xxh3_64(key)
+    }
+}
+
 #[allow(clippy::cast_ptr_alignment, clippy::cast_possible_truncation)]
 pub fn murmurhash64a(key: &[u8], seed: u64) -> u64 {
     let len = key.len();
@@ -58,9 +97,283 @@ pub fn murmurhash64a(key: &[u8], seed: u64) -> u64 {
     }
 }
 
+const PRIME32_1: u64 = 0x9e37_79b1;
+const PRIME32_2: u64 = 0x85eb_ca77;
+const PRIME32_3: u64 = 0xc2b2_ae3d;
+const PRIME64_1: u64 = 0x9e37_79b1_85eb_ca87;
+const PRIME64_2: u64 = 0xc2b2_ae3d_27d4_eb4f;
+const PRIME64_3: u64 = 0x1656_67b1_9e37_79f9;
+const PRIME64_4: u64 = 0x85eb_ca77_c2b2_ae63;
+const PRIME64_5: u64 = 0x27d4_eb2f_1656_67c5;
+const PRIME_MX1: u64 = 0x1656_6791_9e37_79f9;
+const PRIME_MX2: u64 = 0x9fb2_1c65_1e98_df25;
+
+const XXH3_SECRET: [u8; 192] = [
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c, //
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f, //
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21, //
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c, //
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3, //
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8, //
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d, //
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64, //
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb, //
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e, //
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce, //
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e, //
+];
+
+const XXH3_STRIPE_LEN: usize = 64;
+const XXH3_STRIPES_PER_BLOCK: usize = (XXH3_SECRET.len() - XXH3_STRIPE_LEN) / 8;
+const XXH3_BLOCK_LEN: usize = XXH3_STRIPE_LEN * XXH3_STRIPES_PER_BLOCK;
+
+#[inline(always)]
+#[allow(clippy::cast_ptr_alignment)]
+unsafe fn read64(p: *const u8) -> u64 {
+    p.cast::<u64>().read_unaligned().to_le()
+}
+
+#[inline(always)]
+#[allow(clippy::cast_ptr_alignment)]
+unsafe fn read32(p: *const u8) -> u64 {
+    u64::from(p.cast::<u32>().read_unaligned().to_le())
+}
+
+#[inline(always)]
+#[allow(clippy::cast_possible_truncation)]
+fn mul128_fold64(lhs: u64, rhs: u64) -> u64 {
+    let product = u128::from(lhs) * u128::from(rhs);
+    (product as u64) ^ ((product >> 64) as u64)
+}
+
+#[inline(always)]
+fn xxh64_avalanche(mut h: u64) -> u64 {
+    h ^= h >> 33;
+    h = h.wrapping_mul(PRIME64_2);
+    h ^= h >> 29;
+    h = h.wrapping_mul(PRIME64_3);
+    h ^ (h >> 32)
+}
+
+#[inline(always)]
+fn xxh3_avalanche(mut h: u64) -> u64 {
+    h ^= h >> 37;
+    h = h.wrapping_mul(PRIME_MX1);
+    h ^ (h >> 32)
+}
+
+#[inline(always)]
+fn xxh3_rrmxmx(mut h: u64, len: u64) -> u64 {
+    h ^= h.rotate_left(49) ^ h.rotate_left(24);
+    h = h.wrapping_mul(PRIME_MX2);
+    h ^= (h >> 35).wrapping_add(len);
+    h = h.wrapping_mul(PRIME_MX2);
+    h ^ (h >> 28)
+}
+
+#[inline(always)]
+unsafe fn xxh3_mix16(data: *const u8, secret: *const u8) -> u64 {
+    mul128_fold64(read64(data) ^ read64(secret), read64(data.add(8)) ^ read64(secret.add(8)))
+}
+
+/// XXH3 64-bit with the default secret and seed 0.
+pub fn xxh3_64(key: &[u8]) -> u64 {
+    let len = key.len();
+    let data = key.as_ptr();
+    let secret = XXH3_SECRET.as_ptr();
+    unsafe {
+        if len <= 16 {
+            xxh3_64_0to16(data, len, secret)
+        } else if len <= 128 {
+            xxh3_64_17to128(data, len, secret)
+        } else if len <= 240 {
+            xxh3_64_129to240(data, len, secret)
+        } else {
+            xxh3_64_long(data, len)
+        }
+    }
+}
+
+#[inline(always)]
+unsafe fn xxh3_64_0to16(data: *const u8, len: usize, secret: *const u8) -> u64 {
+    let len64 = len as u64;
+    if len > 8 {
+        let lo = read64(data) ^ (read64(secret.add(24)) ^ read64(secret.add(32)));
+        let hi = read64(data.add(len - 8)) ^ (read64(secret.add(40)) ^ read64(secret.add(48)));
+        let acc = len64
+            .wrapping_add(lo.swap_bytes())
+            .wrapping_add(hi)
+            .wrapping_add(mul128_fold64(lo, hi));
+        return xxh3_avalanche(acc);
+    }
+    if len >= 4 {
+        let lo = read32(data);
+        let hi = read32(data.add(len - 4));
+        let keyed = (hi + (lo << 32)) ^ (read64(secret.add(8)) ^ read64(secret.add(16)));
+        return xxh3_rrmxmx(keyed, len64);
+    }
+    if len > 0 {
+        let c1 = u64::from(*data);
+        let c2 = u64::from(*data.add(len >> 1));
+        let c3 = u64::from(*data.add(len - 1));
+        let combined = (c1 << 16) | (c2 << 24) | c3 | (len64 << 8);
+        return xxh64_avalanche(combined ^ (read32(secret) ^ read32(secret.add(4))));
+    }
+    xxh64_avalanche(read64(secret.add(56)) ^ read64(secret.add(64)))
+}
+
+#[inline(always)]
+unsafe fn xxh3_64_17to128(data: *const u8, len: usize, secret: *const u8) -> u64 {
+    let mut acc = (len as u64).wrapping_mul(PRIME64_1);
+    if len > 32 {
+        if len > 64 {
+            if len > 96 {
+                acc = acc.wrapping_add(xxh3_mix16(data.add(48), secret.add(96)));
+                acc = acc.wrapping_add(xxh3_mix16(data.add(len - 64), secret.add(112)));
+            }
+            acc = acc.wrapping_add(xxh3_mix16(data.add(32), secret.add(64)));
+            acc = acc.wrapping_add(xxh3_mix16(data.add(len - 48), secret.add(80)));
+        }
+        acc = acc.wrapping_add(xxh3_mix16(data.add(16), secret.add(32)));
+        acc = acc.wrapping_add(xxh3_mix16(data.add(len - 32), secret.add(48)));
+    }
+    acc = acc.wrapping_add(xxh3_mix16(data, secret));
+    acc = acc.wrapping_add(xxh3_mix16(data.add(len - 16), secret.add(16)));
+    xxh3_avalanche(acc)
+}
+
+#[inline(always)]
+unsafe fn xxh3_64_129to240(data: *const u8, len: usize, secret: *const u8) -> u64 {
+    let mut acc = (len as u64).wrapping_mul(PRIME64_1);
+    for i in 0..8 {
+        acc = acc.wrapping_add(xxh3_mix16(data.add(16 * i), secret.add(16 * i)));
+    }
+    acc = xxh3_avalanche(acc);
+    for i in 8..len / 16 {
+        acc = acc.wrapping_add(xxh3_mix16(data.add(16 * i), secret.add(16 * (i - 8) + 3)));
+    }
+    acc = acc.wrapping_add(xxh3_mix16(data.add(len - 16), secret.add(136 - 17)));
+    xxh3_avalanche(acc)
+}
+
+unsafe fn xxh3_64_long(data: *const u8, len: usize) -> u64 {
+    let mut acc = [
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1,
+    ];
+
+    if is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        xxh3_hash_long_avx2(&mut acc, data, len);
+    } else {
+        xxh3_hash_long_scalar(&mut acc, data, len);
+    }
+
+    let secret = XXH3_SECRET.as_ptr().add(11);
+    let mut result = (len as u64).wrapping_mul(PRIME64_1);
+    for i in 0..4 {
+        let lhs = acc[2 * i] ^ read64(secret.add(16 * i));
+        let rhs = acc[2 * i + 1] ^ read64(secret.add(16 * i + 8));
+        result = result.wrapping_add(mul128_fold64(lhs, rhs));
+    }
+    xxh3_avalanche(result)
+}
+
+/// Runs the stripe loop of the long input: full blocks with scrambling,
+/// the remaining stripes, and the last (overlapping) stripe.
+macro_rules! xxh3_hash_long_loop {
+    ($acc:expr, $data:expr, $len:expr, $accumulate:ident, $scramble:ident) => {{
+        let secret = XXH3_SECRET.as_ptr();
+        let blocks = ($len - 1) / XXH3_BLOCK_LEN;
+        for n in 0..blocks {
+            let block = $data.add(n * XXH3_BLOCK_LEN);
+            for s in 0..XXH3_STRIPES_PER_BLOCK {
+                $accumulate($acc, block.add(s * XXH3_STRIPE_LEN), secret.add(s * 8));
+            }
+            $scramble($acc, secret.add(XXH3_SECRET.len() - XXH3_STRIPE_LEN));
+        }
+
+        let block = $data.add(blocks * XXH3_BLOCK_LEN);
+        let stripes = (($len - 1) - blocks * XXH3_BLOCK_LEN) / XXH3_STRIPE_LEN;
+        for s in 0..stripes {
+            $accumulate($acc, block.add(s * XXH3_STRIPE_LEN), secret.add(s * 8));
+        }
+
+        let last = $data.add($len - XXH3_STRIPE_LEN);
+        $accumulate($acc, last, secret.add(XXH3_SECRET.len() - XXH3_STRIPE_LEN - 7));
+    }};
+}
+
+unsafe fn xxh3_hash_long_scalar(acc: &mut [u64; 8], data: *const u8, len: usize) {
+    xxh3_hash_long_loop!(acc, data, len, xxh3_accumulate_scalar, xxh3_scramble_scalar);
+}
+
+#[inline(always)]
+unsafe fn xxh3_accumulate_scalar(acc: &mut [u64; 8], data: *const u8, secret: *const u8) {
+    for i in 0..8 {
+        let val = read64(data.add(8 * i));
+        let key = val ^ read64(secret.add(8 * i));
+        acc[i ^ 1] = acc[i ^ 1].wrapping_add(val);
+        acc[i] = acc[i].wrapping_add((key & 0xffff_ffff).wrapping_mul(key >> 32));
+    }
+}
+
+#[inline(always)]
+unsafe fn xxh3_scramble_scalar(acc: &mut [u64; 8], secret: *const u8) {
+    for (i, a) in acc.iter_mut().enumerate() {
+        let mut x = *a;
+        x ^= x >> 47;
+        x ^= read64(secret.add(8 * i));
+        *a = x.wrapping_mul(PRIME32_1);
+    }
+}
+
+#[target_feature(enable = "avx2")]
+unsafe fn xxh3_hash_long_avx2(acc: &mut [u64; 8], data: *const u8, len: usize) {
+    use core::arch::x86_64::*;
+
+    let mut v = [
+        _mm256_loadu_si256(acc.as_ptr().cast()),
+        _mm256_loadu_si256(acc.as_ptr().add(4).cast()),
+    ];
+    xxh3_hash_long_loop!(&mut v, data, len, xxh3_accumulate_avx2, xxh3_scramble_avx2);
+    _mm256_storeu_si256(acc.as_mut_ptr().cast(), v[0]);
+    _mm256_storeu_si256(acc.as_mut_ptr().add(4).cast(), v[1]);
+}
+
+/// acc += swap64(data) + lo32(data ^ secret) * hi32(data ^ secret), per 64-bit lane.
+#[inline]
+#[target_feature(enable = "avx2")]
+unsafe fn xxh3_accumulate_avx2(acc: &mut [core::arch::x86_64::__m256i; 2], data: *const u8, secret: *const u8) {
+    use core::arch::x86_64::*;
+
+    for (i, a) in acc.iter_mut().enumerate() {
+        let val = _mm256_loadu_si256(data.add(32 * i).cast());
+        let key = _mm256_xor_si256(val, _mm256_loadu_si256(secret.add(32 * i).cast()));
+        let product = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+        let swapped = _mm256_shuffle_epi32(val, 0b01_00_11_10);
+        *a = _mm256_add_epi64(product, _mm256_add_epi64(*a, swapped));
+    }
+}
+
+#[inline]
+#[target_feature(enable = "avx2")]
+unsafe fn xxh3_scramble_avx2(acc: &mut [core::arch::x86_64::__m256i; 2], secret: *const u8) {
+    use core::arch::x86_64::*;
+
+    #[allow(clippy::cast_possible_truncation, clippy::cast_possible_wrap)]
+    let prime = _mm256_set1_epi32(PRIME32_1 as i32);
+    for (i, a) in acc.iter_mut().enumerate() {
+        let x = _mm256_xor_si256(*a, _mm256_srli_epi64(*a, 47));
+        let x = _mm256_xor_si256(x, _mm256_loadu_si256(secret.add(32 * i).cast()));
+        let lo = _mm256_mul_epu32(x, prime);
+        let hi = _mm256_mul_epu32(_mm256_shuffle_epi32(x, 0b00_11_00_01), prime);
+        *a = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    }
+}
+
 #[cfg(test)]
 mod tests {
     use super::*;
+    use crate::config::for_each_simd;
 
     #[test]
     fn hash_value() {
@@ -77,4 +390,36 @@ mod tests {
             assert_eq!(hash, expected, "key: {key}");
         }
     }
+
+    #[test]
+    fn xxh3_value() {
+        let cases: &[(usize, u64)] = &[
+            (0, 0x2d06_8005_38d3_94c2),
+            (1, 0xc44b_dff4_074e_ecdb),
+            (6, 0x27b5_6a84_cd2d_7325),
+            (12, 0xa713_daf0_dfbb_77e7),
+            (24, 0xa3fe_70bf_9d35_10eb),
+            (48, 0x397d_a259_ecba_1f11),
+            (80, 0xbcde_fbbb_2c47_c90a),
+            (195, 0xcd94_217e_e362_ec3a),
+            (403, 0xcdeb_804d_65c6_dea4),
+            (512, 0x617e_4959_9013_cb6b),
+            (2048, 0xdd59_e2c3_a5f0_38e0),
+            (2240, 0x6e73_a905_39cf_2948),
+            (2367, 0xcb37_aeb9_e5d3_61ed),
+        ];
+
+        let mut data = vec![0u8; 2367];
+        let mut byte_gen: u64 = 0x9e37_79b1;
+        for b in &mut data {
+            *b = (byte_gen >> 56) as u8;
+            byte_gen = byte_gen.wrapping_mul(0x9e37_79b1_85eb_ca8d);
+        }
+
+        for_each_simd(|simd| {
+            for &(len, expected) in cases {
+                assert_eq!(xxh3_64(&data[..len]), expected, "len: {len}, simd: {simd}");
+            }
+        });
+    }
 }
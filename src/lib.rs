@@ -9,42 +9,271 @@
     clippy::missing_panics_doc
 )]
 
+mod arena;
 mod array;
+mod column;
 mod config;
 mod dense;
+mod ffi;
+#[cfg(any(test, feature = "fuzzing"))]
+#[doc(hidden)]
+pub mod fuzzing;
 mod hash;
+mod mle;
+mod module;
+mod nibble;
+mod redis;
+mod rollup;
+mod shared;
 #[cfg(test)]
 mod tests;
+mod window;
 
-pub use self::config::{is_simd_enabled, set_simd};
+pub use self::column::HllColumn;
+pub use self::config::{is_simd_enabled, set_simd, ArenaAlloc, Estimator, HllRepr};
+pub use self::dense::{MergeScratch, HLL_DENSE_LEN};
+pub use self::hash::{HllHasher, MurmurHash64A, Xxh3};
+pub use self::mle::JointEstimate;
+pub use self::rollup::SketchRollup;
+pub use self::shared::{HllReader, HllWriter};
+pub use self::window::SlidingHyperLogLog;
 
-use self::config::HllRepr;
+use self::config::{HLL_HIST_LEN, HLL_Q, HLL_REGISTERS};
 use self::dense::HllDense;
-use self::hash::murmurhash64a;
+use self::nibble::HllNibble;
 
+use std::borrow::Cow;
+use std::cell::RefCell;
+use std::marker::PhantomData;
+
+use rayon::iter::{IndexedParallelIterator, ParallelIterator};
+use rayon::slice::{ParallelSlice, ParallelSliceMut};
+
+/// `count_many` prefetches the header of the sketch this many sketches ahead.
+const COUNT_PREFETCH_DISTANCE: usize = 8;
+
+/// Bytes read by `count`: the representation, the cached cardinality and the histogram.
+const COUNT_HEADER_LEN: usize = 16 + 2 * HLL_HIST_LEN;
+
+/// Sketches per task of `count_many_par`.
+const COUNT_PAR_CHUNK: usize = 4096;
+
+thread_local! {
+    /// Scratch space of `merge`, so a merge does not zero 16 KiB of stack first.
+    static MERGE_SCRATCH: RefCell<MergeScratch> = const { RefCell::new(MergeScratch::new()) };
+}
+
+/// A `HyperLogLog` sketch whose keys are hashed by `H`.
+///
+/// The default hasher is Redis-compatible. Sketches with different hashers must not be merged.
 #[repr(transparent)]
-pub struct HyperLogLog {
+pub struct HyperLogLog<H = MurmurHash64A> {
     ptr: *mut (),
+    _hasher: PhantomData<fn() -> H>,
 }
 
+// SAFETY: the sketch owns its allocation, and `&self` methods only read it
+// or update the cached cardinality atomically.
+unsafe impl<H> Send for HyperLogLog<H> {}
+unsafe impl<H> Sync for HyperLogLog<H> {}
+
 impl HyperLogLog {
     #[must_use]
     pub fn new() -> Self {
-        let ptr = HllDense::create().cast();
-        Self { ptr }
+        Self::with_hasher(MurmurHash64A)
+    }
+
+    /// Computes the cardinality of Redis dense registers (`HLL_DENSE_LEN` bytes),
+    /// e.g. from a snapshot or a replica, without building a `HyperLogLog`.
+    #[must_use]
+    pub fn count_from_dense(reg_dense: &[u8]) -> u64 {
+        HllDense::count_from_dense(reg_dense)
+    }
+
+    /// Parses a Redis string value written by `PFADD` or `PFMERGE`, in the dense or the sparse encoding.
+    /// Returns `None` if `bytes` is not a valid `HyperLogLog` value.
+    #[must_use]
+    pub fn from_redis(bytes: &[u8]) -> Option<Self> {
+        redis::parse_header(bytes)?;
+        let mut reg_raw = [0; HLL_REGISTERS];
+        redis::value_to_raw(&mut reg_raw, bytes)?;
+        if usize::from(reg_raw.iter().copied().max().unwrap_or(0)) > HLL_Q + 1 {
+            return None;
+        }
+
+        let mut hll = Self::new();
+        unsafe { hll.load_raw(reg_raw.as_ptr()) }
+        Some(hll)
+    }
+
+    /// Computes the cardinality of a Redis string value, like `PFCOUNT key`.
+    /// A valid cached cardinality is returned as is. Sparse values are counted from their runs
+    /// without decoding the registers. Returns `None` if `bytes` is not a valid value.
+    #[must_use]
+    pub fn count_from_redis(bytes: &[u8]) -> Option<u64> {
+        let (encoding, card) = redis::parse_header(bytes)?;
+        if let Some(card) = card {
+            return Some(card);
+        }
+        let body = &bytes[redis::HLL_HDR_LEN..];
+        if encoding == redis::HLL_DENSE {
+            return Some(HllDense::count_from_dense(body));
+        }
+        let mut hist = [0; HLL_HIST_LEN];
+        redis::sparse_histogram(&mut hist, body)?;
+        Some(config::hll_estimate(&hist))
+    }
+
+    /// Estimates the cardinality of the union of Redis string values, like `PFCOUNT key1 key2 ...`.
+    /// Returns `None` if any of `values` is not a valid value.
+    #[must_use]
+    pub fn union_count_redis(values: &[&[u8]]) -> Option<u64> {
+        let mut acc = [0; HLL_REGISTERS];
+        let mut tmp = [0; HLL_REGISTERS];
+        for value in values {
+            redis::parse_header(value)?;
+            redis::value_max_into(&mut acc, &mut tmp, value)?;
+        }
+        Some(unsafe { dense::count_raw(acc.as_ptr()) })
+    }
+
+    /// Merges Redis string values into `self`, like `PFMERGE`.
+    ///
+    /// Sparse values are applied as point updates, so merging many small values costs in
+    /// proportion to their non-zero registers. Dense values are unpacked and loaded at once.
+    /// Returns `None`, leaving `self` unchanged, if any of `values` is not a valid value.
+    pub fn merge_redis(&mut self, values: &[&[u8]]) -> Option<()> {
+        let mut acc = [0; HLL_REGISTERS];
+        let mut tmp = [0; HLL_REGISTERS];
+        let mut has_dense = false;
+        for value in values {
+            let (encoding, _) = redis::parse_header(value)?;
+            if encoding == redis::HLL_DENSE {
+                redis::value_max_into(&mut acc, &mut tmp, value)?;
+                has_dense = true;
+            } else {
+                redis::sparse_for_each_val(&value[redis::HLL_HDR_LEN..], |_, _, _| {})?;
+            }
+        }
+
+        if has_dense {
+            if usize::from(acc.iter().copied().max().unwrap_or(0)) > HLL_Q + 1 {
+                return None;
+            }
+            unsafe {
+                if self.cached_count() != 0 {
+                    self.max_into(acc.as_mut_ptr());
+                }
+                self.load_raw(acc.as_ptr());
+            }
+        }
+        for value in values {
+            if value[4] == redis::HLL_SPARSE {
+                self.merge_sparse(&value[redis::HLL_HDR_LEN..])?;
+            }
+        }
+        Some(())
+    }
+
+    /// Serializes the sketch as a sparse Redis string value, which is smaller than the dense one
+    /// for small sets. Returns `None` if a register is too large for the sparse encoding.
+    #[must_use]
+    pub fn to_redis_sparse(&self) -> Option<Vec<u8>> {
+        let mut reg_raw = [0; HLL_REGISTERS];
+        unsafe { self.to_raw(reg_raw.as_mut_ptr()) };
+
+        let mut out = vec![0; redis::HLL_HDR_LEN];
+        redis::write_header(&mut out, self.cached_count());
+        out[4] = redis::HLL_SPARSE;
+        redis::raw_to_sparse(&reg_raw, &mut out)?;
+        Some(out)
+    }
+
+    /// Serializes the sketch as a dense Redis string value, which `PFCOUNT` and `PFMERGE` accept.
+    #[must_use]
+    pub fn to_redis(&self) -> Vec<u8> {
+        let mut out = vec![0; redis::HLL_HDR_LEN];
+        redis::write_header(&mut out, self.cached_count());
+        out.extend_from_slice(&self.registers());
+        out
+    }
+}
+
+impl<H: HllHasher> HyperLogLog<H> {
+    #[must_use]
+    pub fn with_hasher(hasher: H) -> Self {
+        Self::with_repr(hasher, HllRepr::Dense)
+    }
+
+    /// Creates an empty sketch stored in `repr`.
+    #[must_use]
+    pub fn with_repr(_: H, repr: HllRepr) -> Self {
+        Self {
+            ptr: create(repr),
+            _hasher: PhantomData,
+        }
+    }
+
+    /// Converts the sketch to `repr`. The registers are kept.
+    pub fn set_repr(&mut self, repr: HllRepr) {
+        if repr != self.repr() {
+            *self = self.converted(repr);
+        }
+    }
+
+    fn converted(&self, repr: HllRepr) -> Self {
+        let mut reg_raw = [0; HLL_REGISTERS];
+        let mut copy = Self {
+            ptr: create(repr),
+            _hasher: PhantomData,
+        };
+        unsafe {
+            self.to_raw(reg_raw.as_mut_ptr());
+            copy.load_raw(reg_raw.as_ptr());
+        }
+        copy
     }
 
     pub fn clear(&mut self) {
         match self.repr() {
             HllRepr::Dense => unsafe { HllDense::clear(&mut *self.ptr.cast()) },
+            HllRepr::Nibble => unsafe { HllNibble::clear(&mut *self.ptr.cast()) },
         }
     }
 
     pub fn insert(&mut self, key: &[u8]) -> bool {
-        const SEED: u64 = 0xadc8_3b19;
-        let hash = murmurhash64a(key, SEED);
+        let hash = H::hash(key);
+        self.insert_hash(hash)
+    }
+
+    /// Inserts a batch of keys, like `PFADD key element ...`.
+    /// Returns `true` if any register was updated.
+    pub fn insert_many(&mut self, keys: &[&[u8]]) -> bool {
+        let mut hashes = [0; 1024];
+        let mut updated = false;
+        for chunk in keys.chunks(hashes.len()) {
+            for (hash, key) in hashes.iter_mut().zip(chunk) {
+                *hash = H::hash(key);
+            }
+            updated |= self.insert_hashes(&hashes[..chunk.len()]);
+        }
+        updated
+    }
+
+    /// Inserts a key that is already hashed, e.g. by an upstream 64-bit fingerprint.
+    /// The hash must be uniformly distributed and should come from the same function for all keys.
+    pub fn insert_hash(&mut self, hash: u64) -> bool {
         match self.repr() {
             HllRepr::Dense => unsafe { HllDense::insert(&mut *self.ptr.cast(), hash) },
+            HllRepr::Nibble => unsafe { HllNibble::insert(&mut *self.ptr.cast(), hash) },
+        }
+    }
+
+    /// Inserts a batch of pre-hashed keys. Returns `true` if any register was updated.
+    pub fn insert_hashes(&mut self, hashes: &[u64]) -> bool {
+        match self.repr() {
+            HllRepr::Dense => unsafe { HllDense::insert_hashes(&mut *self.ptr.cast(), hashes) },
+            HllRepr::Nibble => unsafe { HllNibble::insert_hashes(&mut *self.ptr.cast(), hashes) },
         }
     }
 
@@ -52,36 +281,310 @@ impl HyperLogLog {
     pub fn count(&self) -> u64 {
         match self.repr() {
             HllRepr::Dense => unsafe { HllDense::count(&*self.ptr.cast()) },
+            HllRepr::Nibble => unsafe { HllNibble::count(&*self.ptr.cast()) },
+        }
+    }
+
+    /// Computes the cardinality with the given estimator.
+    /// Unlike `count`, the cached cardinality is neither used nor updated.
+    #[must_use]
+    pub fn count_with(&self, estimator: Estimator) -> u64 {
+        match self.repr() {
+            HllRepr::Dense => unsafe { HllDense::count_with(&*self.ptr.cast(), estimator) },
+            HllRepr::Nibble => unsafe { HllNibble::count_with(&*self.ptr.cast(), estimator) },
+        }
+    }
+
+    /// Computes the cardinality of each of `sketches`, like calling `count` on each of them.
+    ///
+    /// Meant for many cold sketches: only the header of a sketch is read, and the headers are
+    /// prefetched a few sketches ahead. Stale sketches are estimated four at a time, one per
+    /// SIMD lane, and their cached cardinality is updated.
+    #[must_use]
+    pub fn count_many(sketches: &[&Self]) -> Vec<u64> {
+        let mut out = vec![0; sketches.len()];
+        Self::count_many_into(sketches, &mut out);
+        out
+    }
+
+    /// Like `count_many`, split across the rayon thread pool.
+    #[must_use]
+    pub fn count_many_par(sketches: &[&Self]) -> Vec<u64> {
+        let mut out = vec![0; sketches.len()];
+        out.par_chunks_mut(COUNT_PAR_CHUNK)
+            .zip(sketches.par_chunks(COUNT_PAR_CHUNK))
+            .for_each(|(out, sketches)| Self::count_many_into(sketches, out));
+        out
+    }
+
+    fn count_many_into(sketches: &[&Self], out: &mut [u64]) {
+        let mut stale = [0; 4];
+        let mut n = 0;
+        for (i, src) in sketches.iter().enumerate() {
+            if let Some(ahead) = sketches.get(i + COUNT_PREFETCH_DISTANCE) {
+                ahead.prefetch_header();
+            }
+            let card = src.cached_count();
+            if card != u64::MAX {
+                out[i] = card;
+                continue;
+            }
+            stale[n] = i;
+            n += 1;
+            if n == stale.len() {
+                let cards = config::hll_estimate_x4(stale.map(|i| sketches[i].histogram()));
+                for (&i, card) in stale.iter().zip(cards) {
+                    sketches[i].set_cached_count(card);
+                    out[i] = card;
+                }
+                n = 0;
+            }
+        }
+        for &i in &stale[..n] {
+            out[i] = sketches[i].count();
+        }
+    }
+
+    /// Estimates the cardinality of the union of `sources`, like `PFCOUNT key1 key2 ...`.
+    /// Unlike `merge`, nothing is allocated and no destination is written.
+    #[must_use]
+    pub fn union_count(sources: &[&Self]) -> u64 {
+        if sources.iter().all(|src| src.repr() == HllRepr::Dense) {
+            return HllDense::union_count(sources.iter().map(|src| unsafe { &*src.ptr.cast::<HllDense>() }));
         }
+        let mut reg_raw = [0; HLL_REGISTERS];
+        unsafe {
+            for src in sources {
+                if src.cached_count() != 0 {
+                    src.max_into(reg_raw.as_mut_ptr());
+                }
+            }
+            dense::count_raw(reg_raw.as_ptr())
+        }
+    }
+
+    /// Estimates `|A \ B|`, `|B \ A|` and `|A ∩ B|` of `self` (`A`) and `other` (`B`) at once,
+    /// by the joint maximum-likelihood estimator over the register pairs.
+    #[must_use]
+    pub fn joint_count(&self, other: &Self) -> JointEstimate {
+        if self.repr() != HllRepr::Dense || other.repr() != HllRepr::Dense {
+            return self.converted(HllRepr::Dense).joint_count(&other.converted(HllRepr::Dense));
+        }
+        let hist = unsafe { HllDense::joint_histogram(&*self.ptr.cast(), &*other.ptr.cast()) };
+        mle::joint_mle(&hist)
+    }
+
+    /// Returns the registers in the Redis dense encoding.
+    /// Other representations are packed into a new buffer.
+    #[must_use]
+    pub fn registers(&self) -> Cow<'_, [u8]> {
+        match self.repr() {
+            HllRepr::Dense => Cow::Borrowed(unsafe { HllDense::registers(&*self.ptr.cast()) }),
+            HllRepr::Nibble => {
+                let mut reg_raw = [0; HLL_REGISTERS];
+                unsafe {
+                    self.to_raw(reg_raw.as_mut_ptr());
+                    Cow::Owned(dense::raw_to_dense(reg_raw.as_ptr()))
+                }
+            }
+        }
+    }
+
+    /// Serializes the sketch for cold storage, e.g. snapshot files.
+    ///
+    /// Registers are stored as 4-bit offsets from the smallest register, with exceptions
+    /// for outliers, which takes about two thirds of the dense encoding.
+    #[must_use]
+    pub fn to_compact(&self) -> Vec<u8> {
+        match self.repr() {
+            HllRepr::Dense => unsafe { HllDense::to_compact(&*self.ptr.cast(), H::ID) },
+            HllRepr::Nibble => unsafe { HllNibble::to_compact(&*self.ptr.cast(), H::ID) },
+        }
+    }
+
+    /// Deserializes a sketch written by [`to_compact`](Self::to_compact) with the same hasher.
+    /// Returns `None` if `bytes` is not a valid encoding, or was written with another hasher.
+    #[must_use]
+    pub fn from_compact(bytes: &[u8]) -> Option<Self> {
+        let ptr = HllDense::from_compact(bytes, H::ID)?.cast();
+        Some(Self {
+            ptr,
+            _hasher: PhantomData,
+        })
+    }
+
+    /// Splits the sketch into a writer and a reader. See [`HllWriter`].
+    #[must_use]
+    pub fn into_shared(self) -> (HllWriter<H>, HllReader) {
+        HllWriter::new(self)
     }
 
+    /// Merges `sources` into `self`. Sources may be stored in any representation.
     pub fn merge(&mut self, sources: &[Self]) {
-        assert!(self.repr() == HllRepr::Dense);
-        for src in sources {
-            assert!(src.repr() == HllRepr::Dense);
+        MERGE_SCRATCH.with_borrow_mut(|scratch| self.merge_impl(sources, scratch, false));
+    }
+
+    /// Like `merge`, with caller-supplied scratch space for the unpacked registers instead of
+    /// a thread-local one.
+    pub fn merge_with_scratch(&mut self, sources: &[Self], scratch: &mut MergeScratch) {
+        self.merge_impl(sources, scratch, false);
+    }
+
+    /// Like `merge`, but writes the registers of a dense destination with non-temporal stores,
+    /// which bypass the cache. Use it when the result is not read again soon, e.g. when merging
+    /// into many cold destinations: the sketches that other commands are reading stay cached.
+    pub fn merge_streaming(&mut self, sources: &[Self]) {
+        MERGE_SCRATCH.with_borrow_mut(|scratch| self.merge_impl(sources, scratch, true));
+    }
+
+    fn merge_impl(&mut self, sources: &[Self], scratch: &mut MergeScratch, streaming: bool) {
+        if self.repr() == HllRepr::Dense && sources.iter().all(|src| src.repr() == HllRepr::Dense) {
+            let sources: &[&HllDense] = unsafe { slice_cast(sources) };
+            return unsafe { HllDense::merge(&mut *self.ptr.cast(), sources, scratch, streaming) };
+        }
+        let mut sources = sources.iter();
+        unsafe {
+            let reg_raw = scratch.as_mut_ptr();
+            if self.cached_count() != 0 {
+                self.to_raw(reg_raw);
+            } else if let Some(first) = sources.next() {
+                first.to_raw(reg_raw);
+            } else {
+                return;
+            }
+            for src in sources {
+                src.max_into(reg_raw);
+            }
+            if streaming {
+                self.load_raw_nt(reg_raw);
+            } else {
+                self.load_raw(reg_raw);
+            }
         }
-        let sources: &[&HllDense] = unsafe { slice_cast(sources) };
-        unsafe { HllDense::merge(&mut *self.ptr.cast(), sources) }
     }
 }
 
-impl HyperLogLog {
-    fn repr(&self) -> HllRepr {
+impl<H> HyperLogLog<H> {
+    fn into_raw(self) -> *mut () {
+        std::mem::ManuallyDrop::new(self).ptr
+    }
+
+    /// `ptr` must come from `into_raw`.
+    unsafe fn from_raw(ptr: *mut ()) -> Self {
+        Self {
+            ptr,
+            _hasher: PhantomData,
+        }
+    }
+
+    #[must_use]
+    pub fn repr(&self) -> HllRepr {
         unsafe { self.ptr.cast::<HllRepr>().read() }
     }
+
+    /// Prefetches the bytes read by `count`.
+    fn prefetch_header(&self) {
+        use core::arch::x86_64::{_mm_prefetch, _MM_HINT_T0};
+
+        if cfg!(miri) {
+            return;
+        }
+        let ptr = self.ptr.cast::<i8>().cast_const();
+        for offset in (0..COUNT_HEADER_LEN).step_by(64).chain([COUNT_HEADER_LEN - 1]) {
+            unsafe { _mm_prefetch::<_MM_HINT_T0>(ptr.add(offset)) };
+        }
+    }
+
+    /// Returns the heap memory held by the sketch, in bytes.
+    #[must_use]
+    pub fn memory_usage(&self) -> usize {
+        match self.repr() {
+            HllRepr::Dense => std::mem::size_of::<HllDense>(),
+            HllRepr::Nibble => unsafe { HllNibble::memory_usage(&*self.ptr.cast()) },
+        }
+    }
+
+    fn histogram(&self) -> &[u16; HLL_HIST_LEN] {
+        match self.repr() {
+            HllRepr::Dense => unsafe { HllDense::histogram(&*self.ptr.cast()) },
+            HllRepr::Nibble => unsafe { HllNibble::histogram(&*self.ptr.cast()) },
+        }
+    }
+
+    fn cached_count(&self) -> u64 {
+        match self.repr() {
+            HllRepr::Dense => unsafe { HllDense::cached_count(&*self.ptr.cast()) },
+            HllRepr::Nibble => unsafe { HllNibble::cached_count(&*self.ptr.cast()) },
+        }
+    }
+
+    fn set_cached_count(&self, card: u64) {
+        match self.repr() {
+            HllRepr::Dense => unsafe { HllDense::set_cached_count(&*self.ptr.cast(), card) },
+            HllRepr::Nibble => unsafe { HllNibble::set_cached_count(&*self.ptr.cast(), card) },
+        }
+    }
+
+    /// Writes the registers to `reg_raw`, one byte each.
+    unsafe fn to_raw(&self, reg_raw: *mut u8) {
+        match self.repr() {
+            HllRepr::Dense => HllDense::to_raw(&*self.ptr.cast(), reg_raw),
+            HllRepr::Nibble => HllNibble::to_raw(&*self.ptr.cast(), reg_raw),
+        }
+    }
+
+    /// Raises each register of `reg_raw` to the matching register of the sketch.
+    unsafe fn max_into(&self, reg_raw: *mut u8) {
+        match self.repr() {
+            HllRepr::Dense => HllDense::max_into(&*self.ptr.cast(), reg_raw),
+            HllRepr::Nibble => HllNibble::max_into(&*self.ptr.cast(), reg_raw),
+        }
+    }
+
+    /// Replaces the registers with `reg_raw` and marks the cardinality as stale.
+    unsafe fn load_raw(&mut self, reg_raw: *const u8) {
+        match self.repr() {
+            HllRepr::Dense => HllDense::load_raw(&mut *self.ptr.cast(), reg_raw),
+            HllRepr::Nibble => HllNibble::load_raw(&mut *self.ptr.cast(), reg_raw),
+        }
+    }
+
+    /// Like `load_raw`, with non-temporal stores where the representation has them.
+    unsafe fn load_raw_nt(&mut self, reg_raw: *const u8) {
+        match self.repr() {
+            HllRepr::Dense => HllDense::load_raw_nt(&mut *self.ptr.cast(), reg_raw),
+            HllRepr::Nibble => HllNibble::load_raw(&mut *self.ptr.cast(), reg_raw),
+        }
+    }
+
+    /// Applies the sparse opcodes of a Redis string value as point updates.
+    fn merge_sparse(&mut self, sparse: &[u8]) -> Option<()> {
+        match self.repr() {
+            HllRepr::Dense => unsafe { HllDense::merge_sparse(&mut *self.ptr.cast(), sparse) },
+            HllRepr::Nibble => unsafe { HllNibble::merge_sparse(&mut *self.ptr.cast(), sparse) },
+        }
+    }
 }
 
-impl Drop for HyperLogLog {
+impl<H> Drop for HyperLogLog<H> {
     fn drop(&mut self) {
         match self.repr() {
             HllRepr::Dense => unsafe { HllDense::destroy(self.ptr.cast()) },
+            HllRepr::Nibble => unsafe { HllNibble::destroy(self.ptr.cast()) },
         }
     }
 }
 
-impl Default for HyperLogLog {
+impl<H: HllHasher + Default> Default for HyperLogLog<H> {
     fn default() -> Self {
-        Self::new()
+        Self::with_hasher(H::default())
+    }
+}
+
+fn create(repr: HllRepr) -> *mut () {
+    match repr {
+        HllRepr::Dense => HllDense::create().cast(),
+        HllRepr::Nibble => HllNibble::create().cast(),
     }
 }
 
@@ -0,0 +1,353 @@
+//! Maximum-likelihood estimation on register histograms.
+//!
+//! Registers are modeled with the Poisson approximation of Ertl,
+//! "New cardinality estimation algorithms for `HyperLogLog` sketches" (2017):
+//! a register fed by `λ / m` elements on average satisfies `P(K <= k) = exp(-λ / m * ρ(k))`.
+
+use crate::config::*;
+
+/// Band of `JointHist` for the register pairs with `a > b`.
+pub const A_GT_B: usize = 0x40;
+/// Band of `JointHist` for the register pairs with `a < b`.
+pub const A_LT_B: usize = 0x80;
+/// Band of `JointHist` for the register pairs with `a == b`.
+pub const A_EQ_B: usize = 0xc0;
+
+/// Histograms of the register pairs `(a, b)` of two sketches, split by how the pair compares.
+///
+/// `a[band + k]` counts the pairs in `band` with `a == k`, `b[band + k]` the ones with `b == k`.
+pub struct JointHist {
+    pub a: [u16; 256],
+    pub b: [u16; 256],
+}
+
+impl JointHist {
+    pub fn new() -> Self {
+        Self {
+            a: [0; 256],
+            b: [0; 256],
+        }
+    }
+
+    /// Returns the histograms of `A`, `B` and `A ∪ B`.
+    #[allow(clippy::needless_range_loop)]
+    fn marginals(&self) -> [[u16; HLL_HIST_LEN]; 3] {
+        let mut hist = [[0; HLL_HIST_LEN]; 3];
+        for k in 0..HLL_HIST_LEN {
+            let eq = self.a[A_EQ_B + k];
+            hist[0][k] = self.a[A_GT_B + k] + self.a[A_LT_B + k] + eq;
+            hist[1][k] = self.b[A_GT_B + k] + self.b[A_LT_B + k] + eq;
+            hist[2][k] = self.a[A_GT_B + k] + self.b[A_LT_B + k] + eq;
+        }
+        hist
+    }
+}
+
+/// Cardinalities of two sets `A` and `B`, split into disjoint parts.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct JointEstimate {
+    /// `|A \ B|`
+    pub a_only: f64,
+    /// `|B \ A|`
+    pub b_only: f64,
+    /// `|A ∩ B|`
+    pub intersection: f64,
+}
+
+impl JointEstimate {
+    /// `|A|`
+    #[must_use]
+    pub fn a(&self) -> f64 {
+        self.a_only + self.intersection
+    }
+
+    /// `|B|`
+    #[must_use]
+    pub fn b(&self) -> f64 {
+        self.b_only + self.intersection
+    }
+
+    /// `|A ∪ B|`
+    #[must_use]
+    pub fn union(&self) -> f64 {
+        self.a_only + self.b_only + self.intersection
+    }
+
+    /// `|A ∩ B| / |A ∪ B|`, or 0 if both sets are empty.
+    #[must_use]
+    pub fn jaccard(&self) -> f64 {
+        let union = self.union();
+        if union == 0.0 {
+            0.0
+        } else {
+            self.intersection / union
+        }
+    }
+}
+
+/// Maximizes the likelihood of the register histogram, starting from the improved estimate.
+#[allow(clippy::cast_precision_loss, clippy::cast_possible_truncation, clippy::cast_sign_loss)]
+pub fn hll_estimate_mle(hist: &[u16; HLL_HIST_LEN]) -> u64 {
+    const MAX_ITERATIONS: usize = 64;
+
+    let m = HLL_REGISTERS as f64;
+
+    if usize::from(hist[0]) == HLL_REGISTERS {
+        return 0;
+    }
+    if usize::from(hist[HLL_Q + 1]) == HLL_REGISTERS {
+        return HLL_CARD_MAX;
+    }
+
+    // d/dy ln P(K == k) = -u + d / (exp(y * d) - 1), with u = ρ(k) and d = ρ(k-1) - ρ(k).
+    // Only the non-empty bins contribute, so precompute their `(count, u, d)` once.
+    let mut c0 = 0.0;
+    let mut terms = [(0.0, 0.0, 0.0); HLL_Q + 1];
+    let mut len = 0;
+    for (k, &c) in hist.iter().enumerate().take(HLL_Q + 2) {
+        if c == 0 {
+            continue;
+        }
+        if k == 0 {
+            c0 = f64::from(c);
+            continue;
+        }
+        let u = rho(k);
+        terms[len] = (f64::from(c), u, rho(k - 1) - u);
+        len += 1;
+    }
+    let terms = &terms[..len];
+
+    // In log space, g = x * f'(x) and h = x * f'(x) + x^2 * f''(x).
+    let derivatives = |x: f64| {
+        let mut df = -c0;
+        let mut ddf = 0.0;
+        for &(c, u, d) in terms {
+            let e = (x * d).exp_m1();
+            df += c * (d / e - u);
+            ddf -= c * d * d * (e + 1.0) / (e * e);
+        }
+        (x * df, x * df + x * x * ddf)
+    };
+
+    let mut phi = (hll_estimate(hist).max(1) as f64 / m).ln();
+    for _ in 0..MAX_ITERATIONS {
+        let (g, h) = derivatives(phi.exp());
+        if g == 0.0 || h >= 0.0 {
+            break;
+        }
+        let delta = (-g / h).clamp(-1.0, 1.0);
+        phi += delta;
+        if delta.abs() < 1e-12 {
+            break;
+        }
+    }
+
+    hll_round(phi.exp() * m)
+}
+
+/// Estimates `|A|`, `|B|` and `|A ∪ B|` separately and combines them by inclusion-exclusion.
+#[allow(clippy::cast_precision_loss)]
+pub fn joint_inclusion_exclusion(hist: &JointHist) -> JointEstimate {
+    let [a, b, union] = hist.marginals().map(|h| hll_estimate(&h) as f64);
+    JointEstimate {
+        a_only: (union - b).max(0.0),
+        b_only: (union - a).max(0.0),
+        intersection: (a + b - union).max(0.0),
+    }
+}
+
+/// Maximizes the joint likelihood of the register pairs over `(|A \ B|, |B \ A|, |A ∩ B|)`,
+/// starting from the inclusion-exclusion estimate.
+#[allow(clippy::cast_precision_loss, clippy::needless_range_loop)]
+pub fn joint_mle(hist: &JointHist) -> JointEstimate {
+    const MAX_ITERATIONS: usize = 100;
+    const MAX_REJECTIONS: usize = 32;
+
+    let start = joint_inclusion_exclusion(hist);
+    if start.union() == 0.0 {
+        return start;
+    }
+
+    let m = HLL_REGISTERS as f64;
+
+    // Solve in log space so that the rates stay positive.
+    let eval = |phi: [f64; 3]| {
+        let x = phi.map(f64::exp);
+        let (ln_l, grad) = joint_ln_likelihood(hist, x);
+        (ln_l, [grad[0] * x[0], grad[1] * x[1], grad[2] * x[2]])
+    };
+
+    let mut phi = [start.a_only, start.b_only, start.intersection].map(|v| (v.max(1.0) / m).ln());
+    let (mut ln_l, mut grad) = eval(phi);
+    if !ln_l.is_finite() {
+        return start;
+    }
+
+    // Levenberg-Marquardt on the negated Hessian, estimated from the analytic gradient.
+    let mut mu = 1e-3;
+    for _ in 0..MAX_ITERATIONS {
+        const H: f64 = 1e-6;
+        let mut neg_hess = [[0.0; 3]; 3];
+        for j in 0..3 {
+            let mut p = phi;
+            p[j] += H;
+            let (_, g) = eval(p);
+            for i in 0..3 {
+                neg_hess[i][j] = -(g[i] - grad[i]) / H;
+            }
+        }
+        for i in 0..3 {
+            for j in 0..i {
+                let v = (neg_hess[i][j] + neg_hess[j][i]) * 0.5;
+                neg_hess[i][j] = v;
+                neg_hess[j][i] = v;
+            }
+        }
+
+        let mut progress = false;
+        for _ in 0..MAX_REJECTIONS {
+            let mut a = neg_hess;
+            for (i, row) in a.iter_mut().enumerate() {
+                row[i] += mu * row[i].abs().max(1.0);
+            }
+            let Some(delta) = solve3(a, grad) else {
+                mu *= 4.0;
+                continue;
+            };
+
+            let next = [phi[0] + delta[0], phi[1] + delta[1], phi[2] + delta[2]];
+            let (next_ln_l, next_grad) = eval(next);
+            if next_ln_l.is_finite() && next_ln_l >= ln_l {
+                let gain = next_ln_l - ln_l;
+                let step = delta.iter().fold(0.0_f64, |acc, d| acc.max(d.abs()));
+
+                phi = next;
+                ln_l = next_ln_l;
+                grad = next_grad;
+                mu = (mu / 3.0).max(1e-12);
+                progress = step > 1e-9 && gain > 1e-12 * ln_l.abs();
+                break;
+            }
+            mu *= 4.0;
+        }
+        if !progress {
+            break;
+        }
+    }
+
+    let [a_only, b_only, intersection] = phi.map(|v| v.exp() * m);
+    JointEstimate {
+        a_only,
+        b_only,
+        intersection,
+    }
+}
+
+/// Returns the log-likelihood of the joint histogram and its gradient
+/// for the per-register rates `x = [a_only, b_only, intersection] / m`.
+fn joint_ln_likelihood(hist: &JointHist, x: [f64; 3]) -> (f64, [f64; 3]) {
+    let [xa, xb, xx] = x;
+
+    let mut ln_l = 0.0;
+    let mut grad = [0.0; 3];
+
+    for k in 0..=HLL_Q + 1 {
+        // a < b: a = max(K_a, K_x), b = K_b
+        // a > b: a = K_a, b = max(K_b, K_x)
+        let terms = [
+            (hist.a[A_LT_B + k], xa + xx, [1.0, 0.0, 1.0]),
+            (hist.b[A_LT_B + k], xb, [0.0, 1.0, 0.0]),
+            (hist.a[A_GT_B + k], xa, [1.0, 0.0, 0.0]),
+            (hist.b[A_GT_B + k], xb + xx, [0.0, 1.0, 1.0]),
+        ];
+        for (c, y, w) in terms {
+            if c == 0 {
+                continue;
+            }
+            let c = f64::from(c);
+            let (p, dp) = reg_pmf(k, y);
+            ln_l += c * p.ln();
+            for (g, w) in grad.iter_mut().zip(w) {
+                *g += c * w * dp / p;
+            }
+        }
+
+        // a == b == k: either K_x == k and K_a, K_b <= k, or K_x < k and K_a == K_b == k
+        let c = hist.a[A_EQ_B + k];
+        if c != 0 {
+            let c = f64::from(c);
+            let (pa, dpa) = reg_pmf(k, xa);
+            let (pb, dpb) = reg_pmf(k, xb);
+            let (px, dpx) = reg_pmf(k, xx);
+            let (fa, dfa) = reg_cdf(k, xa);
+            let (fb, dfb) = reg_cdf(k, xb);
+            let (fx, dfx) = if k == 0 { (0.0, 0.0) } else { reg_cdf(k - 1, xx) };
+
+            let p = px * fa * fb + fx * pa * pb;
+            let dp = [
+                px * dfa * fb + fx * dpa * pb,
+                px * fa * dfb + fx * pa * dpb,
+                dpx * fa * fb + dfx * pa * pb,
+            ];
+            ln_l += c * p.ln();
+            for (g, dp) in grad.iter_mut().zip(dp) {
+                *g += c * dp / p;
+            }
+        }
+    }
+
+    (ln_l, grad)
+}
+
+/// `ρ(k) = P(rank > k)` of a single element.
+#[allow(clippy::cast_possible_truncation, clippy::cast_possible_wrap)]
+fn rho(k: usize) -> f64 {
+    if k > HLL_Q {
+        0.0
+    } else {
+        0.5_f64.powi(k as i32)
+    }
+}
+
+/// Returns `P(K == k)` of a register with rate `y` and its derivative by `y`.
+#[allow(clippy::many_single_char_names)]
+pub fn reg_pmf(k: usize, y: f64) -> (f64, f64) {
+    if k == 0 {
+        let p = (-y).exp();
+        return (p, -p);
+    }
+    // P(K == k) = P(K <= k) * (1 - exp(-y * (ρ(k-1) - ρ(k))))
+    let u = rho(k);
+    let d = rho(k - 1) - u;
+    let f = (-y * u).exp();
+    let p = f * -(-y * d).exp_m1();
+    (p, -u * p + f * d * (-y * d).exp())
+}
+
+/// Returns `P(K <= k)` of a register with rate `y` and its derivative by `y`.
+pub fn reg_cdf(k: usize, y: f64) -> (f64, f64) {
+    let u = rho(k);
+    let f = (-y * u).exp();
+    (f, -u * f)
+}
+
+fn solve3(a: [[f64; 3]; 3], b: [f64; 3]) -> Option<[f64; 3]> {
+    let det = |m: [[f64; 3]; 3]| {
+        m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+            + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])
+    };
+    let d = det(a);
+    if d == 0.0 || !d.is_finite() {
+        return None;
+    }
+    let mut x = [0.0; 3];
+    for (j, x) in x.iter_mut().enumerate() {
+        let mut aj = a;
+        for i in 0..3 {
+            aj[i][j] = b[i];
+        }
+        *x = det(aj) / d;
+    }
+    Some(x)
+}
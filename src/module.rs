@@ -0,0 +1,522 @@
+//! A Redis module that runs the accelerated paths as `HLL.PFADD`, `HLL.PFCOUNT` and `HLL.PFMERGE`.
+//!
+//! The commands read and write the same string values as the native `PF*` commands, so both
+//! can be used on the same keys. Sparse values are read as they are and written back dense.
+//! Load the cdylib with `MODULE LOAD /path/to/libredis_hyperloglog.so`.
+//!
+//! The module API is resolved at load time through `RedisModule_GetApi`, like `RedisModule_Init`
+//! in `redismodule.h` does, so building needs no Redis headers.
+
+#![allow(non_snake_case, clippy::missing_safety_doc)]
+
+use crate::config::HLL_REGISTERS;
+use crate::redis::{self, HLL_DENSE, HLL_DENSE_SIZE, HLL_HDR_LEN, HLL_SPARSE};
+use crate::{dense, HllHasher, HyperLogLog, MurmurHash64A};
+
+use std::ffi::{c_char, c_int, c_longlong, c_void, CStr};
+use std::ptr;
+use std::slice;
+use std::sync::OnceLock;
+
+#[repr(C)]
+pub struct RedisModuleCtx {
+    _private: [u8; 0],
+}
+
+#[repr(C)]
+pub struct RedisModuleString {
+    _private: [u8; 0],
+}
+
+#[repr(C)]
+pub struct RedisModuleKey {
+    _private: [u8; 0],
+}
+
+type Ctx = RedisModuleCtx;
+type Str = RedisModuleString;
+type Key = RedisModuleKey;
+
+const REDISMODULE_OK: c_int = 0;
+const REDISMODULE_ERR: c_int = 1;
+const REDISMODULE_APIVER_1: c_int = 1;
+
+const REDISMODULE_READ: c_int = 1 << 0;
+const REDISMODULE_WRITE: c_int = 1 << 1;
+
+const REDISMODULE_KEYTYPE_EMPTY: c_int = 0;
+const REDISMODULE_KEYTYPE_STRING: c_int = 1;
+
+const WRONGTYPE: &CStr = c"WRONGTYPE Key is not a valid HyperLogLog string value.";
+const INVALIDOBJ: &CStr = c"INVALIDOBJ Corrupted HLL object detected";
+
+type GetApiFn = unsafe extern "C" fn(*const c_char, *mut c_void) -> c_int;
+type CmdFn = unsafe extern "C" fn(*mut Ctx, *mut *mut Str, c_int) -> c_int;
+
+macro_rules! module_api {
+    ($($name:ident: fn($($arg:ty),*) $(-> $ret:ty)?;)*) => {
+        /// The module API functions used by the commands.
+        struct Api {
+            $($name: unsafe extern "C" fn($($arg),*) $(-> $ret)?,)*
+        }
+
+        impl Api {
+            unsafe fn load(get_api: GetApiFn) -> Option<Self> {
+                Some(Self {
+                    $($name: {
+                        let name = concat!("RedisModule_", stringify!($name), "\0");
+                        let mut f: *mut c_void = ptr::null_mut();
+                        if get_api(name.as_ptr().cast(), ptr::addr_of_mut!(f).cast()) != REDISMODULE_OK || f.is_null() {
+                            return None;
+                        }
+                        std::mem::transmute::<*mut c_void, unsafe extern "C" fn($($arg),*) $(-> $ret)?>(f)
+                    },)*
+                })
+            }
+        }
+    };
+}
+
+module_api! {
+    SetModuleAttribs: fn(*mut Ctx, *const c_char, c_int, c_int);
+    CreateCommand: fn(*mut Ctx, *const c_char, CmdFn, *const c_char, c_int, c_int, c_int) -> c_int;
+    OpenKey: fn(*mut Ctx, *mut Str, c_int) -> *mut Key;
+    CloseKey: fn(*mut Key);
+    KeyType: fn(*mut Key) -> c_int;
+    StringDMA: fn(*mut Key, *mut usize, c_int) -> *mut c_char;
+    StringTruncate: fn(*mut Key, usize) -> c_int;
+    StringPtrLen: fn(*const Str, *mut usize) -> *const c_char;
+    ReplyWithLongLong: fn(*mut Ctx, c_longlong) -> c_int;
+    ReplyWithSimpleString: fn(*mut Ctx, *const c_char) -> c_int;
+    ReplyWithError: fn(*mut Ctx, *const c_char) -> c_int;
+    WrongArity: fn(*mut Ctx) -> c_int;
+    ReplicateVerbatim: fn(*mut Ctx) -> c_int;
+}
+
+static API: OnceLock<Api> = OnceLock::new();
+
+fn api() -> &'static Api {
+    API.get().expect("module is loaded")
+}
+
+#[no_mangle]
+pub unsafe extern "C" fn RedisModule_OnLoad(ctx: *mut Ctx, _args: *mut *mut Str, _nargs: c_int) -> c_int {
+    // the first field of the context is `RedisModule_GetApi`
+    let get_api = ctx.cast::<GetApiFn>().read();
+    let Some(loaded) = Api::load(get_api) else {
+        return REDISMODULE_ERR;
+    };
+    let api = API.get_or_init(|| loaded);
+
+    (api.SetModuleAttribs)(ctx, c"hll".as_ptr(), 1, REDISMODULE_APIVER_1);
+
+    let commands: [(&CStr, CmdFn, &CStr, c_int); 3] = [
+        (c"hll.pfadd", pfadd, c"write denyoom fast", 1),
+        (c"hll.pfcount", pfcount, c"readonly", -1),
+        (c"hll.pfmerge", pfmerge, c"write denyoom", -1),
+    ];
+    for (name, cmd, flags, last_key) in commands {
+        if (api.CreateCommand)(ctx, name.as_ptr(), cmd, flags.as_ptr(), 1, last_key, 1) != REDISMODULE_OK {
+            return REDISMODULE_ERR;
+        }
+    }
+    REDISMODULE_OK
+}
+
+/// Closes the key when dropped.
+struct OpenKey(*mut Key);
+
+impl OpenKey {
+    unsafe fn new(ctx: *mut Ctx, name: *mut Str, mode: c_int) -> Self {
+        Self((api().OpenKey)(ctx, name, mode))
+    }
+
+    unsafe fn key_type(&self) -> c_int {
+        (api().KeyType)(self.0)
+    }
+
+    unsafe fn value<'a>(&self, mode: c_int) -> &'a mut [u8] {
+        let mut len = 0;
+        let ptr = (api().StringDMA)(self.0, ptr::addr_of_mut!(len), mode);
+        if len == 0 {
+            return &mut [];
+        }
+        slice::from_raw_parts_mut(ptr.cast(), len)
+    }
+
+    unsafe fn truncate(&self, len: usize) {
+        (api().StringTruncate)(self.0, len);
+    }
+}
+
+impl Drop for OpenKey {
+    fn drop(&mut self) {
+        unsafe { (api().CloseKey)(self.0) }
+    }
+}
+
+unsafe fn arg<'a>(args: *mut *mut Str, i: usize) -> &'a [u8] {
+    let mut len = 0;
+    let ptr = (api().StringPtrLen)(*args.add(i), ptr::addr_of_mut!(len));
+    if len == 0 {
+        return &[];
+    }
+    slice::from_raw_parts(ptr.cast(), len)
+}
+
+unsafe fn reply_error(ctx: *mut Ctx, msg: &CStr) -> c_int {
+    (api().ReplyWithError)(ctx, msg.as_ptr())
+}
+
+/// Raises `acc` to the registers of the value at `key`. Empty keys are skipped.
+unsafe fn max_into(
+    ctx: *mut Ctx,
+    name: *mut Str,
+    acc: &mut [u8; HLL_REGISTERS],
+    tmp: &mut [u8; HLL_REGISTERS],
+) -> Result<(), &'static CStr> {
+    let key = OpenKey::new(ctx, name, REDISMODULE_READ);
+    match key.key_type() {
+        REDISMODULE_KEYTYPE_EMPTY => return Ok(()),
+        REDISMODULE_KEYTYPE_STRING => {}
+        _ => return Err(WRONGTYPE),
+    }
+    let value = key.value(REDISMODULE_READ);
+    redis::parse_header(value).ok_or(WRONGTYPE)?;
+    redis::value_max_into(acc, tmp, value).ok_or(INVALIDOBJ)
+}
+
+/// `HLL.PFADD key [element ...]`
+unsafe extern "C" fn pfadd(ctx: *mut Ctx, args: *mut *mut Str, nargs: c_int) -> c_int {
+    let api = api();
+    let nargs = usize::try_from(nargs).unwrap_or(0);
+    if nargs < 2 {
+        return (api.WrongArity)(ctx);
+    }
+
+    let key = OpenKey::new(ctx, *args.add(1), REDISMODULE_READ | REDISMODULE_WRITE);
+    let mut updated = false;
+    match key.key_type() {
+        REDISMODULE_KEYTYPE_EMPTY => {
+            key.truncate(HLL_DENSE_SIZE);
+            redis::write_header(key.value(REDISMODULE_WRITE), 0);
+            updated = true;
+        }
+        REDISMODULE_KEYTYPE_STRING => {
+            let value = key.value(REDISMODULE_READ);
+            match redis::parse_header(value) {
+                Some((HLL_DENSE, _)) => {}
+                Some((HLL_SPARSE, _)) => {
+                    let Some(hll) = HyperLogLog::from_redis(value) else {
+                        return reply_error(ctx, INVALIDOBJ);
+                    };
+                    key.truncate(HLL_DENSE_SIZE);
+                    key.value(REDISMODULE_WRITE).copy_from_slice(&hll.to_redis());
+                }
+                _ => return reply_error(ctx, WRONGTYPE),
+            }
+        }
+        _ => return reply_error(ctx, WRONGTYPE),
+    }
+
+    let (header, reg_dense) = key.value(REDISMODULE_WRITE).split_at_mut(HLL_HDR_LEN);
+    for i in 2..nargs {
+        updated |= redis::dense_insert(reg_dense, MurmurHash64A::hash(arg(args, i)));
+    }
+
+    if updated {
+        redis::set_cached_card(header, u64::MAX);
+        (api.ReplicateVerbatim)(ctx);
+    }
+    (api.ReplyWithLongLong)(ctx, c_longlong::from(updated))
+}
+
+/// `HLL.PFCOUNT key [key ...]`
+///
+/// Unlike `PFCOUNT`, a computed cardinality is not written back, so the command stays read-only.
+#[allow(clippy::cast_possible_wrap)]
+unsafe extern "C" fn pfcount(ctx: *mut Ctx, args: *mut *mut Str, nargs: c_int) -> c_int {
+    let api = api();
+    let nargs = usize::try_from(nargs).unwrap_or(0);
+    if nargs < 2 {
+        return (api.WrongArity)(ctx);
+    }
+
+    if nargs == 2 {
+        let key = OpenKey::new(ctx, *args.add(1), REDISMODULE_READ);
+        match key.key_type() {
+            REDISMODULE_KEYTYPE_EMPTY => return (api.ReplyWithLongLong)(ctx, 0),
+            REDISMODULE_KEYTYPE_STRING => {}
+            _ => return reply_error(ctx, WRONGTYPE),
+        }
+        let value = key.value(REDISMODULE_READ);
+        if redis::parse_header(value).is_none() {
+            return reply_error(ctx, WRONGTYPE);
+        }
+        return match HyperLogLog::count_from_redis(value) {
+            Some(card) => (api.ReplyWithLongLong)(ctx, card as c_longlong),
+            None => reply_error(ctx, INVALIDOBJ),
+        };
+    }
+
+    let mut acc = [0; HLL_REGISTERS];
+    let mut tmp = [0; HLL_REGISTERS];
+    for i in 1..nargs {
+        if let Err(msg) = max_into(ctx, *args.add(i), &mut acc, &mut tmp) {
+            return reply_error(ctx, msg);
+        }
+    }
+    let card = dense::count_raw(acc.as_ptr());
+    (api.ReplyWithLongLong)(ctx, card as c_longlong)
+}
+
+/// `HLL.PFMERGE destkey [sourcekey ...]`
+unsafe extern "C" fn pfmerge(ctx: *mut Ctx, args: *mut *mut Str, nargs: c_int) -> c_int {
+    let api = api();
+    let nargs = usize::try_from(nargs).unwrap_or(0);
+    if nargs < 2 {
+        return (api.WrongArity)(ctx);
+    }
+
+    // like `PFMERGE`, the destination is one of the sources
+    let mut acc = [0; HLL_REGISTERS];
+    let mut tmp = [0; HLL_REGISTERS];
+    for i in 1..nargs {
+        if let Err(msg) = max_into(ctx, *args.add(i), &mut acc, &mut tmp) {
+            return reply_error(ctx, msg);
+        }
+    }
+
+    let key = OpenKey::new(ctx, *args.add(1), REDISMODULE_READ | REDISMODULE_WRITE);
+    key.truncate(HLL_DENSE_SIZE);
+    let (header, reg_dense) = key.value(REDISMODULE_WRITE).split_at_mut(HLL_HDR_LEN);
+    redis::write_header(header, u64::MAX);
+    reg_dense.copy_from_slice(&dense::raw_to_dense(acc.as_ptr()));
+
+    (api.ReplicateVerbatim)(ctx);
+    (api.ReplyWithSimpleString)(ctx, c"OK".as_ptr())
+}
+
+#[cfg(test)]
+mod tests {
+    //! Runs the commands against an in-process stand-in for the module API.
+
+    use super::*;
+
+    use std::cell::RefCell;
+    use std::collections::HashMap;
+
+    #[derive(Debug, PartialEq)]
+    enum Reply {
+        Int(i64),
+        Status(String),
+        Error(String),
+    }
+
+    thread_local! {
+        static KEYS: RefCell<HashMap<Vec<u8>, Vec<u8>>> = RefCell::new(HashMap::new());
+        static COMMANDS: RefCell<HashMap<String, CmdFn>> = RefCell::new(HashMap::new());
+        static REPLIES: RefCell<Vec<Reply>> = const { RefCell::new(Vec::new()) };
+    }
+
+    #[repr(C)]
+    struct FakeCtx {
+        get_api: GetApiFn,
+    }
+
+    struct FakeKey {
+        name: Vec<u8>,
+    }
+
+    unsafe extern "C" fn get_api(name: *const c_char, out: *mut c_void) -> c_int {
+        let f: *const c_void = match CStr::from_ptr(name).to_str().unwrap() {
+            "RedisModule_SetModuleAttribs" => set_module_attribs as _,
+            "RedisModule_CreateCommand" => create_command as _,
+            "RedisModule_OpenKey" => open_key as _,
+            "RedisModule_CloseKey" => close_key as _,
+            "RedisModule_KeyType" => key_type as _,
+            "RedisModule_StringDMA" => string_dma as _,
+            "RedisModule_StringTruncate" => string_truncate as _,
+            "RedisModule_StringPtrLen" => string_ptr_len as _,
+            "RedisModule_ReplyWithLongLong" => reply_with_long_long as _,
+            "RedisModule_ReplyWithSimpleString" => reply_with_simple_string as _,
+            "RedisModule_ReplyWithError" => reply_with_error as _,
+            "RedisModule_WrongArity" => wrong_arity as _,
+            "RedisModule_ReplicateVerbatim" => replicate_verbatim as _,
+            _ => return REDISMODULE_ERR,
+        };
+        out.cast::<*const c_void>().write(f);
+        REDISMODULE_OK
+    }
+
+    unsafe extern "C" fn set_module_attribs(_: *mut Ctx, _: *const c_char, _: c_int, _: c_int) {}
+
+    unsafe extern "C" fn create_command(
+        _: *mut Ctx,
+        name: *const c_char,
+        cmd: CmdFn,
+        _: *const c_char,
+        _: c_int,
+        _: c_int,
+        _: c_int,
+    ) -> c_int {
+        let name = CStr::from_ptr(name).to_str().unwrap().to_owned();
+        COMMANDS.with_borrow_mut(|commands| commands.insert(name, cmd));
+        REDISMODULE_OK
+    }
+
+    unsafe extern "C" fn open_key(_: *mut Ctx, name: *mut Str, _: c_int) -> *mut Key {
+        let name = name.cast::<Vec<u8>>().as_ref().unwrap().clone();
+        Box::into_raw(Box::new(FakeKey { name })).cast()
+    }
+
+    unsafe extern "C" fn close_key(key: *mut Key) {
+        drop(Box::from_raw(key.cast::<FakeKey>()));
+    }
+
+    unsafe fn key_name<'a>(key: *mut Key) -> &'a [u8] {
+        &key.cast::<FakeKey>().as_ref().unwrap().name
+    }
+
+    unsafe extern "C" fn key_type(key: *mut Key) -> c_int {
+        let name = key_name(key);
+        if name.starts_with(b"list:") {
+            return 2;
+        }
+        if KEYS.with_borrow(|keys| keys.contains_key(name)) {
+            REDISMODULE_KEYTYPE_STRING
+        } else {
+            REDISMODULE_KEYTYPE_EMPTY
+        }
+    }
+
+    unsafe extern "C" fn string_dma(key: *mut Key, len: *mut usize, _: c_int) -> *mut c_char {
+        KEYS.with_borrow_mut(|keys| {
+            let value = keys.entry(key_name(key).to_vec()).or_default();
+            *len = value.len();
+            value.as_mut_ptr().cast()
+        })
+    }
+
+    unsafe extern "C" fn string_truncate(key: *mut Key, len: usize) -> c_int {
+        KEYS.with_borrow_mut(|keys| keys.entry(key_name(key).to_vec()).or_default().resize(len, 0));
+        REDISMODULE_OK
+    }
+
+    unsafe extern "C" fn string_ptr_len(s: *const Str, len: *mut usize) -> *const c_char {
+        let s = s.cast::<Vec<u8>>().as_ref().unwrap();
+        *len = s.len();
+        s.as_ptr().cast()
+    }
+
+    fn reply(reply: Reply) -> c_int {
+        REPLIES.with_borrow_mut(|replies| replies.push(reply));
+        REDISMODULE_OK
+    }
+
+    unsafe extern "C" fn reply_with_long_long(_: *mut Ctx, x: c_longlong) -> c_int {
+        reply(Reply::Int(x))
+    }
+
+    unsafe extern "C" fn reply_with_simple_string(_: *mut Ctx, s: *const c_char) -> c_int {
+        reply(Reply::Status(CStr::from_ptr(s).to_str().unwrap().to_owned()))
+    }
+
+    unsafe extern "C" fn reply_with_error(_: *mut Ctx, s: *const c_char) -> c_int {
+        reply(Reply::Error(CStr::from_ptr(s).to_str().unwrap().to_owned()))
+    }
+
+    unsafe extern "C" fn wrong_arity(_: *mut Ctx) -> c_int {
+        reply(Reply::Error("ERR wrong number of arguments".to_owned()))
+    }
+
+    unsafe extern "C" fn replicate_verbatim(_: *mut Ctx) -> c_int {
+        REDISMODULE_OK
+    }
+
+    fn load() {
+        let mut ctx = FakeCtx { get_api };
+        let ret = unsafe { RedisModule_OnLoad(ptr::addr_of_mut!(ctx).cast(), ptr::null_mut(), 0) };
+        assert_eq!(ret, REDISMODULE_OK);
+    }
+
+    fn call(args: &[&[u8]]) -> Reply {
+        let name = std::str::from_utf8(args[0]).unwrap().to_lowercase();
+        let cmd = COMMANDS.with_borrow(|commands| commands[&name]);
+        let mut owned: Vec<Vec<u8>> = args.iter().map(|a| a.to_vec()).collect();
+        let mut ptrs: Vec<*mut Str> = owned.iter_mut().map(|a| ptr::from_mut(a).cast()).collect();
+        let nargs = c_int::try_from(ptrs.len()).unwrap();
+        let ret = unsafe { cmd(ptr::null_mut(), ptrs.as_mut_ptr(), nargs) };
+        assert_eq!(ret, REDISMODULE_OK);
+        REPLIES.with_borrow_mut(Vec::pop).unwrap()
+    }
+
+    fn get(key: &[u8]) -> Vec<u8> {
+        KEYS.with_borrow(|keys| keys[key].clone())
+    }
+
+    #[test]
+    fn commands() {
+        load();
+
+        let n: u64 = if cfg!(miri) { 100 } else { 10000 };
+        let mut expected = HyperLogLog::new();
+        for i in 0..n {
+            let key = i.to_string();
+            let updated = expected.insert(key.as_bytes());
+            assert_eq!(call(&[b"HLL.PFADD", b"a", key.as_bytes()]), Reply::Int(i64::from(updated)));
+        }
+        assert_eq!(call(&[b"hll.pfadd", b"empty"]), Reply::Int(1));
+        assert_eq!(call(&[b"hll.pfadd", b"empty"]), Reply::Int(0));
+
+        let a = get(b"a");
+        assert_eq!(a.len(), HLL_DENSE_SIZE);
+        assert_eq!(a[..HLL_HDR_LEN], expected.to_redis()[..HLL_HDR_LEN]);
+        assert_eq!(HyperLogLog::from_redis(&a).unwrap().registers(), expected.registers());
+
+        let card = i64::try_from(expected.count()).unwrap();
+        assert_eq!(call(&[b"hll.pfcount", b"a"]), Reply::Int(card));
+        assert_eq!(call(&[b"hll.pfcount", b"a", b"missing", b"empty"]), Reply::Int(card));
+        assert_eq!(call(&[b"hll.pfcount", b"missing"]), Reply::Int(0));
+
+        // a sparse value, as native `PFADD` writes for small sets
+        let mut small = HyperLogLog::new();
+        for i in 0..100u64 {
+            small.insert(&(i + n).to_be_bytes());
+        }
+        let sparse = small.to_redis_sparse().unwrap();
+        assert_eq!(HyperLogLog::from_redis(&sparse).unwrap().registers(), small.registers());
+        KEYS.with_borrow_mut(|keys| keys.insert(b"s".to_vec(), sparse));
+
+        let mut union = HyperLogLog::new();
+        union.merge(&[
+            HyperLogLog::from_redis(&a).unwrap(),
+            HyperLogLog::from_redis(&small.to_redis()).unwrap(),
+        ]);
+        let union_card = i64::try_from(union.count()).unwrap();
+        assert_eq!(call(&[b"hll.pfcount", b"a", b"s"]), Reply::Int(union_card));
+
+        assert_eq!(call(&[b"hll.pfmerge", b"m", b"a", b"s"]), Reply::Status("OK".to_owned()));
+        assert_eq!(HyperLogLog::from_redis(&get(b"m")).unwrap().registers(), union.registers());
+        assert_eq!(call(&[b"hll.pfcount", b"m"]), Reply::Int(union_card));
+
+        // adding to a sparse value promotes it to dense
+        let key = 0u64.to_be_bytes();
+        assert_eq!(call(&[b"hll.pfadd", b"s", &key]), Reply::Int(i64::from(small.insert(&key))));
+        assert_eq!(get(b"s").len(), HLL_DENSE_SIZE);
+        assert_eq!(HyperLogLog::from_redis(&get(b"s")).unwrap().registers(), small.registers());
+
+        KEYS.with_borrow_mut(|keys| keys.insert(b"junk".to_vec(), b"not a sketch".to_vec()));
+        for cmd in [&b"hll.pfadd"[..], b"hll.pfcount", b"hll.pfmerge"] {
+            assert!(matches!(call(&[cmd, b"junk"]), Reply::Error(e) if e.starts_with("WRONGTYPE")));
+            assert!(matches!(call(&[cmd, b"list:x"]), Reply::Error(e) if e.starts_with("WRONGTYPE")));
+            assert!(matches!(call(&[cmd]), Reply::Error(_)));
+        }
+
+        let mut corrupted = small.to_redis_sparse().unwrap();
+        corrupted.pop();
+        KEYS.with_borrow_mut(|keys| keys.insert(b"bad".to_vec(), corrupted));
+        assert!(matches!(call(&[b"hll.pfcount", b"a", b"bad"]), Reply::Error(e) if e.starts_with("INVALIDOBJ")));
+        assert!(matches!(call(&[b"hll.pfcount", b"bad"]), Reply::Error(e) if e.starts_with("INVALIDOBJ")));
+    }
+}
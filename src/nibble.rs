@@ -0,0 +1,479 @@
+//! 4-bit register packing relative to the smallest register (HLL4 style).
+//!
+//! Each register is stored as a nibble holding its offset from `base`, which is kept equal to
+//! the smallest register. Offsets of 15 or more are escaped, and the escaped registers are kept
+//! in a small sorted overflow table. Registers rarely exceed `base + 15`, so the sketch takes
+//! about two thirds of the 6-bit dense encoding. When the smallest register rises, every
+//! offset is shifted down and the overflow entries that fit again move back into the nibbles.
+
+use std::alloc::alloc_zeroed;
+use std::alloc::dealloc;
+use std::alloc::handle_alloc_error;
+use std::alloc::Layout;
+use std::mem::MaybeUninit;
+use std::ptr;
+use std::sync::atomic::AtomicU64;
+use std::sync::atomic::Ordering;
+
+use crate::array::UnsafeArray;
+use crate::config::*;
+use crate::dense::{raw_to_compact, reg_histogram};
+use crate::mle::hll_estimate_mle;
+use crate::redis;
+
+pub const NIBBLES_LEN: usize = HLL_REGISTERS / 2;
+
+/// The nibble of a register that is `base + 15` or more.
+pub const NIBBLE_ESCAPE: u8 = 15;
+
+#[repr(C)]
+pub struct HllNibble {
+    repr: HllRepr,
+    /// The smallest register.
+    base: u8,
+    _pad: [u8; 6],
+    card: AtomicU64,
+    hist: UnsafeArray<u16, HLL_HIST_LEN>,
+    nibbles: UnsafeArray<u8, NIBBLES_LEN>,
+    /// `(index, register)` of the escaped registers, sorted by index.
+    overflow: Vec<(u16, u8)>,
+}
+
+impl HllNibble {
+    pub fn create() -> *mut Self {
+        let layout = Layout::new::<Self>();
+        let ptr = unsafe { alloc_zeroed(layout) };
+        if ptr.is_null() {
+            handle_alloc_error(layout);
+        }
+        let this: *mut Self = ptr.cast();
+        unsafe { Self::init_from_zeroed(this) }
+        this
+    }
+
+    #[allow(clippy::cast_possible_truncation)]
+    unsafe fn init_from_zeroed(this: *mut Self) {
+        (*this).repr = HllRepr::Nibble;
+        (*this).base = 0;
+        (*this).card = const { AtomicU64::new(0) };
+        (*this).hist[0] = HLL_REGISTERS as u16;
+        ptr::addr_of_mut!((*this).overflow).write(Vec::new());
+        // ...zero-initialized
+    }
+
+    pub unsafe fn destroy(this: *mut Self) {
+        ptr::drop_in_place(ptr::addr_of_mut!((*this).overflow));
+        let layout = Layout::new::<Self>();
+        dealloc(this.cast(), layout);
+    }
+
+    pub fn clear(&mut self) {
+        unsafe {
+            let this = ptr::from_mut(self);
+            ptr::drop_in_place(ptr::addr_of_mut!((*this).overflow));
+            this.write_bytes(0, 1);
+            Self::init_from_zeroed(this);
+        }
+    }
+
+    pub fn insert(&mut self, hash: u64) -> bool {
+        let (index, count) = hll_pattern(hash);
+        self.raise(index as usize, count)
+    }
+
+    /// Raises the register at `index` to `count`. Returns `true` if the register changed.
+    #[inline(always)]
+    fn raise(&mut self, index: usize, count: u8) -> bool {
+        // every register is at least `base`
+        if count <= self.base {
+            return false;
+        }
+
+        let old_count = self.get(index);
+
+        if count <= old_count {
+            return false;
+        }
+
+        self.set(index, count);
+
+        self.hist[old_count] -= 1;
+        self.hist[count] += 1;
+
+        if old_count == self.base && self.hist[old_count] == 0 {
+            self.rebase();
+        }
+
+        *self.card.get_mut() = u64::MAX;
+
+        true
+    }
+
+    pub fn insert_hashes(&mut self, hashes: &[u64]) -> bool {
+        let mut updated = false;
+        for &hash in hashes {
+            updated |= self.insert(hash);
+        }
+        updated
+    }
+
+    /// Merges the sparse opcodes of a Redis string value as point updates.
+    /// Returns `None`, leaving the sketch unchanged, if the opcodes are corrupted.
+    pub fn merge_sparse(&mut self, sparse: &[u8]) -> Option<()> {
+        redis::sparse_for_each_val(sparse, |index, len, value| {
+            for index in index..index + len {
+                self.raise(index, value);
+            }
+        })
+    }
+
+    pub fn count(&self) -> u64 {
+        let card = self.card.load(Ordering::Relaxed);
+        if card != u64::MAX {
+            return card;
+        }
+
+        let ans = hll_estimate(self.hist.as_array());
+
+        self.card.store(ans, Ordering::Relaxed);
+        ans
+    }
+
+    /// Computes the cardinality with `estimator`, bypassing the cache.
+    pub fn count_with(&self, estimator: Estimator) -> u64 {
+        match estimator {
+            Estimator::Improved => hll_estimate(self.hist.as_array()),
+            Estimator::Mle => hll_estimate_mle(self.hist.as_array()),
+        }
+    }
+
+    pub fn histogram(&self) -> &[u16; HLL_HIST_LEN] {
+        self.hist.as_array()
+    }
+
+    /// Returns the cached cardinality, or `u64::MAX` if it is stale.
+    pub fn cached_count(&self) -> u64 {
+        self.card.load(Ordering::Relaxed)
+    }
+
+    pub fn set_cached_count(&self, card: u64) {
+        self.card.store(card, Ordering::Relaxed);
+    }
+
+    /// Returns the heap memory held by the sketch, in bytes.
+    pub fn memory_usage(&self) -> usize {
+        std::mem::size_of::<Self>() + self.overflow.capacity() * std::mem::size_of::<(u16, u8)>()
+    }
+
+    /// Serializes the registers and the cached cardinality in the compact encoding,
+    /// which shares the nibble layout.
+    pub fn to_compact(&self, hasher: u8) -> Vec<u8> {
+        unsafe {
+            let mut reg_raw: MaybeUninit<[u8; HLL_REGISTERS]> = MaybeUninit::uninit();
+            let reg_raw = reg_raw.as_mut_ptr().cast::<u8>();
+            self.to_raw(reg_raw);
+            raw_to_compact(reg_raw, hasher, self.base, self.card.load(Ordering::Relaxed))
+        }
+    }
+
+    /// Writes the registers to `reg_raw`, one byte each.
+    pub unsafe fn to_raw(&self, reg_raw: *mut u8) {
+        decode_nibbles(reg_raw, self.nibbles.as_ptr(), self.base);
+        for &(index, value) in &self.overflow {
+            *reg_raw.add(usize::from(index)) = value;
+        }
+    }
+
+    /// Raises each register of `reg_raw` to the matching register of the sketch.
+    pub unsafe fn max_into(&self, reg_raw: *mut u8) {
+        merge_max_nibbles(reg_raw, self.nibbles.as_ptr(), self.base);
+        // escaped registers were raised to `base + 15` above, which is below their value
+        for &(index, value) in &self.overflow {
+            let raw = &mut *reg_raw.add(usize::from(index));
+            *raw = (*raw).max(value);
+        }
+    }
+
+    /// Replaces the registers with `reg_raw` and marks the cardinality as stale.
+    #[allow(clippy::cast_possible_truncation)]
+    pub unsafe fn load_raw(&mut self, reg_raw: *const u8) {
+        reg_histogram(self.hist.as_mut_ptr(), reg_raw);
+
+        let mut count_min = 0;
+        while self.hist[count_min] == 0 {
+            count_min += 1;
+        }
+        self.base = count_min;
+
+        let overflow = &mut self.overflow;
+        overflow.clear();
+        encode_nibbles(self.nibbles.as_mut_ptr(), reg_raw, count_min, &mut |index, value| {
+            overflow.push((index as u16, value));
+        });
+
+        *self.card.get_mut() = u64::MAX;
+    }
+
+    #[inline(always)]
+    fn get(&self, index: usize) -> u8 {
+        let offset = unsafe { get_nibble(self.nibbles.as_ptr(), index) };
+        if offset != NIBBLE_ESCAPE {
+            return self.base + offset;
+        }
+        match self.find(index) {
+            Ok(k) => self.overflow[k].1,
+            Err(_) => unreachable!("escaped register without an overflow entry"),
+        }
+    }
+
+    /// Sets the register at `index` to `value`, which must be larger than its current value.
+    #[inline(always)]
+    #[allow(clippy::cast_possible_truncation)]
+    fn set(&mut self, index: usize, value: u8) {
+        let offset = value - self.base;
+        if offset < NIBBLE_ESCAPE {
+            unsafe { set_nibble(self.nibbles.as_mut_ptr(), index, offset) }
+            return;
+        }
+        unsafe { set_nibble(self.nibbles.as_mut_ptr(), index, NIBBLE_ESCAPE) }
+        match self.find(index) {
+            Ok(k) => self.overflow[k].1 = value,
+            Err(k) => self.overflow.insert(k, (index as u16, value)),
+        }
+    }
+
+    #[allow(clippy::cast_possible_truncation)]
+    fn find(&self, index: usize) -> Result<usize, usize> {
+        self.overflow.binary_search_by_key(&(index as u16), |&(i, _)| i)
+    }
+
+    /// Moves `base` up to the new smallest register.
+    fn rebase(&mut self) {
+        let mut count_min = self.base;
+        while self.hist[count_min] == 0 {
+            count_min += 1;
+        }
+        let delta = count_min - self.base;
+        self.base = count_min;
+
+        let nibbles = self.nibbles.as_mut_ptr();
+        unsafe { rebase_nibbles(nibbles, delta) }
+
+        self.overflow.retain(|&(index, value)| {
+            let offset = value - count_min;
+            if offset >= NIBBLE_ESCAPE {
+                return true;
+            }
+            unsafe { set_nibble(nibbles, usize::from(index), offset) }
+            false
+        });
+    }
+}
+
+#[inline(always)]
+unsafe fn get_nibble(nibbles: *const u8, index: usize) -> u8 {
+    (*nibbles.add(index / 2) >> (4 * (index & 1))) & 0x0f
+}
+
+#[inline(always)]
+unsafe fn set_nibble(nibbles: *mut u8, index: usize, offset: u8) {
+    let shift = 4 * (index & 1);
+    let byte = &mut *nibbles.add(index / 2);
+    *byte = (*byte & !(0x0f << shift)) | (offset << shift);
+}
+
+/// Writes the 4-bit offsets of `reg_raw` from `base` to `nibbles` and reports each escaped
+/// register to `on_escape`, in index order. Returns the number of escapes.
+#[inline(always)]
+pub unsafe fn encode_nibbles(nibbles: *mut u8, reg_raw: *const u8, base: u8, on_escape: &mut impl FnMut(usize, u8)) -> usize {
+    if const { HLL_REGISTERS % 32 == 0 } && is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        return encode_nibbles_avx2(nibbles, reg_raw, base, on_escape);
+    }
+    encode_nibbles_scalar(nibbles, reg_raw, base, on_escape)
+}
+
+unsafe fn encode_nibbles_scalar(nibbles: *mut u8, reg_raw: *const u8, base: u8, on_escape: &mut impl FnMut(usize, u8)) -> usize {
+    let mut n = 0;
+    for i in 0..NIBBLES_LEN {
+        let mut byte = 0;
+        for k in 0..2 {
+            let val = *reg_raw.add(2 * i + k);
+            let offset = (val - base).min(NIBBLE_ESCAPE);
+            if offset == NIBBLE_ESCAPE {
+                on_escape(2 * i + k, val);
+                n += 1;
+            }
+            byte |= offset << (4 * k);
+        }
+        *nibbles.add(i) = byte;
+    }
+    n
+}
+
+/// Saturates the offsets at 15, pairs neighbouring bytes into nibbles with one `vpmaddubsw`
+/// (`even + 16 * odd`), and narrows the 16-bit sums back to bytes.
+/// Escapes are found by a movemask and handled in scalar code, since they are rare.
+#[allow(clippy::cast_possible_wrap, clippy::cast_sign_loss)]
+#[target_feature(enable = "avx2")]
+unsafe fn encode_nibbles_avx2(nibbles: *mut u8, reg_raw: *const u8, base: u8, on_escape: &mut impl FnMut(usize, u8)) -> usize {
+    use core::arch::x86_64::*;
+
+    let vbase = _mm256_set1_epi8(base as i8);
+    let escape = _mm256_set1_epi8(NIBBLE_ESCAPE as i8);
+    let weights = _mm256_set1_epi16(0x1001);
+
+    let mut n = 0;
+    for j in 0..HLL_REGISTERS / 32 {
+        let x = _mm256_loadu_si256(reg_raw.add(j * 32).cast());
+        let offset = _mm256_min_epu8(_mm256_subs_epu8(x, vbase), escape);
+
+        let mut m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(offset, escape)) as u32;
+        while m != 0 {
+            let i = j * 32 + m.trailing_zeros() as usize;
+            on_escape(i, *reg_raw.add(i));
+            n += 1;
+            m &= m - 1;
+        }
+
+        let pairs = _mm256_maddubs_epi16(offset, weights);
+        let packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(pairs, pairs), 0b1000);
+        _mm_storeu_si128(nibbles.add(j * 16).cast(), _mm256_castsi256_si128(packed));
+    }
+    n
+}
+
+/// Expands the nibbles into `base + offset` registers and returns the number of escapes.
+/// Escaped registers are left as `base + 15`.
+#[inline(always)]
+pub unsafe fn decode_nibbles(reg_raw: *mut u8, nibbles: *const u8, base: u8) -> usize {
+    if const { HLL_REGISTERS % 32 == 0 } && is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        return decode_nibbles_avx2(reg_raw, nibbles, base);
+    }
+    decode_nibbles_scalar(reg_raw, nibbles, base)
+}
+
+unsafe fn decode_nibbles_scalar(reg_raw: *mut u8, nibbles: *const u8, base: u8) -> usize {
+    let mut n = 0;
+    for i in 0..NIBBLES_LEN {
+        let byte = *nibbles.add(i);
+        for k in 0..2 {
+            let offset = (byte >> (4 * k)) & 0x0f;
+            n += usize::from(offset == NIBBLE_ESCAPE);
+            *reg_raw.add(2 * i + k) = base.wrapping_add(offset);
+        }
+    }
+    n
+}
+
+#[allow(clippy::cast_possible_wrap, clippy::cast_sign_loss)]
+#[target_feature(enable = "avx2")]
+unsafe fn decode_nibbles_avx2(reg_raw: *mut u8, nibbles: *const u8, base: u8) -> usize {
+    use core::arch::x86_64::*;
+
+    let vbase = _mm256_set1_epi8(base as i8);
+    let escape = _mm256_set1_epi8(NIBBLE_ESCAPE as i8);
+
+    let mut n = 0;
+    for j in 0..HLL_REGISTERS / 32 {
+        let offset = expand_nibbles_avx2(nibbles.add(j * 16));
+        n += _mm256_movemask_epi8(_mm256_cmpeq_epi8(offset, escape)).count_ones() as usize;
+        _mm256_storeu_si256(reg_raw.add(j * 32).cast(), _mm256_add_epi8(offset, vbase));
+    }
+    n
+}
+
+/// Expands 16 bytes of nibbles into 32 offsets, in register order.
+#[inline]
+#[target_feature(enable = "avx2")]
+unsafe fn expand_nibbles_avx2(nibbles: *const u8) -> core::arch::x86_64::__m256i {
+    use core::arch::x86_64::*;
+
+    let low = _mm_set1_epi8(0x0f);
+    let b = _mm_loadu_si128(nibbles.cast());
+    let lo = _mm_and_si128(b, low);
+    let hi = _mm_and_si128(_mm_srli_epi16(b, 4), low);
+    _mm256_set_m128i(_mm_unpackhi_epi8(lo, hi), _mm_unpacklo_epi8(lo, hi))
+}
+
+/// Raises each register of `reg_raw` to `base + offset`.
+/// Escaped registers are only raised to `base + 15`.
+#[inline(always)]
+unsafe fn merge_max_nibbles(reg_raw: *mut u8, nibbles: *const u8, base: u8) {
+    if const { HLL_REGISTERS % 32 == 0 } && is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        return merge_max_nibbles_avx2(reg_raw, nibbles, base);
+    }
+    merge_max_nibbles_scalar(reg_raw, nibbles, base);
+}
+
+unsafe fn merge_max_nibbles_scalar(reg_raw: *mut u8, nibbles: *const u8, base: u8) {
+    for i in 0..HLL_REGISTERS {
+        let val = base + get_nibble(nibbles, i);
+        let raw = &mut *reg_raw.add(i);
+        if val > *raw {
+            *raw = val;
+        }
+    }
+}
+
+#[allow(clippy::cast_possible_wrap)]
+#[target_feature(enable = "avx2")]
+unsafe fn merge_max_nibbles_avx2(reg_raw: *mut u8, nibbles: *const u8, base: u8) {
+    use core::arch::x86_64::*;
+
+    let vbase = _mm256_set1_epi8(base as i8);
+
+    for j in 0..HLL_REGISTERS / 32 {
+        let y = _mm256_add_epi8(expand_nibbles_avx2(nibbles.add(j * 16)), vbase);
+        let t = reg_raw.add(j * 32);
+        let z = _mm256_loadu_si256(t.cast());
+        _mm256_storeu_si256(t.cast(), _mm256_max_epu8(z, y));
+    }
+}
+
+/// Subtracts `delta` from every offset except the escapes.
+#[inline(always)]
+unsafe fn rebase_nibbles(nibbles: *mut u8, delta: u8) {
+    if const { NIBBLES_LEN % 32 == 0 } && is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        return rebase_nibbles_avx2(nibbles, delta);
+    }
+    rebase_nibbles_scalar(nibbles, delta);
+}
+
+unsafe fn rebase_nibbles_scalar(nibbles: *mut u8, delta: u8) {
+    for i in 0..NIBBLES_LEN {
+        let byte = &mut *nibbles.add(i);
+        let mut lo = *byte & 0x0f;
+        let mut hi = *byte >> 4;
+        if lo != NIBBLE_ESCAPE {
+            lo -= delta;
+        }
+        if hi != NIBBLE_ESCAPE {
+            hi -= delta;
+        }
+        *byte = lo | (hi << 4);
+    }
+}
+
+/// Works on both nibbles of each byte in place: the escapes are masked out of the subtrahend,
+/// and the high half is shifted within 16-bit lanes, which cannot carry into the next byte.
+#[allow(clippy::cast_possible_wrap)]
+#[target_feature(enable = "avx2")]
+unsafe fn rebase_nibbles_avx2(nibbles: *mut u8, delta: u8) {
+    use core::arch::x86_64::*;
+
+    let low = _mm256_set1_epi8(0x0f);
+    let escape = _mm256_set1_epi8(NIBBLE_ESCAPE as i8);
+    let vdelta = _mm256_set1_epi8(delta as i8);
+
+    for j in 0..NIBBLES_LEN / 32 {
+        let t = nibbles.add(j * 32);
+        let b = _mm256_loadu_si256(t.cast());
+
+        let lo = _mm256_and_si256(b, low);
+        let hi = _mm256_and_si256(_mm256_srli_epi16(b, 4), low);
+        let lo = _mm256_sub_epi8(lo, _mm256_andnot_si256(_mm256_cmpeq_epi8(lo, escape), vdelta));
+        let hi = _mm256_sub_epi8(hi, _mm256_andnot_si256(_mm256_cmpeq_epi8(hi, escape), vdelta));
+
+        _mm256_storeu_si256(t.cast(), _mm256_or_si256(lo, _mm256_slli_epi16(hi, 4)));
+    }
+}
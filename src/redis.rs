@@ -0,0 +1,280 @@
+//! The Redis string value of a `HyperLogLog`: a 16-byte `HYLL` header followed by
+//! the dense registers or the sparse run-length opcodes.
+//!
+//! Sparse opcodes:
+//! + `ZERO`:  `00xxxxxx`, `xxxxxx + 1` registers set to 0
+//! + `XZERO`: `01xxxxxx yyyyyyyy`, `xxxxxxyyyyyyyy + 1` registers set to 0
+//! + `VAL`:   `1vvvvvxx`, `xx + 1` registers set to `vvvvv + 1`
+
+use crate::config::*;
+use crate::dense::{unpack, HLL_DENSE_LEN};
+
+pub const HLL_MAGIC: [u8; 4] = *b"HYLL";
+pub const HLL_HDR_LEN: usize = 16;
+
+/// Size of a dense string value.
+pub const HLL_DENSE_SIZE: usize = HLL_HDR_LEN + HLL_DENSE_LEN;
+
+pub const HLL_DENSE: u8 = 0;
+pub const HLL_SPARSE: u8 = 1;
+
+/// The most significant bit of the cached cardinality marks it as stale.
+const HLL_CARD_STALE: u64 = 1 << 63;
+
+/// Checks the header and returns the encoding and the cached cardinality, if valid.
+pub fn parse_header(bytes: &[u8]) -> Option<(u8, Option<u64>)> {
+    let header = bytes.get(..HLL_HDR_LEN)?;
+    if header[..4] != HLL_MAGIC {
+        return None;
+    }
+    let encoding = header[4];
+    match encoding {
+        HLL_DENSE if bytes.len() != HLL_DENSE_SIZE => return None,
+        HLL_DENSE | HLL_SPARSE => {}
+        _ => return None,
+    }
+    let card = u64::from_le_bytes(header[8..].try_into().unwrap());
+    let card = if card & HLL_CARD_STALE == 0 { Some(card) } else { None };
+    Some((encoding, card))
+}
+
+/// Writes a dense header with the cached cardinality `card` (`u64::MAX` if stale).
+pub fn write_header(header: &mut [u8], card: u64) {
+    header[..4].copy_from_slice(&HLL_MAGIC);
+    header[4..8].fill(0);
+    set_cached_card(header, card);
+}
+
+pub fn set_cached_card(header: &mut [u8], card: u64) {
+    let card = if card == u64::MAX { HLL_CARD_STALE } else { card };
+    header[8..16].copy_from_slice(&card.to_le_bytes());
+}
+
+/// Decodes the registers of a value whose header is valid. Returns `None` if the value is corrupted.
+pub fn value_to_raw(reg_raw: &mut [u8; HLL_REGISTERS], bytes: &[u8]) -> Option<()> {
+    let body = &bytes[HLL_HDR_LEN..];
+    match bytes[4] {
+        HLL_DENSE => {
+            // unpacking reads exactly `HLL_DENSE_LEN` bytes
+            assert_eq!(body.len(), HLL_DENSE_LEN);
+            unsafe { unpack(reg_raw.as_mut_ptr(), body.as_ptr()) };
+            Some(())
+        }
+        _ => sparse_to_raw(reg_raw, body),
+    }
+}
+
+/// Raises each register of `acc` to the matching register of a value whose header is valid.
+/// `tmp` is scratch space. Returns `None` if the value is corrupted.
+pub fn value_max_into(acc: &mut [u8; HLL_REGISTERS], tmp: &mut [u8; HLL_REGISTERS], bytes: &[u8]) -> Option<()> {
+    if bytes[4] == HLL_SPARSE {
+        return sparse_max_into(acc, &bytes[HLL_HDR_LEN..]);
+    }
+    value_to_raw(tmp, bytes)?;
+    for (a, &t) in acc.iter_mut().zip(tmp.iter()) {
+        *a = (*a).max(t);
+    }
+    Some(())
+}
+
+/// Reads the opcode at `sparse[*i]` and advances `i`. Returns the run length and the value.
+#[inline(always)]
+fn next_run(sparse: &[u8], i: &mut usize) -> Option<(usize, u8)> {
+    let op = sparse[*i];
+    if op & 0x80 != 0 {
+        *i += 1;
+        Some((usize::from(op & 0x03) + 1, ((op >> 2) & 0x1f) + 1))
+    } else if op & 0x40 != 0 {
+        let next = *sparse.get(*i + 1)?;
+        *i += 2;
+        Some(((usize::from(op & 0x3f) << 8 | usize::from(next)) + 1, 0))
+    } else {
+        *i += 1;
+        Some((usize::from(op & 0x3f) + 1, 0))
+    }
+}
+
+/// Decodes sparse opcodes into `reg_raw`. Returns `None` if the runs do not cover
+/// exactly `HLL_REGISTERS` registers.
+pub fn sparse_to_raw(reg_raw: &mut [u8; HLL_REGISTERS], sparse: &[u8]) -> Option<()> {
+    if is_simd_enabled() && is_x86_feature_detected!("avx2") {
+        return unsafe { sparse_to_raw_avx2(reg_raw, sparse) };
+    }
+    sparse_to_raw_scalar(reg_raw, sparse)
+}
+
+fn sparse_to_raw_scalar(reg_raw: &mut [u8; HLL_REGISTERS], sparse: &[u8]) -> Option<()> {
+    let mut idx = 0;
+    let mut i = 0;
+    while i < sparse.len() {
+        let (len, value) = next_run(sparse, &mut i)?;
+        reg_raw.get_mut(idx..idx + len)?.fill(value);
+        idx += len;
+    }
+    (idx == HLL_REGISTERS).then_some(())
+}
+
+/// Zeroes the registers with vector stores first, so zero runs only advance the index.
+/// A `VAL` run is one 4-byte store of the value masked to the run length: the bytes past
+/// the run are zero, which is either right or rewritten by a later run.
+#[allow(clippy::cast_possible_truncation, clippy::cast_ptr_alignment)]
+#[target_feature(enable = "avx2")]
+unsafe fn sparse_to_raw_avx2(reg_raw: &mut [u8; HLL_REGISTERS], sparse: &[u8]) -> Option<()> {
+    use core::arch::x86_64::*;
+
+    const LEN_MASK: [u32; 4] = [0xff, 0xffff, 0x00ff_ffff, 0xffff_ffff];
+
+    let raw = reg_raw.as_mut_ptr();
+    let zero = _mm256_setzero_si256();
+    for j in 0..HLL_REGISTERS / 32 {
+        _mm256_storeu_si256(raw.add(j * 32).cast(), zero);
+    }
+
+    let mut idx = 0;
+    let mut i = 0;
+    while i < sparse.len() {
+        let op = *sparse.get_unchecked(i);
+        if op & 0x80 != 0 {
+            let len = usize::from(op & 0x03);
+            let value = u32::from((op >> 2) & 0x1f) + 1;
+            if idx + 4 <= HLL_REGISTERS {
+                raw.add(idx)
+                    .cast::<u32>()
+                    .write_unaligned((value * 0x0101_0101) & LEN_MASK[len]);
+            } else if idx + len < HLL_REGISTERS {
+                raw.add(idx).write_bytes(value as u8, len + 1);
+            }
+            idx += len + 1;
+            i += 1;
+        } else {
+            let (len, _) = next_run(sparse, &mut i)?;
+            idx += len;
+        }
+    }
+    (idx == HLL_REGISTERS).then_some(())
+}
+
+/// Builds the register histogram from the runs, without decoding the registers.
+pub fn sparse_histogram(hist: &mut [u16; HLL_HIST_LEN], sparse: &[u8]) -> Option<()> {
+    hist.fill(0);
+    let mut idx = 0;
+    let mut i = 0;
+    while i < sparse.len() {
+        let (len, value) = next_run(sparse, &mut i)?;
+        idx += len;
+        if idx > HLL_REGISTERS {
+            return None;
+        }
+        #[allow(clippy::cast_possible_truncation)]
+        let len = len as u16;
+        hist[usize::from(value)] += len;
+    }
+    (idx == HLL_REGISTERS).then_some(())
+}
+
+/// Raises the registers of `acc` covered by `VAL` runs. Zero runs cannot raise a register
+/// and are skipped, so the cost is proportional to the number of non-zero registers.
+pub fn sparse_max_into(acc: &mut [u8; HLL_REGISTERS], sparse: &[u8]) -> Option<()> {
+    sparse_for_each_val(sparse, |index, len, value| {
+        for a in &mut acc[index..index + len] {
+            *a = (*a).max(value);
+        }
+    })
+}
+
+/// Calls `f(index, len, value)` for each `VAL` run. The runs are checked first: if they do not
+/// cover exactly `HLL_REGISTERS` registers, returns `None` without calling `f`.
+pub fn sparse_for_each_val(sparse: &[u8], mut f: impl FnMut(usize, usize, u8)) -> Option<()> {
+    let mut idx = 0;
+    let mut i = 0;
+    while i < sparse.len() {
+        let (len, _) = next_run(sparse, &mut i)?;
+        idx += len;
+    }
+    if idx != HLL_REGISTERS {
+        return None;
+    }
+
+    idx = 0;
+    i = 0;
+    while i < sparse.len() {
+        let (len, value) = next_run(sparse, &mut i)?;
+        if value != 0 {
+            f(idx, len, value);
+        }
+        idx += len;
+    }
+    Some(())
+}
+
+/// The largest register a `VAL` opcode can hold.
+pub const HLL_SPARSE_VAL_MAX: u8 = 32;
+
+/// Appends the sparse opcodes of `reg_raw` to `out`, like `hllDenseToSparse`.
+/// Returns `None` if a register is above `HLL_SPARSE_VAL_MAX`.
+#[allow(clippy::cast_possible_truncation)]
+pub fn raw_to_sparse(reg_raw: &[u8; HLL_REGISTERS], out: &mut Vec<u8>) -> Option<()> {
+    let mut idx = 0;
+    while idx < HLL_REGISTERS {
+        let value = reg_raw[idx];
+        let run = reg_raw[idx..].iter().take_while(|&&x| x == value).count();
+        if value == 0 {
+            let len = run.min(1 << 14);
+            if len <= 64 {
+                out.push((len - 1) as u8);
+            } else {
+                out.push(0x40 | ((len - 1) >> 8) as u8);
+                out.push((len - 1) as u8);
+            }
+            idx += len;
+        } else {
+            if value > HLL_SPARSE_VAL_MAX {
+                return None;
+            }
+            let mut left = run;
+            while left > 0 {
+                let len = left.min(4);
+                out.push(0x80 | ((value - 1) << 2) | (len - 1) as u8);
+                left -= len;
+            }
+            idx += run;
+        }
+    }
+    Some(())
+}
+
+/// Reads the register at `index` of dense registers, like `HLL_DENSE_GET_REGISTER`.
+/// Unlike the unpacking kernels, never reads past the last register.
+#[allow(clippy::cast_possible_truncation)]
+pub fn dense_get(reg_dense: &[u8], index: usize) -> u8 {
+    let byte = index * HLL_BITS / 8;
+    let low = (index * HLL_BITS) & 7;
+    let b0 = u16::from(reg_dense[byte]);
+    let b1 = u16::from(reg_dense.get(byte + 1).copied().unwrap_or(0));
+    (((b0 | (b1 << 8)) >> low) & ((1 << HLL_BITS) - 1)) as u8
+}
+
+/// Writes the register at `index` of dense registers, like `HLL_DENSE_SET_REGISTER`.
+#[allow(clippy::cast_possible_truncation)]
+pub fn dense_set(reg_dense: &mut [u8], index: usize, value: u8) {
+    let byte = index * HLL_BITS / 8;
+    let low = (index * HLL_BITS) & 7;
+    let mask = ((1u16 << HLL_BITS) - 1) << low;
+    let value = u16::from(value) << low;
+
+    reg_dense[byte] = (u16::from(reg_dense[byte]) & !mask | value) as u8;
+    if let Some(b1) = reg_dense.get_mut(byte + 1) {
+        *b1 = ((u16::from(*b1) << 8 & !mask | value) >> 8) as u8;
+    }
+}
+
+/// Adds a hash to dense registers in place, like `PFADD`. Returns `true` if a register changed.
+pub fn dense_insert(reg_dense: &mut [u8], hash: u64) -> bool {
+    let (index, count) = hll_pattern(hash);
+    let index = index as usize;
+    if dense_get(reg_dense, index) >= count {
+        return false;
+    }
+    dense_set(reg_dense, index, count);
+    true
+}
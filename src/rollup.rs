@@ -0,0 +1,102 @@
+//! A rollup index over an append-only sequence of sketches (e.g. one per minute).
+//!
+//! Level `k` stores the union of every aligned span of `2^k` sketches, like the nodes of
+//! a segment tree. Any range is covered by at most two spans per level, so a range count
+//! is one `union_count` over `O(log n)` sketches instead of a merge over the whole range.
+
+use crate::{HllHasher, HyperLogLog, MurmurHash64A};
+
+use std::ops::Range;
+
+pub struct SketchRollup<H = MurmurHash64A> {
+    /// `levels[k][j]` is the union of sketches `j << k .. (j + 1) << k`.
+    /// Only complete spans are stored.
+    levels: Vec<Vec<HyperLogLog<H>>>,
+}
+
+impl<H: HllHasher + Default> SketchRollup<H> {
+    #[must_use]
+    pub fn new() -> Self {
+        Self {
+            levels: vec![Vec::new()],
+        }
+    }
+
+    #[must_use]
+    pub fn len(&self) -> usize {
+        self.levels[0].len()
+    }
+
+    #[must_use]
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    #[must_use]
+    pub fn get(&self, index: usize) -> Option<&HyperLogLog<H>> {
+        self.levels[0].get(index)
+    }
+
+    /// Appends a sketch and builds the spans it completes.
+    /// Costs one merge amortized.
+    pub fn push(&mut self, sketch: HyperLogLog<H>) {
+        self.levels[0].push(sketch);
+
+        let mut k = 1;
+        while self.levels[k - 1].len() % 2 == 0 {
+            if self.levels.len() == k {
+                self.levels.push(Vec::new());
+            }
+
+            let j = self.levels[k].len();
+            let mut node = HyperLogLog::default();
+            node.merge(&self.levels[k - 1][2 * j..2 * j + 2]);
+            self.levels[k].push(node);
+
+            k += 1;
+        }
+    }
+
+    /// Merges `sources` into the sketch at `index`, e.g. for late data,
+    /// and into every span that contains it.
+    pub fn merge_into(&mut self, index: usize, sources: &[HyperLogLog<H>]) {
+        assert!(index < self.len());
+        for (k, level) in self.levels.iter_mut().enumerate() {
+            if let Some(node) = level.get_mut(index >> k) {
+                node.merge(sources);
+            }
+        }
+    }
+
+    /// Estimates the cardinality of the union of the sketches in `range`.
+    #[must_use]
+    pub fn count(&self, range: Range<usize>) -> u64 {
+        assert!(range.end <= self.len());
+
+        let mut sources = Vec::with_capacity(2 * self.levels.len());
+        let Range { mut start, end } = range;
+        while start < end {
+            // the largest aligned span that starts at `start` and ends within the range
+            let mut k = (start.trailing_zeros() as usize).min(self.levels.len() - 1);
+            while start + (1 << k) > end {
+                k -= 1;
+            }
+            sources.push(&self.levels[k][start >> k]);
+            start += 1 << k;
+        }
+
+        HyperLogLog::union_count(&sources)
+    }
+
+    /// Returns the heap memory held by all sketches, in bytes.
+    #[must_use]
+    pub fn memory_usage(&self) -> usize {
+        self.levels.iter().flatten().map(HyperLogLog::memory_usage).sum()
+    }
+}
+
+impl<H: HllHasher + Default> Default for SketchRollup<H> {
+    fn default() -> Self {
+        Self::new()
+    }
+}
@@ -0,0 +1,204 @@
+//! A single-writer, multi-reader split of a `HyperLogLog`.
+//!
+//! The writer owns the sketch. After every mutation that changes a register it publishes
+//! the register histogram and the cached cardinality through a seqlock, so readers can
+//! serve `PFCOUNT` on other threads without locks and without touching the registers.
+
+use crate::config::{hll_estimate, HLL_HIST_LEN};
+use crate::{HllHasher, HyperLogLog};
+
+use std::cell::Cell;
+use std::hint;
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+use std::sync::Arc;
+
+const STALE: u64 = u64::MAX;
+
+/// Histogram bins packed into each published word.
+const BINS_PER_WORD: usize = 4;
+
+/// The published histogram and cardinality, guarded by a sequence number
+/// that is odd while the writer is in the middle of an update.
+struct Snapshot {
+    seq: AtomicU64,
+    card: AtomicU64,
+    hist: [AtomicU64; HLL_HIST_LEN / BINS_PER_WORD],
+}
+
+impl Snapshot {
+    fn new() -> Self {
+        Self {
+            seq: AtomicU64::new(0),
+            card: AtomicU64::new(0),
+            hist: [const { AtomicU64::new(0) }; HLL_HIST_LEN / BINS_PER_WORD],
+        }
+    }
+
+    /// Only the single writer may call this.
+    fn store(&self, hist: &[u16; HLL_HIST_LEN], card: u64) {
+        let seq = self.seq.load(Ordering::Relaxed);
+        self.seq.store(seq + 1, Ordering::Relaxed);
+        fence(Ordering::Release);
+
+        self.card.store(card, Ordering::Relaxed);
+        for (word, bins) in self.hist.iter().zip(hist.chunks_exact(BINS_PER_WORD)) {
+            let packed = bins.iter().rev().fold(0, |acc, &b| (acc << 16) | u64::from(b));
+            word.store(packed, Ordering::Relaxed);
+        }
+
+        self.seq.store(seq + 2, Ordering::Release);
+    }
+
+    /// Returns a consistent `(seq, hist, card)`, retrying while a store is in progress.
+    #[allow(clippy::cast_possible_truncation)]
+    fn load(&self) -> (u64, [u16; HLL_HIST_LEN], u64) {
+        let mut hist = [0; HLL_HIST_LEN];
+        loop {
+            let seq = self.seq.load(Ordering::Acquire);
+            if seq & 1 != 0 {
+                hint::spin_loop();
+                continue;
+            }
+
+            let card = self.card.load(Ordering::Relaxed);
+            for (word, bins) in self.hist.iter().zip(hist.chunks_exact_mut(BINS_PER_WORD)) {
+                let packed = word.load(Ordering::Relaxed);
+                for (k, b) in bins.iter_mut().enumerate() {
+                    *b = (packed >> (16 * k)) as u16;
+                }
+            }
+
+            fence(Ordering::Acquire);
+            if self.seq.load(Ordering::Relaxed) == seq {
+                return (seq, hist, card);
+            }
+        }
+    }
+}
+
+/// The writing half of a shared `HyperLogLog`.
+///
+/// Inserts and merges go to the owned sketch. Every call that updates a register
+/// publishes a new snapshot before it returns, so a reader sees either the state
+/// before the call or the state after it.
+pub struct HllWriter<H = crate::MurmurHash64A> {
+    hll: HyperLogLog<H>,
+    snapshot: Arc<Snapshot>,
+}
+
+impl<H: HllHasher> HllWriter<H> {
+    pub(crate) fn new(hll: HyperLogLog<H>) -> (Self, HllReader) {
+        let this = Self {
+            hll,
+            snapshot: Arc::new(Snapshot::new()),
+        };
+        this.publish();
+        let reader = this.reader();
+        (this, reader)
+    }
+
+    /// Creates another reader of this sketch.
+    #[must_use]
+    pub fn reader(&self) -> HllReader {
+        HllReader {
+            snapshot: Arc::clone(&self.snapshot),
+            cache: Cell::new((u64::MAX, STALE)),
+        }
+    }
+
+    fn publish(&self) {
+        self.snapshot.store(self.hll.histogram(), self.hll.cached_count());
+    }
+
+    fn publish_if(&self, updated: bool) -> bool {
+        if updated {
+            self.publish();
+        }
+        updated
+    }
+
+    pub fn insert(&mut self, key: &[u8]) -> bool {
+        let updated = self.hll.insert(key);
+        self.publish_if(updated)
+    }
+
+    pub fn insert_many(&mut self, keys: &[&[u8]]) -> bool {
+        let updated = self.hll.insert_many(keys);
+        self.publish_if(updated)
+    }
+
+    pub fn insert_hash(&mut self, hash: u64) -> bool {
+        let updated = self.hll.insert_hash(hash);
+        self.publish_if(updated)
+    }
+
+    pub fn insert_hashes(&mut self, hashes: &[u64]) -> bool {
+        let updated = self.hll.insert_hashes(hashes);
+        self.publish_if(updated)
+    }
+
+    pub fn merge(&mut self, sources: &[HyperLogLog<H>]) {
+        self.hll.merge(sources);
+        self.publish();
+    }
+
+    pub fn clear(&mut self) {
+        self.hll.clear();
+        self.publish();
+    }
+
+    /// Computes the cardinality, and publishes it if readers only had a stale one.
+    /// Takes `&mut self` because publishing must not race with itself.
+    #[must_use]
+    pub fn count(&mut self) -> u64 {
+        let stale = self.hll.cached_count() == STALE;
+        let ans = self.hll.count();
+        if stale {
+            self.publish();
+        }
+        ans
+    }
+
+    /// Returns the sketch, e.g. to merge it or read its registers.
+    #[must_use]
+    pub fn get(&self) -> &HyperLogLog<H> {
+        &self.hll
+    }
+
+    /// Detaches the sketch. Existing readers keep the last published snapshot.
+    #[must_use]
+    pub fn into_inner(self) -> HyperLogLog<H> {
+        self.hll
+    }
+}
+
+/// The reading half of a shared `HyperLogLog`.
+///
+/// `count` never blocks the writer. A stale cardinality is recomputed from the
+/// published histogram and kept in a per-reader cache until the next snapshot.
+/// Clone a reader for each thread.
+#[derive(Clone)]
+pub struct HllReader {
+    snapshot: Arc<Snapshot>,
+    /// `(seq, card)` of the last computed snapshot.
+    cache: Cell<(u64, u64)>,
+}
+
+impl HllReader {
+    #[must_use]
+    pub fn count(&self) -> u64 {
+        let (seq, hist, card) = self.snapshot.load();
+        if card != STALE {
+            return card;
+        }
+
+        let (cached_seq, cached_card) = self.cache.get();
+        if cached_seq == seq {
+            return cached_card;
+        }
+
+        let ans = hll_estimate(&hist);
+        self.cache.set((seq, ans));
+        ans
+    }
+}
@@ -1,4 +1,6 @@
-use crate::HyperLogLog;
+use crate::config::{for_each_simd, SimdGuard};
+use crate::{ArenaAlloc, Estimator, HllRepr, MergeScratch};
+use crate::{HllHasher, HyperLogLog, MurmurHash64A, SketchRollup, SlidingHyperLogLog, Xxh3};
 
 #[allow(clippy::cast_precision_loss)]
 #[test]
@@ -33,3 +35,900 @@ fn merge3() {
         assert!(err.abs() < 0.67);
     }
 }
+
+#[test]
+fn count_from_dense() {
+    let cases: &[u64] = if cfg!(miri) {
+        &[0, 10] //
+    } else {
+        &[0, 10, 100, 1000, 10000, 100_000] //
+    };
+
+    for &n in cases {
+        let mut hll = HyperLogLog::new();
+        for i in 1..=n {
+            hll.insert(i.to_string().as_bytes());
+        }
+
+        let expected = hll.count();
+        for_each_simd(|simd| {
+            let count = HyperLogLog::count_from_dense(&hll.registers());
+            assert_eq!(count, expected, "n: {n}, simd: {simd}");
+        });
+    }
+}
+
+#[test]
+fn union_count() {
+    let cases: &[u64] = if cfg!(miri) {
+        &[10] //
+    } else {
+        &[10, 100, 1000, 10000] //
+    };
+
+    for &n in cases {
+        let mut hlls: Vec<HyperLogLog> = (0..4).map(|_| HyperLogLog::new()).collect();
+        for i in 1..=n {
+            for (k, hll) in hlls.iter_mut().enumerate() {
+                // overlapping ranges, plus one empty sketch
+                if k < 3 {
+                    hll.insert((i + k as u64 * n / 2).to_string().as_bytes());
+                }
+            }
+        }
+
+        let sources: Vec<&HyperLogLog> = hlls.iter().collect();
+        let count = HyperLogLog::union_count(&sources);
+
+        let mut hll_merged = HyperLogLog::new();
+        hll_merged.merge(&hlls);
+        assert_eq!(count, hll_merged.count(), "n: {n}");
+
+        assert_eq!(HyperLogLog::union_count(&sources[..0]), 0);
+        assert_eq!(HyperLogLog::union_count(&sources[..1]), hlls[0].count());
+    }
+}
+
+#[allow(clippy::cast_precision_loss)]
+#[test]
+fn joint_count() {
+    let cases: &[(u64, u64, u64)] = if cfg!(miri) {
+        &[(10, 10, 10)] //
+    } else {
+        &[
+            (0, 0, 0),
+            (1000, 0, 0),
+            (0, 0, 1000),
+            (10000, 10000, 10000),
+            (100_000, 20000, 50000),
+            (5000, 50000, 0),
+        ]
+    };
+
+    for &(a_only, b_only, intersection) in cases {
+        let mut hll_a = HyperLogLog::new();
+        let mut hll_b = HyperLogLog::new();
+        for i in 0..a_only {
+            hll_a.insert(format!("a{i}").as_bytes());
+        }
+        for i in 0..b_only {
+            hll_b.insert(format!("b{i}").as_bytes());
+        }
+        for i in 0..intersection {
+            hll_a.insert(format!("x{i}").as_bytes());
+            hll_b.insert(format!("x{i}").as_bytes());
+        }
+
+        let mut results = Vec::new();
+        for_each_simd(|_| {
+            results.push(hll_a.joint_count(&hll_b));
+        });
+        assert_eq!(results[0], results[1]);
+
+        let est = results[0];
+        let union = (a_only + b_only + intersection) as f64;
+        println!("truth: ({a_only}, {b_only}, {intersection}), est: {est:?}");
+
+        let tolerance = (0.02 * union).max(10.0);
+        assert!((est.a_only - a_only as f64).abs() < tolerance);
+        assert!((est.b_only - b_only as f64).abs() < tolerance);
+        assert!((est.intersection - intersection as f64).abs() < tolerance);
+        assert!((est.union() - union).abs() < 0.02 * union + 1.0);
+    }
+}
+
+#[allow(clippy::cast_precision_loss)]
+#[test]
+fn count_mle() {
+    let cases: &[u64] = if cfg!(miri) {
+        &[0, 10] //
+    } else {
+        &[0, 1, 10, 100, 1000, 10000, 100_000] //
+    };
+
+    for &n in cases {
+        let mut hll = HyperLogLog::new();
+        for i in 1..=n {
+            hll.insert(i.to_string().as_bytes());
+        }
+
+        let improved = hll.count_with(Estimator::Improved);
+        let mle = hll.count_with(Estimator::Mle);
+        assert_eq!(improved, hll.count());
+
+        let err = (mle as f64 - n as f64) / (n as f64).max(1.0);
+        println!("n: {n:>6}, improved: {improved:>6}, mle: {mle:>6}, err: {:.6}%", err * 100.0);
+        assert!(err.abs() < 0.02);
+    }
+}
+
+#[test]
+fn count_saturated() {
+    use crate::config::{HLL_CARD_MAX, HLL_REGISTERS};
+
+    // `hash >> HLL_P == 0` sets register `hash` to its maximum
+    let hashes: Vec<u64> = (0..HLL_REGISTERS as u64).collect();
+
+    for repr in [HllRepr::Dense, HllRepr::Nibble] {
+        let mut hll = HyperLogLog::with_repr(MurmurHash64A, repr);
+        hll.insert_hashes(&hashes[1..]);
+        let nearly = hll.count_with(Estimator::Mle);
+        assert!(nearly > 0 && nearly <= HLL_CARD_MAX, "{repr:?}");
+        assert!(hll.count() <= HLL_CARD_MAX, "{repr:?}");
+
+        hll.insert_hashes(&hashes[..1]);
+        for _ in 0..2 {
+            assert_eq!(hll.count(), HLL_CARD_MAX, "{repr:?}");
+            assert_eq!(hll.count_with(Estimator::Mle), HLL_CARD_MAX, "{repr:?}");
+        }
+
+        // the estimate is cached in the Redis header, not marked stale
+        let header = crate::redis::parse_header(&hll.to_redis());
+        assert_eq!(header, Some((0, Some(HLL_CARD_MAX))), "{repr:?}");
+    }
+}
+
+#[allow(clippy::cast_precision_loss)]
+#[test]
+fn xxh3_hasher() {
+    let cases: &[u64] = if cfg!(miri) {
+        &[0, 10] //
+    } else {
+        &[0, 1, 10, 100, 1000, 10000, 100_000] //
+    };
+
+    for &n in cases {
+        let mut hll = HyperLogLog::with_hasher(Xxh3);
+        let mut hll_redis = HyperLogLog::new();
+        for i in 1..=n {
+            let key = format!("key:{i}");
+            hll.insert(key.as_bytes());
+            hll_redis.insert(key.as_bytes());
+        }
+
+        let count = hll.count();
+        let err = (count as f64 - n as f64) / (n as f64).max(1.0);
+        println!("n: {n:>6}, xxh3: {count:>6}, murmur: {:>6}, err: {:.6}%", hll_redis.count(), err * 100.0);
+        assert!(err.abs() < 0.02);
+        if n >= 100 {
+            assert_ne!(hll.registers(), hll_redis.registers());
+        }
+
+        let decoded = HyperLogLog::<Xxh3>::from_compact(&hll.to_compact()).unwrap();
+        assert_eq!(decoded.registers(), hll.registers());
+        assert_eq!(decoded.count(), count);
+        assert!(HyperLogLog::<MurmurHash64A>::from_compact(&hll.to_compact()).is_none());
+    }
+}
+
+#[test]
+fn insert_hashes() {
+    let cases: &[u64] = if cfg!(miri) {
+        &[10, 2000] //
+    } else {
+        &[0, 10, 1000, 2000, 10000, 100_000, 1_000_000] //
+    };
+
+    for &n in cases {
+        let hashes: Vec<u64> = (0..n).map(|i| MurmurHash64A::hash(&i.to_be_bytes())).collect();
+
+        let mut hll = HyperLogLog::new();
+        for i in 0..n {
+            hll.insert(&i.to_be_bytes());
+        }
+
+        for_each_simd(|_| {
+            let mut hll_one = HyperLogLog::new();
+            for &hash in &hashes {
+                hll_one.insert_hash(hash);
+            }
+
+            let mut hll_batch = HyperLogLog::new();
+            assert_eq!(hll_batch.insert_hashes(&hashes), n > 0);
+            assert!(!hll_batch.insert_hashes(&hashes));
+
+            let keys: Vec<[u8; 8]> = (0..n).map(u64::to_be_bytes).collect();
+            let keys: Vec<&[u8]> = keys.iter().map(<[u8; 8]>::as_slice).collect();
+            let mut hll_keys = HyperLogLog::new();
+            hll_keys.insert_many(&keys);
+
+            // later chunks mostly hit the cmin filter
+            let mut hll_chunks = HyperLogLog::new();
+            for chunk in hashes.chunks(3000) {
+                hll_chunks.insert_hashes(chunk);
+            }
+
+            assert_eq!(hll_one.registers(), hll.registers(), "n: {n}");
+            assert_eq!(hll_batch.registers(), hll.registers(), "n: {n}");
+            assert_eq!(hll_chunks.registers(), hll.registers(), "n: {n}");
+            assert_eq!(hll_keys.registers(), hll.registers(), "n: {n}");
+            assert_eq!(hll_batch.count(), hll.count(), "n: {n}");
+            assert_eq!(hll_chunks.count(), hll.count(), "n: {n}");
+        });
+    }
+}
+
+#[test]
+fn shared_reader() {
+    let n: u64 = if cfg!(miri) { 100 } else { 100_000 };
+
+    let (mut writer, reader) = HyperLogLog::new().into_shared();
+    assert_eq!(reader.count(), 0);
+
+    std::thread::scope(|s| {
+        for _ in 0..2 {
+            let reader = reader.clone();
+            s.spawn(move || {
+                let mut last = 0;
+                while last < n * 9 / 10 {
+                    let count = reader.count();
+                    assert!(count <= n * 11 / 10);
+                    last = count;
+                }
+            });
+        }
+
+        for i in 0..n {
+            writer.insert(&i.to_be_bytes());
+        }
+    });
+
+    let mut hll = HyperLogLog::new();
+    for i in 0..n {
+        hll.insert(&i.to_be_bytes());
+    }
+    assert_eq!(reader.count(), hll.count());
+    assert_eq!(writer.count(), hll.count());
+    assert_eq!(writer.reader().count(), hll.count());
+
+    writer.clear();
+    assert_eq!(reader.count(), 0);
+}
+
+#[test]
+fn sliding_window() {
+    let (w, steps, per_bucket): (usize, u64, u64) = if cfg!(miri) { (3, 8, 10) } else { (7, 40, 500) };
+
+    let mut window = SlidingHyperLogLog::new(w);
+    let mut buckets: Vec<HyperLogLog> = Vec::new();
+
+    for t in 0..steps {
+        let mut bucket = HyperLogLog::new();
+        for i in 0..per_bucket {
+            // keys repeat across neighbouring buckets
+            let key = (t / 2 * per_bucket + i).to_be_bytes();
+            window.insert(&key);
+            bucket.insert(&key);
+        }
+        buckets.push(bucket);
+
+        let start = buckets.len().saturating_sub(w);
+        let sources: Vec<&HyperLogLog> = buckets[start..].iter().collect();
+        assert_eq!(window.count(), HyperLogLog::union_count(&sources), "t: {t}");
+
+        window.advance();
+    }
+
+    window.advance_to(steps + w as u64 - 2);
+    let last = buckets.last().unwrap();
+    assert_eq!(window.count(), last.count());
+
+    window.advance_to(steps * 10);
+    assert_eq!(window.count(), 0);
+    window.insert(b"key");
+    assert_eq!(window.count(), 1);
+}
+
+#[test]
+fn rollup() {
+    let (n, per_sketch): (u64, u64) = if cfg!(miri) { (5, 10) } else { (37, 300) };
+
+    let mut rollup = SketchRollup::new();
+    let mut sketches = Vec::new();
+    for t in 0..n {
+        let mut hll = HyperLogLog::new();
+        for i in 0..per_sketch {
+            hll.insert(&(t * per_sketch / 2 + i).to_be_bytes());
+        }
+        let mut copy = HyperLogLog::new();
+        copy.merge(std::slice::from_ref(&hll));
+        sketches.push(copy);
+        rollup.push(hll);
+    }
+
+    let mut late = HyperLogLog::new();
+    late.insert(b"late");
+    rollup.merge_into(3, std::slice::from_ref(&late));
+    sketches[3].merge(std::slice::from_ref(&late));
+
+    let n = sketches.len();
+    assert_eq!(rollup.len(), n);
+    for start in 0..n {
+        for end in start..=n {
+            let sources: Vec<&HyperLogLog> = sketches[start..end].iter().collect();
+            assert_eq!(rollup.count(start..end), HyperLogLog::union_count(&sources), "{start}..{end}");
+        }
+    }
+
+    assert!(rollup.memory_usage() < 2 * n * sketches[0].memory_usage());
+}
+
+#[test]
+fn compact() {
+    let cases: &[u64] = if cfg!(miri) {
+        &[0, 10] //
+    } else {
+        &[0, 1, 100, 10000, 1_000_000] //
+    };
+
+    for &n in cases {
+        let mut hll = HyperLogLog::new();
+        for i in 0..n {
+            hll.insert(&i.to_be_bytes());
+        }
+
+        let mut encoded = Vec::new();
+        for_each_simd(|_| {
+            encoded.push(hll.to_compact());
+        });
+        assert_eq!(encoded[0], encoded[1]);
+        assert!(encoded[0].len() < crate::HLL_DENSE_LEN * 3 / 4, "n: {n}, len: {}", encoded[0].len());
+
+        for_each_simd(|_| {
+            let decoded = HyperLogLog::<MurmurHash64A>::from_compact(&encoded[0]).unwrap();
+            assert_eq!(decoded.registers(), hll.registers(), "n: {n}");
+            assert_eq!(decoded.count(), hll.count(), "n: {n}");
+        });
+
+        let mut bad = encoded[0].clone();
+        bad[0] ^= 1;
+        assert!(HyperLogLog::<MurmurHash64A>::from_compact(&bad).is_none());
+        assert!(HyperLogLog::<MurmurHash64A>::from_compact(&encoded[0][..encoded[0].len() - 1]).is_none());
+        let mut bad = encoded[0].clone();
+        bad[5] = 60;
+        assert!(HyperLogLog::<MurmurHash64A>::from_compact(&bad).is_none());
+
+        // the registers of another hasher are not comparable
+        assert!(HyperLogLog::<Xxh3>::from_compact(&encoded[0]).is_none());
+    }
+}
+
+#[test]
+fn nibble() {
+    let cases: &[u64] = if cfg!(miri) {
+        &[0, 10] //
+    } else {
+        &[0, 1, 100, 10000, 1_000_000] //
+    };
+
+    for_each_simd(|_| {
+        for &n in cases {
+            let mut dense = HyperLogLog::new();
+            let mut nibble = HyperLogLog::with_repr(MurmurHash64A, HllRepr::Nibble);
+            let mut other = HyperLogLog::new();
+            for i in 0..n {
+                dense.insert(&i.to_be_bytes());
+                nibble.insert(&i.to_be_bytes());
+                other.insert(&(i + n / 2).to_be_bytes());
+            }
+
+            assert_eq!(nibble.repr(), HllRepr::Nibble);
+            assert_eq!(nibble.registers(), dense.registers(), "n: {n}");
+            assert_eq!(nibble.count(), dense.count(), "n: {n}");
+            assert_eq!(nibble.count_with(Estimator::Mle), dense.count_with(Estimator::Mle), "n: {n}");
+            assert_eq!(nibble.to_compact(), dense.to_compact(), "n: {n}");
+            assert!(nibble.memory_usage() < dense.memory_usage() * 3 / 4, "n: {n}");
+
+            assert_eq!(
+                HyperLogLog::union_count(&[&nibble, &other]),
+                HyperLogLog::union_count(&[&dense, &other]),
+                "n: {n}"
+            );
+            assert_eq!(nibble.joint_count(&other), dense.joint_count(&other), "n: {n}");
+
+            let mut converted = HyperLogLog::new();
+            converted.merge(std::slice::from_ref(&nibble));
+            converted.set_repr(HllRepr::Nibble);
+            assert_eq!(converted.registers(), dense.registers(), "n: {n}");
+
+            nibble.merge(std::slice::from_ref(&other));
+            dense.merge(std::slice::from_ref(&other));
+            assert_eq!(nibble.registers(), dense.registers(), "n: {n}");
+            assert_eq!(nibble.count(), dense.count(), "n: {n}");
+
+            // inserts after a merge must see the rebuilt overflow table
+            for i in 0..n / 10 {
+                let key = (i + 2 * n).to_be_bytes();
+                assert_eq!(nibble.insert(&key), dense.insert(&key));
+            }
+            assert_eq!(nibble.registers(), dense.registers(), "n: {n}");
+
+            nibble.set_repr(HllRepr::Dense);
+            assert_eq!(nibble.repr(), HllRepr::Dense);
+            assert_eq!(nibble.registers(), dense.registers(), "n: {n}");
+
+            converted.clear();
+            assert_eq!(converted.count(), 0);
+        }
+    });
+}
+
+#[test]
+fn ffi() {
+    use crate::ffi::*;
+
+    let n: u64 = if cfg!(miri) { 100 } else { 10000 };
+    unsafe {
+        let a = hll_create();
+        let b = hll_create();
+        let mut expected = HyperLogLog::new();
+        for i in 0..n {
+            let key = i.to_be_bytes();
+            assert_eq!(hll_insert(a, key.as_ptr(), key.len()), i32::from(expected.insert(&key)));
+        }
+        let hashes: Vec<u64> = (0..n).map(|i| MurmurHash64A::hash(&(i + n).to_be_bytes())).collect();
+        hll_insert_hashes(b, hashes.as_ptr(), hashes.len());
+        assert_eq!(hll_count(a), expected.count());
+
+        let dst = hll_create();
+        hll_merge(dst, [a.cast_const(), b.cast_const()].as_ptr(), 2);
+        assert_eq!(hll_count(dst), hll_union_count([a.cast_const(), b.cast_const()].as_ptr(), 2));
+
+        let len = hll_serialize(dst, std::ptr::null_mut(), 0);
+        let mut buf = vec![0; len];
+        assert_eq!(hll_serialize(dst, buf.as_mut_ptr(), buf.len()), len);
+        let decoded = hll_deserialize(buf.as_ptr(), buf.len());
+        assert!(!decoded.is_null());
+        assert_eq!(hll_count(decoded), hll_count(dst));
+        assert!(hll_deserialize(buf.as_ptr(), len - 1).is_null());
+
+        let mut value = vec![0; hll_to_redis(a, std::ptr::null_mut(), 0)];
+        hll_to_redis(a, value.as_mut_ptr(), value.len());
+        assert_eq!(value, expected.to_redis());
+        let parsed = hll_from_redis(value.as_ptr(), value.len());
+        assert_eq!(hll_count(parsed), expected.count());
+
+        hll_clear(a);
+        assert_eq!(hll_count(a), 0);
+
+        for hll in [a, b, dst, decoded, parsed] {
+            hll_destroy(hll);
+        }
+        hll_destroy(std::ptr::null_mut());
+    }
+}
+
+#[test]
+fn sparse() {
+    use crate::config::HLL_REGISTERS;
+    use crate::redis::{sparse_histogram, sparse_max_into, sparse_to_raw};
+
+    fn decode(sparse: &[u8], simd: bool) -> Option<Vec<u8>> {
+        let _simd = SimdGuard::new(simd);
+        let mut reg_raw = [0xaa; HLL_REGISTERS];
+        sparse_to_raw(&mut reg_raw, sparse).map(|()| reg_raw.to_vec())
+    }
+
+    fn check(sparse: &[u8]) {
+        let expected = decode(sparse, false);
+        assert_eq!(decode(sparse, true), expected, "{sparse:?}");
+
+        let mut hist = [0; 64];
+        let mut acc = [0; HLL_REGISTERS];
+        assert_eq!(sparse_histogram(&mut hist, sparse).is_some(), expected.is_some());
+        assert_eq!(sparse_max_into(&mut acc, sparse).is_some(), expected.is_some());
+        if let Some(reg_raw) = expected {
+            assert_eq!(acc[..], reg_raw[..]);
+            for (v, &h) in hist.iter().enumerate() {
+                assert_eq!(usize::from(h), reg_raw.iter().filter(|&&x| usize::from(x) == v).count());
+            }
+        }
+    }
+
+    let cases: &[u64] = if cfg!(miri) {
+        &[0, 10] //
+    } else {
+        &[0, 1, 10, 100, 1000, 10000, 100_000] //
+    };
+    for &n in cases {
+        let mut hll = HyperLogLog::new();
+        let mut other = HyperLogLog::new();
+        for i in 0..n {
+            hll.insert(&i.to_be_bytes());
+            other.insert(&(i + n / 2).to_be_bytes());
+        }
+
+        let value = hll.to_redis_sparse().unwrap();
+        check(&value[16..]);
+        assert_eq!(HyperLogLog::from_redis(&value).unwrap().registers(), hll.registers(), "n: {n}");
+        assert_eq!(HyperLogLog::count_from_redis(&value), Some(hll.count()), "n: {n}");
+        assert_eq!(HyperLogLog::count_from_redis(&hll.to_redis_sparse().unwrap()), Some(hll.count()));
+
+        let dense = other.to_redis();
+        assert_eq!(
+            HyperLogLog::union_count_redis(&[&value, &dense]),
+            Some(HyperLogLog::union_count(&[&hll, &other])),
+            "n: {n}"
+        );
+    }
+
+    // a run ending at the last register, and runs that overflow or are truncated
+    let mut tail = vec![0x7f, 0xfb, 0x8b];
+    check(&tail);
+    tail.push(0x80);
+    check(&tail);
+    check(&[0x7f, 0xfd, 0x81]);
+    check(&[0x7f, 0xfd, 0x83]);
+    check(&[0x7f, 0xff]);
+    check(&[0x7f, 0xff, 0x80]);
+    check(&[0x7f]);
+    check(&[]);
+
+    // random opcode streams
+    let mut state = 0x9e37_79b9_7f4a_7c15_u64;
+    let mut next = || {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        state
+    };
+    let rounds = if cfg!(miri) { 4 } else { 2000 };
+    for _ in 0..rounds {
+        let mut sparse = Vec::new();
+        let mut idx = 0;
+        while idx < HLL_REGISTERS {
+            let r = next();
+            #[allow(clippy::cast_possible_truncation)]
+            let (ops, len) = match r % 8 {
+                0 => (vec![(r >> 8) as u8 & 0x3f], (r >> 8) as usize % 64 + 1),
+                1 => {
+                    let len = (r >> 8) as usize % 4096;
+                    (vec![0x40 | (len >> 8) as u8, len as u8], len + 1)
+                }
+                _ => (vec![0x80 | (r >> 8) as u8 & 0x7f], (r >> 8) as usize % 4 + 1),
+            };
+            sparse.extend_from_slice(&ops);
+            idx += len;
+        }
+        // drop the last opcode half of the time, so both complete and short streams are checked
+        if next() % 2 == 0 {
+            sparse.pop();
+        }
+        check(&sparse);
+    }
+}
+
+#[test]
+fn merge_redis() {
+    let (sketches, per_sketch): (u64, u64) = if cfg!(miri) { (3, 10) } else { (200, 50) };
+    for repr in [HllRepr::Dense, HllRepr::Nibble] {
+        let mut hll = HyperLogLog::with_repr(MurmurHash64A, repr);
+        let mut expected = HyperLogLog::new();
+        for i in 0u64..20_000 {
+            hll.insert(&i.to_be_bytes());
+            expected.insert(&i.to_be_bytes());
+        }
+
+        let mut values = Vec::new();
+        let mut sources = Vec::new();
+        for s in 0..sketches {
+            let mut small = HyperLogLog::new();
+            for i in 0..per_sketch {
+                small.insert(&(1_000_000 * s + i).to_be_bytes());
+            }
+            values.push(small.to_redis_sparse().unwrap());
+            sources.push(small);
+        }
+        values.push(sources[0].to_redis());
+        expected.merge(&sources);
+
+        let values: Vec<&[u8]> = values.iter().map(Vec::as_slice).collect();
+        assert_eq!(hll.merge_redis(&values), Some(()));
+        assert_eq!(hll.repr(), repr);
+        assert_eq!(hll.registers(), expected.registers(), "{repr:?}");
+        assert_eq!(hll.histogram(), expected.histogram(), "{repr:?}");
+        assert_eq!(hll.count(), expected.count(), "{repr:?}");
+
+        // a corrupted value leaves the sketch unchanged
+        let mut corrupted = values[0].to_vec();
+        corrupted.pop();
+        assert_eq!(hll.merge_redis(&[values[1], &corrupted]), None);
+        assert_eq!(hll.registers(), expected.registers(), "{repr:?}");
+    }
+}
+
+#[test]
+fn count_many() {
+    let mut hlls = Vec::new();
+    for i in 0u64..if cfg!(miri) { 7 } else { 103 } {
+        let repr = if i % 3 == 0 { HllRepr::Nibble } else { HllRepr::Dense };
+        let mut hll = HyperLogLog::with_repr(MurmurHash64A, repr);
+        for j in 0..i * i {
+            hll.insert(&(j * 7919 + i).to_be_bytes());
+        }
+        hlls.push(hll);
+    }
+
+    for_each_simd(|simd| {
+        let sources: Vec<&HyperLogLog> = hlls.iter().collect();
+        // recomputes the stale counts, then returns the cached ones
+        for _ in 0..2 {
+            let expected: Vec<u64> = hlls.iter().map(|hll| hll.count_with(Estimator::Improved)).collect();
+            assert_eq!(HyperLogLog::count_many(&sources), expected, "simd: {simd}");
+            assert_eq!(HyperLogLog::count_many_par(&sources), expected, "simd: {simd}");
+            let cached: Vec<u64> = hlls.iter().map(HyperLogLog::count).collect();
+            assert_eq!(cached, expected);
+        }
+        for (i, hll) in hlls.iter_mut().enumerate() {
+            hll.insert(&i.to_be_bytes());
+        }
+    });
+    assert_eq!(HyperLogLog::<MurmurHash64A>::count_many(&[]), Vec::<u64>::new());
+}
+
+#[test]
+fn column() {
+    use crate::HllColumn;
+
+    let (groups, keys) = if cfg!(miri) { (5, 50) } else { (64, 20_000) };
+    let mut column = HllColumn::new(groups);
+    let mut hlls: Vec<HyperLogLog> = (0..groups).map(|_| HyperLogLog::new()).collect();
+    for k in 0u64..keys {
+        // skewed group sizes, with some groups left empty
+        #[allow(clippy::cast_possible_truncation)]
+        let g = (k * k % 1_000_003) as usize % groups;
+        if g % 7 == 3 {
+            continue;
+        }
+        assert_eq!(column.insert(g, &k.to_be_bytes()), hlls[g].insert(&k.to_be_bytes()));
+    }
+    for (g, hll) in hlls.iter().enumerate() {
+        assert_eq!(column.registers(g), &*hll.registers(), "group {g}");
+    }
+    let expected: Vec<u64> = hlls.iter().map(HyperLogLog::count).collect();
+    assert_eq!(column.count_all(), expected);
+    assert_eq!((0..groups).map(|g| column.count(g)).collect::<Vec<_>>(), expected);
+
+    let gather = [1, 3, 4, groups - 1, 1];
+    let refs: Vec<&HyperLogLog> = gather.iter().map(|&g| &hlls[g]).collect();
+    assert_eq!(column.union_count(&gather), HyperLogLog::union_count(&refs));
+
+    let mut union = HyperLogLog::new();
+    for &g in &gather {
+        union.merge(&[HyperLogLog::from_redis(&hlls[g].to_redis()).unwrap()]);
+    }
+    union.merge(&[HyperLogLog::from_redis(&hlls[2].to_redis()).unwrap()]);
+    column.merge_gather(2, &gather);
+    assert_eq!(column.registers(2), &*union.registers());
+    assert_eq!(column.count(2), union.count());
+
+    column.merge_into(0, 3);
+    let src = HyperLogLog::from_redis(&hlls[0].to_redis()).unwrap();
+    hlls[3].merge(&[src]);
+    assert_eq!(column.registers(3), &*hlls[3].registers());
+    assert_eq!(column.count_all()[3], hlls[3].count());
+
+    // sketch 0 is first in the slab: merging it must not read before the allocation
+    assert_ne!(column.count(0), 0);
+    assert_eq!(column.union_count(&[0]), hlls[0].count());
+    column.merge_into(1, 0);
+    let src = HyperLogLog::from_redis(&hlls[1].to_redis()).unwrap();
+    hlls[0].merge(&[src]);
+    assert_eq!(column.registers(0), &*hlls[0].registers());
+    assert_eq!(column.count(0), hlls[0].count());
+
+    // merged sketches keep inserting correctly
+    column.insert(2, b"x");
+    union.insert(b"x");
+    assert_eq!(column.count(2), union.count());
+
+    column.clear(2);
+    assert_eq!(column.count(2), 0);
+    assert!(column.registers(2).iter().all(|&b| b == 0));
+    assert_eq!(HllColumn::new(0).count_all(), Vec::<u64>::new());
+}
+
+#[test]
+fn insert_grouped() {
+    use crate::HllColumn;
+
+    let (groups, keys): (usize, u64) = if cfg!(miri) { (3, 200) } else { (300, 200_000) };
+    let mut grouped = HllColumn::new(groups);
+    let mut expected = HllColumn::new(groups);
+
+    let mut state = 0x2545_f491_4f6c_dd1d_u64;
+    let mut next = || {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        state
+    };
+    for round in 0..3 {
+        #[allow(clippy::cast_possible_truncation)]
+        let group_of: Vec<usize> = (0..keys)
+            .map(|_| {
+                // half of the elements go to a few hot groups
+                let r = next();
+                if r % 2 == 0 {
+                    (r >> 8) as usize % 4
+                } else {
+                    (r >> 8) as usize % groups
+                }
+            })
+            .collect();
+        let values: Vec<[u8; 8]> = (0..keys).map(|k| (k % (keys / 3) + round).to_be_bytes()).collect();
+        let values: Vec<&[u8]> = values.iter().map(<[u8; 8]>::as_slice).collect();
+
+        let mut updated = false;
+        for (&g, v) in group_of.iter().zip(&values) {
+            updated |= expected.insert(g, v);
+        }
+        assert_eq!(grouped.insert_grouped(&group_of, &values), updated);
+        for g in 0..groups {
+            assert_eq!(grouped.registers(g), expected.registers(g), "group {g}");
+        }
+        assert_eq!(grouped.count_all(), expected.count_all());
+    }
+    assert!(!grouped.insert_grouped(&[], &[]));
+}
+
+#[test]
+fn column_huge_pages() {
+    use crate::HllColumn;
+
+    let (groups, keys): (usize, u64) = if cfg!(miri) { (3, 100) } else { (40, 20_000) };
+    for_each_simd(|simd| {
+        let mut huge = HllColumn::with_alloc(MurmurHash64A, groups, ArenaAlloc::HugePages);
+        let mut expected = HllColumn::new(groups);
+        for k in 0..keys {
+            #[allow(clippy::cast_possible_truncation)]
+            let g = (k % groups as u64) as usize;
+            assert_eq!(huge.insert(g, &k.to_be_bytes()), expected.insert(g, &k.to_be_bytes()));
+        }
+        // sketch 0 is first in the mapping: merging it must not read before it
+        for column in [&mut huge, &mut expected] {
+            column.merge_into(0, 1);
+            column.merge_gather(0, &[2, groups - 1]);
+        }
+        for g in 0..groups {
+            assert_eq!(huge.registers(g), expected.registers(g), "group {g}, simd: {simd}");
+        }
+        assert_eq!(huge.count_all(), expected.count_all(), "simd: {simd}");
+        assert_eq!(huge.union_count(&[0, 1]), expected.union_count(&[0, 1]), "simd: {simd}");
+        assert_ne!(huge.count(0), 0);
+    });
+}
+
+#[test]
+fn merge_streaming() {
+    use crate::config::HLL_REGISTERS;
+    use crate::dense::{compress, compress_nt, DENSE_REGISTERS_LEN, HLL_DENSE_LEN};
+
+    let n: u64 = if cfg!(miri) { 100 } else { 50_000 };
+    for_each_simd(|simd| {
+        // every register value, at both alignments of the destination
+        #[allow(clippy::cast_possible_truncation)]
+        let reg_raw: Vec<u8> = (0..HLL_REGISTERS).map(|i| (i * 7 % 64) as u8).collect();
+        let mut expected = vec![0; DENSE_REGISTERS_LEN];
+        unsafe { compress(expected.as_mut_ptr(), reg_raw.as_ptr()) };
+        let mut buf = vec![0u8; DENSE_REGISTERS_LEN + 32];
+        let aligned = buf.as_ptr().align_offset(16);
+        for offset in [aligned, aligned + 4] {
+            buf.fill(0xff);
+            unsafe { compress_nt(buf.as_mut_ptr().add(offset), reg_raw.as_ptr()) };
+            assert_eq!(buf[offset..offset + HLL_DENSE_LEN], expected[..HLL_DENSE_LEN], "simd: {simd}");
+        }
+
+        for repr in [HllRepr::Dense, HllRepr::Nibble] {
+            let mut sources = Vec::new();
+            for s in 0..3 {
+                let mut hll = HyperLogLog::with_repr(MurmurHash64A, repr);
+                for i in 0..n {
+                    hll.insert(&(i * 3 + s).to_be_bytes());
+                }
+                sources.push(hll);
+            }
+            let mut merged = HyperLogLog::with_repr(MurmurHash64A, repr);
+            let mut streamed = HyperLogLog::with_repr(MurmurHash64A, repr);
+            merged.insert(b"dst");
+            streamed.insert(b"dst");
+            merged.merge(&sources);
+            streamed.merge_streaming(&sources);
+            assert_eq!(streamed.registers(), merged.registers(), "{repr:?}, simd: {simd}");
+            assert_eq!(streamed.histogram(), merged.histogram(), "{repr:?}, simd: {simd}");
+            assert_eq!(streamed.count(), merged.count(), "{repr:?}, simd: {simd}");
+        }
+    });
+}
+
+#[test]
+fn merge_with_scratch() {
+    let n: u64 = if cfg!(miri) { 100 } else { 10_000 };
+    // a dirty scratch must not leak into the result
+    let mut scratch = MergeScratch::new();
+    unsafe { scratch.as_mut_ptr().write_bytes(63, crate::config::HLL_REGISTERS) };
+
+    for repr in [HllRepr::Dense, HllRepr::Nibble] {
+        let sketch = |ranges: &[std::ops::Range<u64>]| {
+            let mut hll = HyperLogLog::with_repr(MurmurHash64A, repr);
+            for i in ranges.iter().cloned().flatten() {
+                hll.insert(&i.to_be_bytes());
+            }
+            hll
+        };
+        let ranges = [0..n, 0..0, n / 2..2 * n];
+        let sources = ranges.clone().map(|r| sketch(&[r]));
+
+        // empty and non-empty destinations, with the first source empty or not
+        for dst_keys in [0..0, 3 * n..3 * n + 10] {
+            for k in 0..=ranges.len() {
+                let mut dst = sketch(std::slice::from_ref(&dst_keys));
+                dst.merge_with_scratch(&sources[k..], &mut scratch);
+
+                let mut all = vec![dst_keys.clone()];
+                all.extend_from_slice(&ranges[k..]);
+                let expected = sketch(&all);
+                assert_eq!(dst.registers(), expected.registers(), "{repr:?}, {k}");
+                assert_eq!(dst.count(), expected.count(), "{repr:?}, {k}");
+            }
+        }
+    }
+}
+
+#[test]
+fn differential() {
+    use crate::fuzzing::{check_kernels, check_pipeline};
+
+    // every fill, aligned and misaligned, short and long inputs
+    let mut state = 0x853c_49e6_748f_ea9b_u64;
+    let mut inputs: Vec<Vec<u8>> = Vec::new();
+    for fill in 0..4 {
+        for misalign in [0, 1, 16, 33, 63] {
+            for len in [0, 1, 7, 100, 4099] {
+                let mut data = vec![fill, misalign];
+                data.extend((0..len).map(|_| {
+                    state ^= state << 13;
+                    state ^= state >> 7;
+                    state ^= state << 17;
+                    state.to_le_bytes()[0]
+                }));
+                inputs.push(data);
+            }
+        }
+    }
+    // edge hashes: the lowest and highest index, the longest run of zeros
+    let mut edges = vec![1, 0];
+    for hash in [0, u64::MAX, 1 << 63, (1 << 14) - 1, 1 << 14] {
+        edges.extend_from_slice(&hash.to_le_bytes());
+    }
+    inputs.push(edges);
+
+    let step = if cfg!(miri) { 37 } else { 1 };
+    for data in inputs.iter().step_by(step) {
+        check_kernels(data);
+        // the pipeline does not depend on the alignment
+        if data[1] == 0 {
+            check_pipeline(data);
+        }
+    }
+}
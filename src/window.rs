@@ -0,0 +1,123 @@
+//! A sliding-window `HyperLogLog` over the last `W` buckets (e.g. minutes).
+//!
+//! The buckets live in a ring of `W` sketches, processed in blocks of `W` buckets.
+//! When a block is complete, its ring slots are folded in place into suffix unions,
+//! and the buckets of the next block are folded into one running prefix union.
+//! Any window then covers a suffix of the previous block, a prefix of the current one
+//! and the live bucket, so a windowed count reads at most three sketches regardless of `W`.
+
+use crate::{HllHasher, HyperLogLog, MurmurHash64A};
+
+pub struct SlidingHyperLogLog<H = MurmurHash64A> {
+    /// Slots `..pos` hold buckets of the current block, slot `pos` is the live bucket,
+    /// and slot `i > pos` holds the union of buckets `i..W` of the previous block.
+    slots: Vec<HyperLogLog<H>>,
+    /// Union of slots `..pos`.
+    prefix: HyperLogLog<H>,
+    pos: usize,
+    bucket: u64,
+}
+
+impl SlidingHyperLogLog {
+    /// Creates a window of `buckets` buckets, including the live one.
+    #[must_use]
+    pub fn new(buckets: usize) -> Self {
+        Self::with_hasher(buckets, MurmurHash64A)
+    }
+}
+
+impl<H: HllHasher + Copy> SlidingHyperLogLog<H> {
+    #[must_use]
+    pub fn with_hasher(buckets: usize, hasher: H) -> Self {
+        assert!(buckets > 0);
+        Self {
+            slots: (0..buckets).map(|_| HyperLogLog::with_hasher(hasher)).collect(),
+            prefix: HyperLogLog::with_hasher(hasher),
+            pos: 0,
+            bucket: 0,
+        }
+    }
+}
+
+impl<H: HllHasher> SlidingHyperLogLog<H> {
+    /// Returns the number of buckets in the window.
+    #[must_use]
+    pub fn buckets(&self) -> usize {
+        self.slots.len()
+    }
+
+    /// Returns the index of the live bucket.
+    #[must_use]
+    pub fn bucket(&self) -> u64 {
+        self.bucket
+    }
+
+    pub fn insert(&mut self, key: &[u8]) -> bool {
+        self.slots[self.pos].insert(key)
+    }
+
+    pub fn insert_hash(&mut self, hash: u64) -> bool {
+        self.slots[self.pos].insert_hash(hash)
+    }
+
+    pub fn insert_hashes(&mut self, hashes: &[u64]) -> bool {
+        self.slots[self.pos].insert_hashes(hashes)
+    }
+
+    /// Estimates the cardinality of the last `buckets()` buckets, including the live one.
+    #[must_use]
+    pub fn count(&self) -> u64 {
+        let live = &self.slots[self.pos];
+        match self.slots.get(self.pos + 1) {
+            Some(suffix) => HyperLogLog::union_count(&[suffix, &self.prefix, live]),
+            None => HyperLogLog::union_count(&[&self.prefix, live]),
+        }
+    }
+
+    /// Starts a new live bucket. The oldest bucket leaves the window.
+    ///
+    /// Costs one merge, plus `W - 1` merges once every `W` calls when a block is complete.
+    pub fn advance(&mut self) {
+        let w = self.slots.len();
+
+        self.prefix.merge(std::slice::from_ref(&self.slots[self.pos]));
+        self.pos += 1;
+        self.bucket += 1;
+
+        if self.pos == w {
+            for i in (0..w - 1).rev() {
+                let (head, tail) = self.slots.split_at_mut(i + 1);
+                head[i].merge(&tail[..1]);
+            }
+            self.prefix.clear();
+            self.pos = 0;
+        }
+
+        self.slots[self.pos].clear();
+    }
+
+    /// Advances until `bucket` is the live bucket. Earlier buckets are ignored.
+    pub fn advance_to(&mut self, bucket: u64) {
+        if bucket <= self.bucket {
+            return;
+        }
+
+        let w = self.slots.len() as u64;
+        if bucket - self.bucket >= 2 * w {
+            // nothing of the current window survives
+            for slot in &mut self.slots {
+                slot.clear();
+            }
+            self.prefix.clear();
+            #[allow(clippy::cast_possible_truncation)]
+            let pos = (bucket % w) as usize;
+            self.pos = pos;
+            self.bucket = bucket;
+            return;
+        }
+
+        while self.bucket < bucket {
+            self.advance();
+        }
+    }
+}